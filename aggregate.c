@@ -0,0 +1,270 @@
+/*
+  +----------------------------------------------------------------------+
+  | Memprof                                                              |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2012-2013 Arnaud Le Blanc                              |
+  +----------------------------------------------------------------------+
+  | Redistribution and use in source and binary forms, with or without   |
+  | modification, are permitted provided that the conditions mentioned   |
+  | in the accompanying LICENSE file are met.                            |
+  +----------------------------------------------------------------------+
+  | Author: Arnaud Le Blanc <arnaud.lb@gmail.com>                        |
+  +----------------------------------------------------------------------+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php.h"
+#include "aggregate.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define ALIGN8(size) (((size) + 7) & ~(size_t)7)
+
+static size_t aggregate_slots_offset()
+{
+	return ALIGN8(sizeof(aggregate_header));
+}
+
+static size_t aggregate_nodes_offset(const aggregate_header * h)
+{
+	return aggregate_slots_offset() + ALIGN8((size_t) h->slots_cap * sizeof(uint32_t));
+}
+
+static size_t aggregate_names_offset(const aggregate_header * h)
+{
+	return aggregate_nodes_offset(h) + (size_t) h->nodes_cap * sizeof(aggregate_node);
+}
+
+static size_t aggregate_size(const aggregate_header * h)
+{
+	return aggregate_names_offset(h) + h->names_cap;
+}
+
+static void aggregate_header_init(aggregate_header * h, uint32_t nodes)
+{
+	uint32_t slots = 1;
+
+	if (nodes < 2) {
+		nodes = 2;
+	}
+	if (nodes > UINT32_MAX / AGGREGATE_NAME_SIZE) {
+		nodes = UINT32_MAX / AGGREGATE_NAME_SIZE;
+	}
+
+	while (slots < nodes && slots < (UINT32_C(1) << 31)) {
+		slots <<= 1;
+	}
+
+	memset(h, 0, sizeof(*h));
+	h->version = AGGREGATE_VERSION;
+	h->nodes_cap = nodes;
+	h->slots_cap = slots;
+	h->names_cap = nodes * AGGREGATE_NAME_SIZE;
+}
+
+static void aggregate_map(memprof_aggregate * agg, void * map, size_t size)
+{
+	agg->header = (aggregate_header *) map;
+	agg->slots = (uint32_t *) ((char *) map + aggregate_slots_offset());
+	agg->nodes = (aggregate_node *) ((char *) map + aggregate_nodes_offset(agg->header));
+	agg->names = (char *) map + aggregate_names_offset(agg->header);
+	agg->map_size = size;
+}
+
+/* Opens the store at path, creating it with room for the given number of
+ * nodes if it doesn't exist. The size of an existing store is kept. */
+memprof_aggregate * aggregate_open(const char * path, uint32_t nodes)
+{
+	memprof_aggregate * agg = NULL;
+	aggregate_header h;
+	struct stat st;
+	void * map = MAP_FAILED;
+	size_t size = 0;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	/* Serializes the creation of the store */
+	if (flock(fd, LOCK_EX) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		goto out;
+	}
+
+	if (st.st_size == 0) {
+		aggregate_header_init(&h, nodes);
+		size = aggregate_size(&h);
+		if (ftruncate(fd, size) != 0) {
+			goto out;
+		}
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			goto out;
+		}
+		/* The file is zero filled. Node 0 is the root, its name is empty. */
+		memcpy(map, &h, sizeof(h));
+		((aggregate_header *) map)->nodes_used = 1;
+		((aggregate_header *) map)->names_used = 1;
+		__atomic_store_n(&((aggregate_header *) map)->magic, AGGREGATE_MAGIC, __ATOMIC_RELEASE);
+	} else {
+		if ((size_t) st.st_size < sizeof(h) || pread(fd, &h, sizeof(h), 0) != sizeof(h)) {
+			goto out;
+		}
+		if (h.magic != AGGREGATE_MAGIC || h.version != AGGREGATE_VERSION) {
+			goto out;
+		}
+		size = aggregate_size(&h);
+		if ((size_t) st.st_size != size || h.slots_cap == 0 || (h.slots_cap & (h.slots_cap - 1)) != 0) {
+			goto out;
+		}
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			goto out;
+		}
+	}
+
+	agg = malloc(sizeof(*agg));
+	if (agg == NULL) {
+		munmap(map, size);
+		goto out;
+	}
+
+	aggregate_map(agg, map, size);
+
+out:
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	return agg;
+}
+
+void aggregate_close(memprof_aggregate * agg)
+{
+	munmap(agg->header, agg->map_size);
+	free(agg);
+}
+
+static uint32_t aggregate_hash(uint32_t parent, const char * name, size_t name_len)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u ^ parent;
+	size_t i;
+
+	for (i = 0; i < name_len; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* Reserves n items of a shared area. Fails when the area is full. */
+static zend_bool aggregate_reserve(uint32_t * used, uint32_t cap, uint32_t n, uint32_t * offset)
+{
+	uint32_t cur = __atomic_load_n(used, __ATOMIC_RELAXED);
+
+	do {
+		if (cur > cap || n > cap - cur) {
+			return 0;
+		}
+	} while (!__atomic_compare_exchange_n(used, &cur, cur + n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	*offset = cur;
+
+	return 1;
+}
+
+/* Looks for (parent, name) in the hash chain, from index to stop */
+static uint32_t aggregate_find(memprof_aggregate * agg, uint32_t index, uint32_t stop, uint32_t parent, const char * name, size_t name_len)
+{
+	uint32_t nodes_cap = agg->header->nodes_cap;
+
+	while (index != stop && index < nodes_cap) {
+		aggregate_node * n = &agg->nodes[index];
+		if (n->parent == parent && n->name_len == name_len && memcmp(agg->names + n->name_off, name, name_len) == 0) {
+			return index;
+		}
+		index = n->next;
+	}
+
+	return AGGREGATE_NONE;
+}
+
+/* Returns the index of the child of parent with the given name, creating it
+ * if needed. Returns AGGREGATE_NONE when the store is full. */
+uint32_t aggregate_child(memprof_aggregate * agg, uint32_t parent, const char * name, size_t name_len)
+{
+	aggregate_header * h = agg->header;
+	uint32_t * slot = &agg->slots[aggregate_hash(parent, name, name_len) & (h->slots_cap - 1)];
+	uint32_t head = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	uint32_t stop = 0;
+	uint32_t index = AGGREGATE_NONE;
+	uint32_t name_off;
+	aggregate_node * n = NULL;
+
+	for (;;) {
+		uint32_t found = aggregate_find(agg, head, stop, parent, name, name_len);
+		if (found != AGGREGATE_NONE) {
+			/* If we reserved a node, it's lost. This is rare enough. */
+			return found;
+		}
+
+		if (n == NULL) {
+			if (name_len >= h->names_cap) {
+				return AGGREGATE_NONE;
+			}
+			if (!aggregate_reserve(&h->nodes_used, h->nodes_cap, 1, &index)) {
+				return AGGREGATE_NONE;
+			}
+			if (!aggregate_reserve(&h->names_used, h->names_cap, name_len + 1, &name_off)) {
+				return AGGREGATE_NONE;
+			}
+			memcpy(agg->names + name_off, name, name_len);
+			agg->names[name_off + name_len] = '\0';
+
+			n = &agg->nodes[index];
+			n->parent = parent;
+			n->name_off = name_off;
+			n->name_len = name_len;
+		}
+
+		n->next = head;
+
+		if (__atomic_compare_exchange_n(slot, &head, index, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&n->ready, 1, __ATOMIC_RELEASE);
+			return index;
+		}
+
+		/* Other nodes were inserted in the chain in the meantime. Only
+		 * these need to be checked again. */
+		stop = n->next;
+	}
+}
+
+void aggregate_add(memprof_aggregate * agg, uint32_t node, uint64_t calls, uint64_t self_size, uint64_t self_count)
+{
+	aggregate_node * n = &agg->nodes[node];
+
+	if (calls) {
+		__atomic_fetch_add(&n->calls, calls, __ATOMIC_RELAXED);
+	}
+	if (self_size) {
+		__atomic_fetch_add(&n->self_size, self_size, __ATOMIC_RELAXED);
+	}
+	if (self_count) {
+		__atomic_fetch_add(&n->self_count, self_count, __ATOMIC_RELAXED);
+	}
+}
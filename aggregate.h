@@ -0,0 +1,72 @@
+/*
+  +----------------------------------------------------------------------+
+  | Memprof                                                              |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2012-2013 Arnaud Le Blanc                              |
+  +----------------------------------------------------------------------+
+  | Redistribution and use in source and binary forms, with or without   |
+  | modification, are permitted provided that the conditions mentioned   |
+  | in the accompanying LICENSE file are met.                            |
+  +----------------------------------------------------------------------+
+  | Author: Arnaud Le Blanc <arnaud.lb@gmail.com>                        |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef MEMPROF_AGGREGATE_H
+#define MEMPROF_AGGREGATE_H
+
+#include <stdint.h>
+
+#define AGGREGATE_MAGIC 0x4741504d /* "MPAG" */
+#define AGGREGATE_VERSION 1
+
+/* The root node always exists */
+#define AGGREGATE_ROOT 0
+#define AGGREGATE_NONE ((uint32_t) -1)
+
+/* Average name length the names area is sized for */
+#define AGGREGATE_NAME_SIZE 32
+
+/* The store is a call tree in a memory mapped file, shared by all the
+ * processes that map it. Nodes and names are never freed: they are reserved
+ * by atomically incrementing the used counters, and a node is published by
+ * atomically linking it in a hash chain keyed by (parent, name). Counters
+ * are updated with atomic adds, so no lock is taken after the file is
+ * created. */
+typedef struct _aggregate_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nodes_cap;
+	uint32_t nodes_used;
+	uint32_t slots_cap;		/* power of two */
+	uint32_t names_cap;
+	uint32_t names_used;
+	uint32_t pad;
+} aggregate_header;
+
+typedef struct _aggregate_node {
+	uint32_t parent;
+	uint32_t next;			/* next node in the same hash chain, or 0 */
+	uint32_t name_off;		/* NUL terminated */
+	uint32_t name_len;
+	uint32_t ready;			/* set once the node is published */
+	uint32_t pad;
+	uint64_t calls;
+	uint64_t self_size;
+	uint64_t self_count;
+} aggregate_node;
+
+typedef struct _memprof_aggregate {
+	aggregate_header * header;
+	uint32_t * slots;
+	aggregate_node * nodes;
+	char * names;
+	size_t map_size;
+} memprof_aggregate;
+
+memprof_aggregate * aggregate_open(const char * path, uint32_t nodes);
+void aggregate_close(memprof_aggregate * agg);
+uint32_t aggregate_child(memprof_aggregate * agg, uint32_t parent, const char * name, size_t name_len);
+void aggregate_add(memprof_aggregate * agg, uint32_t node, uint64_t calls, uint64_t self_size, uint64_t self_count);
+
+#endif /* MEMPROF_AGGREGATE_H */
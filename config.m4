@@ -6,6 +6,9 @@ PHP_ARG_ENABLE(memprof, whether to enable memprof support,
 PHP_ARG_WITH(judy-dir, for judy lib,
  [  --with-judy-dir         Specify judy dir])
 
+PHP_ARG_WITH(memprof-zstd, for zstd support in memprof,
+ [  --with-memprof-zstd     Enable zstd compression of memprof dumps], no, no)
+
 AC_ARG_ENABLE(memprof-debug,
 [  --enable-memprof-debug   Enable memprof debugging],[
   PHP_MEMPROF_DEBUG=$enableval
@@ -49,6 +52,28 @@ if test "$PHP_MEMPROF" != "no"; then
     -L$JUDY_DIR/$PHP_LIBDIR -lJudy
   ])
   dnl
+
+  PHP_CHECK_LIBRARY(z, deflateInit2_,
+  [
+    PHP_ADD_LIBRARY(z, 1, MEMPROF_SHARED_LIBADD)
+    AC_DEFINE([HAVE_MEMPROF_ZLIB], 1, [Define to 1 if zlib is available])
+  ],[
+    AC_DEFINE([HAVE_MEMPROF_ZLIB], 0, [Define to 1 if zlib is available])
+    AC_MSG_WARN([zlib not found, gzip compression of dumps will not be available])
+  ])
+
+  if test "$PHP_MEMPROF_ZSTD" != "no"; then
+    PHP_CHECK_LIBRARY(zstd, ZSTD_compressStream2,
+    [
+      PHP_ADD_LIBRARY(zstd, 1, MEMPROF_SHARED_LIBADD)
+      AC_DEFINE([HAVE_MEMPROF_ZSTD], 1, [Define to 1 if zstd is available])
+    ],[
+      AC_MSG_ERROR([zstd >= 1.4.0 not found])
+    ])
+  else
+    AC_DEFINE([HAVE_MEMPROF_ZSTD], 0, [Define to 1 if zstd is available])
+  fi
+
   PHP_SUBST(MEMPROF_SHARED_LIBADD)
 
   ORIG_CFLAGS="$CFLAGS"
@@ -76,9 +101,9 @@ if test "$PHP_MEMPROF" != "no"; then
 
   CFLAGS="$ORIG_CFLAGS"
 
-  AC_DEFINE([MEMPROF_CONFIGURE_VERSION], 3, [Define configure version])
+  AC_DEFINE([MEMPROF_CONFIGURE_VERSION], 4, [Define configure version])
 
-  PHP_NEW_EXTENSION(memprof, memprof.c util.c, $ext_shared)
+  PHP_NEW_EXTENSION(memprof, memprof.c util.c writer.c aggregate.c snapshot.c trace.c, $ext_shared)
 fi
 
 if test "$PHP_MEMPROF_DEBUG" != "no"; then
@@ -23,9 +23,22 @@
 #include "php_memprof.h"
 #include "zend_extensions.h"
 #include "zend_exceptions.h"
+#include "zend_smart_str.h"
+#if PHP_VERSION_ID >= 80100
+#	include "zend_fibers.h"
+#	include "zend_observer.h"
+#endif
 #include <stdint.h>
-#include <sys/queue.h>
+#include <errno.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "util.h"
+#include "writer.h"
+#include "aggregate.h"
+#include "snapshot.h"
+#include "trace.h"
 #include <Judy.h>
 #if MEMPROF_DEBUG
 #	undef NDEBUG
@@ -41,10 +54,11 @@
 #define MEMPROF_ENV_PROFILE "MEMPROF_PROFILE"
 #define MEMPROF_FLAG_NATIVE "native"
 #define MEMPROF_FLAG_DUMP_ON_LIMIT "dump_on_limit"
+#define MEMPROF_FLAG_TRACE "trace"
 
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 
-#if MEMPROF_CONFIGURE_VERSION != 3
+#if MEMPROF_CONFIGURE_VERSION != 4
 #	error Please rebuild configure (run phpize and reconfigure)
 #endif
 
@@ -136,7 +150,22 @@
 
 #define MEMORY_LIMIT_ERROR_PREFIX "Allowed memory size of"
 
-typedef LIST_HEAD(_alloc_list_head, _alloc) alloc_list_head;
+/* Check the cgroup memory usage at most once per this many allocated bytes */
+#define CGROUP_CHECK_BYTES (1<<20)
+
+/* Check whether memprof.delta_interval elapsed once per this many calls */
+#define DELTA_CHECK_CALLS 1024
+
+/* Longest call path written by folded autodumps, and longest error message
+ * of autodumps on the memory limit */
+#define AUTODUMP_PATH_SIZE (64*1024)
+#define AUTODUMP_MESSAGE_SIZE 4096
+
+#if PHP_VERSION_ID >= 80200
+#	define MEMPROF_VM_INTERRUPT() zend_atomic_bool_store_ex(&EG(vm_interrupt), true)
+#else
+#	define MEMPROF_VM_INTERRUPT() (EG(vm_interrupt) = 1)
+#endif
 
 /* a call frame */
 typedef struct _frame {
@@ -145,16 +174,40 @@ typedef struct _frame {
 	struct _frame * prev;
 	size_t calls;
 	HashTable next_cache;
-	alloc_list_head allocs;
+	size_t self_size;	/* size of the live blocks allocated by this frame */
+	size_t self_count;	/* number of live blocks allocated by this frame */
+	size_t peak_self_size;	/* highest self_size */
+	size_t peak_size;	/* highest growth of the inclusive size during a call */
+	uint32_t peak_entry;	/* 1 + index of the frame's latest entry in
+							 * peak_stack, 0 if the frame is not active */
+	uint32_t delta_id;		/* 1 + id of the frame in the timeline, 0 if it
+							 * has not been written yet */
+	uint32_t delta_epoch;	/* delta_epoch when the frame last changed */
+	uint32_t trace_id;		/* id of the frame in the trace, 0 if it has
+							 * not been declared yet */
 } frame;
 
+/* One entry per active call. cur is the growth of the inclusive size of the
+ * frame since the call, max is the highest value of cur. Only the entry of
+ * the nearest active ancestor of a frame is updated when its size changes;
+ * entries are added to their parent when the call returns. */
+typedef struct _peak_entry {
+	frame * f;
+	uint32_t prev_entry;	/* previous value of f->peak_entry */
+	int64_t cur;
+	int64_t max;
+} peak_entry;
+
 /* an allocated block's infos */
 typedef struct _alloc {
 #if MEMPROF_DEBUG
 	size_t canary_a;
 #endif
-	LIST_ENTRY(_alloc) list;
+	struct _frame * frame;	/* NULL if the block is not tracked */
 	size_t size;
+	uint32_t label;			/* scope label id, 0 if none */
+	struct _alloc * growth;	/* bytes added by a realloc in another frame,
+							 * see memprof.realloc_growth */
 #if MEMPROF_DEBUG
 	size_t canary_b;
 #endif
@@ -172,8 +225,20 @@ typedef struct _alloc_buckets {
 	alloc_bucket_item ** buckets;
 } alloc_buckets;
 
-static zend_bool dump_callgrind(php_stream * stream);
-static zend_bool dump_pprof(php_stream * stream);
+typedef zend_bool (*dump_func)(memprof_writer * w, frame * root);
+
+static zend_bool dump_callgrind(memprof_writer * w, frame * root);
+static zend_bool dump_pprof(memprof_writer * w, frame * root);
+static zend_bool dump_folded(memprof_writer * w, frame * root);
+static zend_bool dump_snapshot(memprof_writer * w, frame * root);
+static zend_bool dump_delta(memprof_writer * w, frame * root);
+static void delta_timed_dump();
+static void delta_append();
+static void delta_destroy();
+static void alloc_trigger_fire();
+static void aggregate_merge();
+static alloc * alloc_buckets_alloc(alloc_buckets * buckets, size_t size);
+static void alloc_buckets_free(alloc_buckets * buckets, alloc * a);
 
 static ZEND_DECLARE_MODULE_GLOBALS(memprof)
 
@@ -216,26 +281,220 @@ static void (*rinit_zend_error_cb)(MEMPROF_ZEND_ERROR_CB_ARGS);
 static zend_bool zend_error_cb_overridden;
 static void memprof_zend_error_cb(MEMPROF_ZEND_ERROR_CB_ARGS);
 
+static void (*old_zend_interrupt_function)(zend_execute_data *execute_data);
+
 static PHP_INI_MH((*origOnChangeMemoryLimit)) = NULL;
 
 static int memprof_dumped = 0;
 static int track_mallocs = 0;
 
+/* While paused, new blocks are not tracked and calls are not recorded, but
+ * tracked blocks are still accounted for when freed */
+static int memprof_paused = 0;
+
+/* Bytes allocated minus bytes freed through the profiled heap since
+ * profiling was enabled. alloc_trigger_fire() is called when this reaches
+ * alloc_trigger_next, so the allocation path only pays for one comparison. */
+static size_t alloc_trigger_usage = 0;
+static size_t alloc_trigger_next = SIZE_MAX;
+
+/* memprof.dump_thresholds resolved to absolute sizes, in ascending order */
+static size_t dump_threshold_sizes[MEMPROF_MAX_DUMP_THRESHOLDS];
+static size_t dump_threshold_sizes_count = 0;
+static size_t dump_threshold_index = 0;
+static size_t dump_threshold_next = SIZE_MAX;
+static zend_bool dump_threshold_pending = 0;
+
+static size_t cgroup_check_next = SIZE_MAX;
+static zend_bool cgroup_check_pending = 0;
+
+/* Not reset between requests: triggered dumps are rate limited per process */
+static time_t last_triggered_dump = 0;
+static uint64_t last_cgroup_check = 0;
+static uint64_t last_cgroup_events = 0;
+static zend_bool cgroup_events_read = 0;
+static char cgroup_dir_buf[MAXPATHLEN];
+static zend_bool cgroup_dir_detected = 0;
+
+/* Everything an autodump needs, allocated when profiling is enabled: the
+ * dump itself must not allocate when the process runs out of memory */
+typedef struct _autodump_reserve {
+	char buf[WRITER_BUFFER_SIZE];
+	char path[AUTODUMP_PATH_SIZE];
+	char filename[MAXPATHLEN];
+	union {
+		zend_string str;
+		char buf[sizeof(zend_string) + AUTODUMP_MESSAGE_SIZE];
+	} message;
+	zend_bool message_used;		/* the engine holds message */
+	struct _autodump_reserve * next_retired;
+} autodump_reserve;
+
+static autodump_reserve * reserve = NULL;
+/* Reserves released while the engine may still hold their error message, in
+ * PG(last_error_message) or in the result of error_get_last(). The message
+ * can be read until the end of the request, after RSHUTDOWN. */
+static autodump_reserve * retired_reserves = NULL;
+/* Set while dumping from the reserve */
+static zend_bool reserve_dumping = 0;
+#if MEMPROF_DEBUG
+static zend_mm_heap * failing_zheap = NULL;
+#endif
+
 static frame root_frame;
 static frame * current_frame;
-static alloc_list_head * current_alloc_list;
+static size_t frames_count = 0;
+
+static peak_entry * peak_stack = NULL;
+static uint32_t peak_stack_len = 0;
+static uint32_t peak_stack_size = 0;
+/* Index of the first entry of the running fiber in peak_stack. The entries
+ * below are those of the fibers that resumed it. */
+static uint32_t peak_base = 0;
+
+/* Delta dumps. Once the first delta is written, frames that change are
+ * added to delta_dirty, once per epoch, and the next delta only writes
+ * these frames. */
+static zend_bool delta_tracking = 0;
+static uint32_t delta_epoch = 0;
+static uint32_t delta_seq = 0;
+static uint32_t delta_next_id = 0;
+static frame ** delta_dirty = NULL;
+static size_t delta_dirty_len = 0;
+static size_t delta_dirty_size = 0;
+static char * delta_filename = NULL;	/* timeline of memprof.delta_interval */
+static uint64_t last_delta_dump = 0;
+static uint32_t delta_calls = 0;
+static zend_long delta_interval = 0;
+
+/* Incremented when profiling is enabled, so that calls made before
+ * memprof_disable() don't restore frames of a destroyed tree */
+static uint32_t profile_generation = 0;
+
+/* Scope labels. Label ids index label_names, 0 means no label. */
+static uint32_t current_label = 0;
+static HashTable label_ids;
+static HashTable label_names;
+static uint32_t * label_stack = NULL;
+static size_t label_stack_len = 0;
+static size_t label_stack_size = 0;
+
+/* Functions whose calls are attributed to their caller. Resolved
+ * lazily by function pointer in passthrough_cache. */
+#define PASSTHROUGH_YES 1
+#define PASSTHROUGH_NO 2
+static zend_bool passthrough_enabled = 0;
+static HashTable passthrough_names;
+static HashTable collapse_prefixes;
+static Pvoid_t passthrough_cache = (Pvoid_t) NULL;
+
+/* Shared across requests. Mapped on first use. */
+static memprof_aggregate * aggregate_store = NULL;
+
 static alloc_buckets current_alloc_buckets;
 
 static Pvoid_t allocs_set = (Pvoid_t) NULL;
 
+/* Read from memprof.realloc_growth when profiling is enabled */
+static zend_bool realloc_growth = 0;
+
+/* Bytes and blocks freed by a frame, out of those allocated by another one */
+typedef struct _free_site {
+	size_t size;
+	size_t count;
+} free_site;
+
+/* With memprof.free_sites, a sparse matrix of the frees: maps allocating
+ * frames to maps of freeing frames to free_site */
+static zend_bool free_sites_enabled = 0;
+static Pvoid_t free_sites = (Pvoid_t) NULL;
+
+/* With the trace profile flag, allocation and call events are streamed to
+ * trace_filename */
+static zend_bool trace_enabled = 0;
+static memprof_trace event_trace;
+static char trace_filename[MAXPATHLEN];
+
+/* Blocks smaller than this are not tracked. Read from
+ * memprof.min_tracked_size when profiling is enabled. */
+static size_t min_tracked_size = 0;
+
+/* Bounds and OR of the low address bits of all the pointers ever added to
+ * allocs_set, so that is_own_alloc() can reject most untracked pointers
+ * without probing the set. When only large blocks are tracked, these are
+ * page aligned while small blocks are not. */
+#define TRACKED_ADDR_LOW_MASK ((uintptr_t) 4095)
+static uintptr_t tracked_addr_min = UINTPTR_MAX;
+static uintptr_t tracked_addr_max = 0;
+static uintptr_t tracked_addr_bits = 0;
+
+#define ALLOC_IS_TRACKED_SIZE(size) ((size) >= min_tracked_size)
+
+/* With memprof.alloc_batch, new blocks go to a small open addressing table
+ * instead of allocs_set. Most blocks are freed shortly after they are
+ * allocated: these are removed from the table and never reach allocs_set.
+ * When the table is half full, the blocks that are still live are sorted by
+ * address and added to allocs_set in one batch. */
+typedef struct _pending_alloc {
+	void * ptr;		/* NULL if the slot is empty */
+	alloc * a;
+} pending_alloc;
+
+#define PENDING_ALLOCS_MAX_BATCH (1<<20)
+
+static pending_alloc * pending_allocs = NULL;
+static size_t pending_allocs_mask = 0;
+static unsigned int pending_allocs_shift = 0;
+static size_t pending_allocs_count = 0;
+static size_t pending_allocs_batch = 0;	/* flushed when count reaches this */
+static pending_alloc * pending_allocs_sorted = NULL;
+
 static const size_t zend_mm_heap_size = 4096;
 static zend_mm_heap * zheap = NULL;
 static zend_mm_heap * orig_zheap = NULL;
 
 #define ALLOC_INIT(alloc, size) alloc_init(alloc, size)
 
-#define ALLOC_LIST_INSERT_HEAD(head, elem) alloc_list_insert_head(head, elem)
-#define ALLOC_LIST_REMOVE(elem) alloc_list_remove(elem)
+#define ALLOC_TRIGGER_ADD(size) do { \
+		alloc_trigger_usage += (size); \
+		if (UNEXPECTED(alloc_trigger_usage >= alloc_trigger_next)) { \
+			alloc_trigger_fire(); \
+		} \
+	} while (0)
+
+#define ALLOC_TRIGGER_SUB(size) do { \
+		alloc_trigger_usage -= (size); \
+	} while (0)
+
+#define ALLOC_ATTACH(elem, frame) alloc_attach(elem, frame)
+#define ALLOC_DETACH(elem) alloc_detach(elem)
+
+/* Must be called before ALLOC_DETACH when a block is freed */
+#define ALLOC_FREED(elem) do { \
+		if (UNEXPECTED(free_sites_enabled)) { \
+			free_sites_record(elem); \
+		} \
+	} while (0)
+
+/* Trace events are only written for blocks attributed to a frame.
+ * TRACE_REALLOC must be called before the block's record is updated. */
+#define TRACE_ALLOC(enabled, ptr, size) do { \
+		if (enabled) { \
+			trace_alloc(&event_trace, ptr, size); \
+		} \
+	} while (0)
+
+#define TRACE_FREE(enabled, elem, ptr) do { \
+		if ((enabled) && (elem)->frame != NULL) { \
+			trace_free(&event_trace, ptr); \
+		} \
+	} while (0)
+
+#define TRACE_REALLOC(enabled, elem, ptr, result, size) do { \
+		if (enabled) { \
+			trace_block_realloc(elem, ptr, result, size); \
+		} \
+	} while (0)
 
 ZEND_NORETURN static void out_of_memory() {
 	fprintf(stderr, "memprof: System out of memory, try lowering memory_limit\n");
@@ -276,27 +535,224 @@ static inline size_t safe_size(size_t nmemb, size_t size, size_t offset) {
 
 static inline void alloc_init(alloc * alloc, size_t size) {
 	alloc->size = size;
-	alloc->list.le_next = NULL;
-	alloc->list.le_prev = NULL;
+	alloc->frame = NULL;
+	alloc->label = 0;
+	alloc->growth = NULL;
 #if MEMPROF_DEBUG
 	alloc->canary_a = alloc->canary_b = size ^ 0x5a5a5a5a;
 #endif
 }
 
-static void alloc_list_insert_head(alloc_list_head * head, alloc * elem) {
-	LIST_INSERT_HEAD(head, elem, list);
+/* Size of the block, including bytes attributed to another frame */
+static inline size_t alloc_size(const alloc * elem) {
+	return elem->size + (elem->growth ? elem->growth->size : 0);
+}
+
+/* Returns the entry of the nearest active ancestor of f (or f). The root
+ * frame is always active. */
+static inline peak_entry * frame_peak_entry(frame * f) {
+	while (f->peak_entry == 0) {
+		f = f->prev;
+	}
+	return &peak_stack[f->peak_entry - 1];
+}
+
+static void frame_delta_dirty(frame * f) {
+	if (delta_dirty_len == delta_dirty_size) {
+		delta_dirty_size = delta_dirty_size ? delta_dirty_size * 2 : 64;
+		delta_dirty = realloc_check(delta_dirty, safe_size(delta_dirty_size, sizeof(*delta_dirty), 0));
+	}
+	delta_dirty[delta_dirty_len++] = f;
+	f->delta_epoch = delta_epoch;
+}
+
+/* Records that f changed since the previous delta */
+static inline void frame_touch(frame * f) {
+	if (UNEXPECTED(delta_tracking) && f->delta_epoch != delta_epoch) {
+		frame_delta_dirty(f);
+	}
+}
+
+static inline void frame_self_add(frame * f, size_t size) {
+	peak_entry * e = frame_peak_entry(f);
+
+	frame_touch(f);
+
+	f->self_size += size;
+	if (f->self_size > f->peak_self_size) {
+		f->peak_self_size = f->self_size;
+	}
+
+	e->cur += size;
+	if (e->cur > e->max) {
+		e->max = e->cur;
+	}
+}
+
+static inline void frame_self_sub(frame * f, size_t size) {
+	frame_touch(f);
+	f->self_size -= size;
+	frame_peak_entry(f)->cur -= size;
+}
+
+/* Changes the size of a block without changing its frame */
+static inline void alloc_resize(alloc * elem, size_t size) {
+	if (elem->frame && size > elem->size) {
+		frame_self_add(elem->frame, size - elem->size);
+	} else if (elem->frame) {
+		frame_self_sub(elem->frame, elem->size - size);
+	}
+	elem->size = size;
+#if MEMPROF_DEBUG
+	elem->canary_a = elem->canary_b = size ^ 0x5a5a5a5a;
+#endif
+}
+
+/* Attributes a block to a frame */
+static inline void alloc_attach(alloc * elem, frame * f) {
+	elem->frame = f;
+	elem->label = current_label;
+	frame_self_add(f, elem->size);
+	f->self_count++;
+}
+
+static inline void alloc_detach(alloc * elem) {
+	frame * f = elem->frame;
+	if (f) {
+		frame_self_sub(f, elem->size);
+		f->self_count--;
+		elem->frame = NULL;
+	}
+	if (elem->growth) {
+		/* The growth of a block only counts bytes, not blocks */
+		frame_self_sub(elem->growth->frame, elem->growth->size);
+		alloc_buckets_free(&current_alloc_buckets, elem->growth);
+		elem->growth = NULL;
+	}
+}
+
+/* Accounts for a realloc of a tracked block. By default the whole block
+ * moves to the current frame, like a new allocation. With
+ * memprof.realloc_growth, the frame that allocated the block keeps the
+ * original bytes, and the bytes beyond that are attributed to the last frame
+ * that grew the block. */
+static zend_always_inline void alloc_realloc_ex(alloc * elem, size_t size, zend_bool growth) {
+	alloc * g = elem->growth;
+
+	if (!growth || !track_mallocs || elem->frame == NULL) {
+		alloc_detach(elem);
+		alloc_resize(elem, size);
+		if (track_mallocs) {
+			alloc_attach(elem, current_frame);
+		}
+		return;
+	}
+
+	if (size <= elem->size || (g == NULL && elem->frame == current_frame)) {
+		if (g != NULL) {
+			frame_self_sub(g->frame, g->size);
+			alloc_buckets_free(&current_alloc_buckets, g);
+			elem->growth = NULL;
+		}
+		alloc_resize(elem, size);
+		return;
+	}
+
+	if (g == NULL) {
+		g = elem->growth = alloc_buckets_alloc(&current_alloc_buckets, 0);
+	} else {
+		frame_self_sub(g->frame, g->size);
+		g->frame = NULL;
+	}
+
+	alloc_resize(g, size - elem->size);
+	g->frame = current_frame;
+	g->label = current_label;
+	frame_self_add(current_frame, g->size);
+}
+
+static void alloc_realloc(alloc * elem, size_t size) {
+	alloc_realloc_ex(elem, size, realloc_growth);
+}
+
+/* A reallocated block is attributed to a frame afterwards iff mallocs are
+ * tracked. Traces always attribute the whole block to the frame that
+ * reallocated it, whatever memprof.realloc_growth. */
+static zend_always_inline void trace_block_realloc(alloc * elem, void * ptr, void * result, size_t size) {
+	if (elem->frame != NULL) {
+		if (track_mallocs) {
+			trace_realloc(&event_trace, ptr, result, size);
+		} else {
+			trace_free(&event_trace, ptr);
+		}
+	} else if (track_mallocs) {
+		trace_alloc(&event_trace, result, size);
+	}
+}
+
+/* Returns the id of f in the trace, declaring it and its ancestors first if
+ * needed */
+static uint32_t trace_frame_id(frame * f) {
+	if (f->trace_id == 0) {
+		uint32_t parent = trace_frame_id(f->prev);
+		f->trace_id = trace_frame(&event_trace, parent, f->name, f->name_len);
+	}
+	return f->trace_id;
+}
+
+static void free_site_add(frame * alloc_frame, size_t size, size_t count)
+{
+	Word_t * p;
+	free_site * site;
+
+	JLI(p, free_sites, (Word_t) alloc_frame);
+	JLI(p, *(Pvoid_t *) p, (Word_t) current_frame);
+
+	site = (free_site *) *p;
+	if (site == NULL) {
+		site = malloc_check(sizeof(*site));
+		site->size = 0;
+		site->count = 0;
+		*p = (Word_t) site;
+	}
+
+	site->size += size;
+	site->count += count;
 }
 
-static void list_remove(alloc * elm) {
-	LIST_REMOVE(elm, list);
+/* Records that the current frame frees a block */
+static void free_sites_record(const alloc * elem)
+{
+	if (elem->frame != NULL) {
+		free_site_add(elem->frame, elem->size, 1);
+	}
+	if (elem->growth != NULL) {
+		free_site_add(elem->growth->frame, elem->growth->size, 0);
+	}
 }
 
-static void alloc_list_remove(alloc * elem) {
-	if (elem->list.le_prev || elem->list.le_next) {
-		list_remove(elem);
-		elem->list.le_next = NULL;
-		elem->list.le_prev = NULL;
+static void free_sites_destroy()
+{
+	Word_t alloc_index = 0;
+	Word_t * p;
+	Word_t ret;
+
+	JLF(p, free_sites, alloc_index);
+	while (p != NULL) {
+		Pvoid_t * sites = (Pvoid_t *) p;
+		Word_t free_index = 0;
+		Word_t * q;
+
+		JLF(q, *sites, free_index);
+		while (q != NULL) {
+			free((free_site *) *q);
+			JLN(q, *sites, free_index);
+		}
+		JLFA(ret, *sites);
+
+		JLN(p, free_sites, alloc_index);
 	}
+	JLFA(ret, free_sites);
 }
 
 #if MEMPROF_DEBUG
@@ -311,11 +767,6 @@ static void alloc_check_single(alloc * alloc, const char * function, int line) {
 static void alloc_check(alloc * alloc, const char * function, int line) {
 	/* fprintf(stderr, "checking %p at %s:%d\n", alloc, function, line); */
 	alloc_check_single(alloc, function, line);
-	/*
-	for (alloc = current_alloc_list->lh_first; alloc; alloc = alloc->list.le_next) {
-		alloc_check_single(alloc, function, line);
-	}
-	*/
 }
 
 #	define ALLOC_CHECK(alloc) alloc_check(alloc, __FUNCTION__, __LINE__);
@@ -393,21 +844,15 @@ static void alloc_buckets_free(alloc_buckets * buckets, alloc * a)
 	buckets->next_free = item;
 }
 
+/* Blocks still attributed to the frame must be released before (or at the
+ * same time as) the frame */
 static void destroy_frame(frame * f)
 {
-	alloc * a;
-
 #if MEMPROF_DEBUG
 	memset(f->name, 0x5a, f->name_len);
 #endif
 	free(f->name);
 
-	while (f->allocs.lh_first) {
-		a = f->allocs.lh_first;
-		ALLOC_CHECK(a);
-		ALLOC_LIST_REMOVE(a);
-	}
-
 	zend_hash_destroy(&f->next_cache);
 
 #if MEMPROF_DEBUG
@@ -431,7 +876,14 @@ static void init_frame(frame * f, frame * prev, char * name, size_t name_len)
 	f->name_len = name_len;
 	f->calls = 0;
 	f->prev = prev;
-	LIST_INIT(&f->allocs);
+	f->self_size = 0;
+	f->self_count = 0;
+	f->peak_self_size = 0;
+	f->peak_size = 0;
+	f->peak_entry = 0;
+	f->delta_id = 0;
+	f->delta_epoch = 0;
+	f->trace_id = 0;
 }
 
 static frame * new_frame(frame * prev, char * name, size_t name_len)
@@ -441,6 +893,38 @@ static frame * new_frame(frame * prev, char * name, size_t name_len)
 	return f;
 }
 
+/* The root of a tree is its own parent */
+#define FRAME_IS_ROOT(f) ((f)->prev == (f))
+
+#define TRUNCATED_FRAME_NAME "[truncated]"
+
+static zend_bool frame_is_truncated(const frame * f)
+{
+	return f->name_len == sizeof(TRUNCATED_FRAME_NAME)-1
+		&& memcmp(f->name, TRUNCATED_FRAME_NAME, sizeof(TRUNCATED_FRAME_NAME)-1) == 0;
+}
+
+/* Returns the nearest ancestor of f (or f) named name, if name appears at
+ * least limit times on the path of f */
+static frame * frame_recursion_ancestor(frame * f, const char * name, size_t name_len, zend_long limit)
+{
+	frame * nearest = NULL;
+	zend_long count = 0;
+
+	for (; !FRAME_IS_ROOT(f); f = f->prev) {
+		if (f->name_len == name_len && memcmp(f->name, name, name_len) == 0) {
+			if (nearest == NULL) {
+				nearest = f;
+			}
+			if (++count >= limit) {
+				return nearest;
+			}
+		}
+	}
+
+	return NULL;
+}
+
 static frame * get_or_create_frame(zend_execute_data * current_execute_data, frame * prev)
 {
 	frame * f;
@@ -448,27 +932,97 @@ static frame * get_or_create_frame(zend_execute_data * current_execute_data, fra
 	char name[256];
 	size_t name_len;
 
+	if (UNEXPECTED(frame_is_truncated(prev))) {
+		return prev;
+	}
+
 	name_len = get_function_name(current_execute_data, name, sizeof(name));
 
 	f = zend_hash_str_find_ptr(&prev->next_cache, name, name_len);
 	if (f == NULL) {
+		zend_long fold = MEMPROF_G(fold_recursion);
+		zend_long max_frames = MEMPROF_G(max_frames);
+
+		if (fold > 0) {
+			f = frame_recursion_ancestor(prev, name, name_len, fold);
+			if (f != NULL) {
+				return f;
+			}
+		}
+
+		if (max_frames > 0 && frames_count >= (size_t) max_frames) {
+			/* Over budget: calls are attributed to a single child of prev */
+			name_len = sizeof(TRUNCATED_FRAME_NAME)-1;
+			memcpy(name, TRUNCATED_FRAME_NAME, sizeof(TRUNCATED_FRAME_NAME));
+			f = zend_hash_str_find_ptr(&prev->next_cache, name, name_len);
+			if (f != NULL) {
+				return f;
+			}
+		}
+
 		f = new_frame(prev, name, name_len);
 		zend_hash_str_add_ptr(&prev->next_cache, name, name_len, f);
+		frames_count++;
 	}
 
 	return f;
 }
 
-static size_t frame_alloc_size(const frame * f)
+static void peaks_push(frame * f)
 {
-	size_t size = 0;
-	alloc * alloc;
+	peak_entry * e;
 
-	LIST_FOREACH(alloc, &f->allocs, list) {
-		size += alloc->size;
+	if (peak_stack_len == peak_stack_size) {
+		peak_stack_size = peak_stack_size ? peak_stack_size * 2 : 64;
+		peak_stack = realloc_check(peak_stack, safe_size(peak_stack_size, sizeof(*peak_stack), 0));
 	}
 
-	return size;
+	e = &peak_stack[peak_stack_len++];
+	e->f = f;
+	e->prev_entry = f->peak_entry;
+	e->cur = 0;
+	e->max = 0;
+
+	f->peak_entry = peak_stack_len;
+}
+
+/* Pops the entries above depth, adding them to their parent */
+static void peaks_pop(uint32_t depth)
+{
+	while (peak_stack_len > depth) {
+		peak_entry * e = &peak_stack[--peak_stack_len];
+		peak_entry * parent = e - 1;
+
+		if ((size_t) e->max > e->f->peak_size) {
+			e->f->peak_size = e->max;
+			frame_touch(e->f);
+		}
+		e->f->peak_entry = e->prev_entry;
+
+		if (parent->cur + e->max > parent->max) {
+			parent->max = parent->cur + e->max;
+		}
+		parent->cur += e->cur;
+	}
+}
+
+/* Updates the peaks of the active frames, as if all calls returned now */
+static void peaks_flush()
+{
+	int64_t child_max = 0;
+	uint32_t i;
+
+	for (i = peak_stack_len; i > 0; i--) {
+		peak_entry * e = &peak_stack[i-1];
+		int64_t max = MAX(e->max, e->cur + child_max);
+
+		if ((size_t) max > e->f->peak_size) {
+			e->f->peak_size = max;
+			frame_touch(e->f);
+		}
+
+		child_max = max;
+	}
 }
 
 static int frame_stack_depth(const frame * f)
@@ -476,18 +1030,190 @@ static int frame_stack_depth(const frame * f)
 	const frame * prev;
 	int depth = 0;
 
-	for (prev = f; prev != &root_frame; prev = prev->prev) {
+	for (prev = f; !FRAME_IS_ROOT(prev); prev = prev->prev) {
 		depth ++;
 	}
 
 	return depth;
 }
 
+static inline size_t pending_alloc_slot(const void * ptr)
+{
+	/* Fibonacci hashing: the high bits of the product depend on all the
+	 * bits of the address, including the high ones of aligned blocks */
+	return (size_t) (((uint64_t) (uintptr_t) ptr * UINT64_C(0x9E3779B97F4A7C15)) >> pending_allocs_shift);
+}
+
+static pending_alloc * pending_alloc_find(const void * ptr)
+{
+	size_t i = pending_alloc_slot(ptr);
+
+	for (;;) {
+		pending_alloc * e = &pending_allocs[i];
+		if (e->ptr == ptr) {
+			return e;
+		}
+		if (e->ptr == NULL) {
+			return NULL;
+		}
+		i = (i + 1) & pending_allocs_mask;
+	}
+}
+
+/* Removes e, moving back the entries that follow it in the probe sequence
+ * so that no tombstone is needed */
+static void pending_alloc_remove(pending_alloc * e)
+{
+	size_t i = e - pending_allocs;
+	size_t j = i;
+
+	for (;;) {
+		size_t k;
+
+		j = (j + 1) & pending_allocs_mask;
+		if (pending_allocs[j].ptr == NULL) {
+			break;
+		}
+
+		/* The entry at j can move to i unless its slot is in (i, j] */
+		k = pending_alloc_slot(pending_allocs[j].ptr);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+			continue;
+		}
+
+		pending_allocs[i] = pending_allocs[j];
+		i = j;
+	}
+
+	pending_allocs[i].ptr = NULL;
+	pending_allocs_count--;
+}
+
+static int pending_alloc_compare(const void * a, const void * b)
+{
+	uintptr_t pa = (uintptr_t) ((const pending_alloc *) a)->ptr;
+	uintptr_t pb = (uintptr_t) ((const pending_alloc *) b)->ptr;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+static void pending_alloc_swap(void * a, void * b)
+{
+	pending_alloc tmp = *(pending_alloc *) a;
+	*(pending_alloc *) a = *(pending_alloc *) b;
+	*(pending_alloc *) b = tmp;
+}
+
+/* Adds the pending blocks to allocs_set. Must be called before traversing
+ * allocs_set. */
+static void pending_allocs_flush()
+{
+	size_t n = 0;
+	size_t i;
+	Word_t * p;
+
+	if (pending_allocs_count == 0) {
+		return;
+	}
+
+	for (i = 0; i <= pending_allocs_mask; i++) {
+		if (pending_allocs[i].ptr != NULL) {
+			pending_allocs_sorted[n++] = pending_allocs[i];
+		}
+	}
+
+	memset(pending_allocs, 0, (pending_allocs_mask + 1) * sizeof(*pending_allocs));
+	pending_allocs_count = 0;
+
+	/* Judy inserts are faster in address order */
+	zend_sort(pending_allocs_sorted, n, sizeof(*pending_allocs_sorted), pending_alloc_compare, pending_alloc_swap);
+
+	WITHOUT_MALLOC_HOOKS {
+		for (i = 0; i < n; i++) {
+			JLI(p, allocs_set, (Word_t) pending_allocs_sorted[i].ptr);
+			*p = (Word_t) pending_allocs_sorted[i].a;
+		}
+	} END_WITHOUT_MALLOC_HOOKS;
+}
+
+static void pending_allocs_add(void * ptr, alloc * a)
+{
+	size_t i;
+
+	if (pending_allocs_count == pending_allocs_batch) {
+		pending_allocs_flush();
+	}
+
+	i = pending_alloc_slot(ptr);
+	while (pending_allocs[i].ptr != NULL) {
+		i = (i + 1) & pending_allocs_mask;
+	}
+
+	pending_allocs[i].ptr = ptr;
+	pending_allocs[i].a = a;
+	pending_allocs_count++;
+}
+
+static void pending_allocs_init(zend_long batch)
+{
+	size_t size = 2;
+	unsigned int bits = 1;
+
+	if (batch <= 0) {
+		return;
+	}
+	if (batch > PENDING_ALLOCS_MAX_BATCH) {
+		batch = PENDING_ALLOCS_MAX_BATCH;
+	}
+
+	/* At most half full */
+	while (size < (size_t) batch * 2) {
+		size <<= 1;
+		bits++;
+	}
+
+	pending_allocs = calloc(size, sizeof(*pending_allocs));
+	pending_allocs_sorted = malloc(batch * sizeof(*pending_allocs_sorted));
+	if (pending_allocs == NULL || pending_allocs_sorted == NULL) {
+		out_of_memory();
+	}
+
+	pending_allocs_mask = size - 1;
+	pending_allocs_shift = 64 - bits;
+	pending_allocs_count = 0;
+	pending_allocs_batch = batch;
+}
+
+static void pending_allocs_destroy()
+{
+	free(pending_allocs);
+	free(pending_allocs_sorted);
+	pending_allocs = NULL;
+	pending_allocs_sorted = NULL;
+	pending_allocs_count = 0;
+	pending_allocs_batch = 0;
+}
+
+/* Pending allocations are only used for allocs_set */
 static void mark_own_alloc(Pvoid_t * set, void * ptr, alloc * a)
 {
 	Word_t * p;
-	JLI(p, *set, (Word_t)ptr);
-	*p = (Word_t) a;
+	uintptr_t addr = (uintptr_t) ptr;
+
+	if (pending_allocs != NULL && set == &allocs_set) {
+		pending_allocs_add(ptr, a);
+	} else {
+		JLI(p, *set, (Word_t)ptr);
+		*p = (Word_t) a;
+	}
+
+	if (addr < tracked_addr_min) {
+		tracked_addr_min = addr;
+	}
+	if (addr > tracked_addr_max) {
+		tracked_addr_max = addr;
+	}
+	tracked_addr_bits |= addr & TRACKED_ADDR_LOW_MASK;
 }
 
 static void unmark_own_alloc(Pvoid_t * set, void * ptr)
@@ -496,6 +1222,14 @@ static void unmark_own_alloc(Pvoid_t * set, void * ptr)
 
 	MALLOC_HOOK_CHECK_NOT_OWN();
 
+	if (pending_allocs_count != 0 && set == &allocs_set) {
+		pending_alloc * e = pending_alloc_find(ptr);
+		if (e != NULL) {
+			pending_alloc_remove(e);
+			return;
+		}
+	}
+
 	JLD(ret, *set, (Word_t)ptr);
 }
 
@@ -505,6 +1239,20 @@ alloc * is_own_alloc(Pvoid_t * set, void * ptr)
 
 	MALLOC_HOOK_CHECK_NOT_OWN();
 
+	if ((uintptr_t) ptr < tracked_addr_min || (uintptr_t) ptr > tracked_addr_max) {
+		return 0;
+	}
+	if (((uintptr_t) ptr & TRACKED_ADDR_LOW_MASK & ~tracked_addr_bits) != 0) {
+		return 0;
+	}
+
+	if (pending_allocs_count != 0 && set == &allocs_set) {
+		pending_alloc * e = pending_alloc_find(ptr);
+		if (e != NULL) {
+			return e->a;
+		}
+	}
+
 	JLG(p, *set, (Word_t)ptr);
 	if (p != NULL) {
 		return (alloc*) *p;
@@ -521,14 +1269,19 @@ static void * malloc_hook(size_t size, const void *caller)
 
 	WITHOUT_MALLOC_HOOKS {
 
-		result = malloc_check(size);
-		if (result != NULL) {
-			alloc * a = alloc_buckets_alloc(&current_alloc_buckets, size);
-			if (track_mallocs) {
-				ALLOC_LIST_INSERT_HEAD(current_alloc_list, a);
+		if (UNEXPECTED(memprof_paused)) {
+			result = malloc(size);
+		} else {
+			result = malloc_check(size);
+			if (result != NULL && ALLOC_IS_TRACKED_SIZE(size)) {
+				alloc * a = alloc_buckets_alloc(&current_alloc_buckets, size);
+				if (track_mallocs) {
+					ALLOC_ATTACH(a, current_frame);
+					TRACE_ALLOC(UNEXPECTED(trace_enabled), result, size);
+				}
+				mark_own_alloc(&allocs_set, result, a);
+				assert(is_own_alloc(&allocs_set, result));
 			}
-			mark_own_alloc(&allocs_set, result, a);
-			assert(is_own_alloc(&allocs_set, result));
 		}
 
 	} END_WITHOUT_MALLOC_HOOKS;
@@ -545,30 +1298,54 @@ static void * realloc_hook(void *ptr, size_t size, const void *caller)
 
 		if (ptr != NULL && !(a = is_own_alloc(&allocs_set, ptr))) {
 			result = realloc(ptr, size);
-		} else {
-			/* ptr may be freed by realloc, so we must remove it from list now */
+			if (result != NULL && min_tracked_size > 0 && ALLOC_IS_TRACKED_SIZE(size) && !memprof_paused) {
+				/* A small block grew past the threshold */
+				a = alloc_buckets_alloc(&current_alloc_buckets, size);
+				if (track_mallocs) {
+					ALLOC_ATTACH(a, current_frame);
+					TRACE_ALLOC(UNEXPECTED(trace_enabled), result, size);
+				}
+				mark_own_alloc(&allocs_set, result, a);
+			}
+		} else if (UNEXPECTED(memprof_paused)) {
 			if (ptr != NULL) {
 				ALLOC_CHECK(a);
-				ALLOC_LIST_REMOVE(a);
+				ALLOC_FREED(a);
+				TRACE_FREE(UNEXPECTED(trace_enabled), a, ptr);
+				ALLOC_DETACH(a);
 				unmark_own_alloc(&allocs_set, ptr);
 				alloc_buckets_free(&current_alloc_buckets, a);
 			}
+			result = realloc(ptr, size);
+		} else if (ptr != NULL) {
+			ALLOC_CHECK(a);
 
+			/* On failure, ptr is left untouched. realloc(ptr, 0) frees ptr. */
 			result = realloc(ptr, size);
-			if (result != NULL) {
-				/* succeeded; add result */
-				a = alloc_buckets_alloc(&current_alloc_buckets, size);
-				if (track_mallocs) {
-					ALLOC_LIST_INSERT_HEAD(current_alloc_list, a);
+			if (result != NULL && ALLOC_IS_TRACKED_SIZE(size)) {
+				if (result != ptr) {
+					unmark_own_alloc(&allocs_set, ptr);
+					mark_own_alloc(&allocs_set, result, a);
 				}
-				mark_own_alloc(&allocs_set, result, a);
-			} else if (ptr != NULL) {
-				/* failed, re-add ptr, since it hasn't been freed */
+				TRACE_REALLOC(UNEXPECTED(trace_enabled), a, ptr, result, size);
+				alloc_realloc(a, size);
+			} else if (result != NULL || size == 0) {
+				/* Freed, or shrunk below the threshold */
+				ALLOC_FREED(a);
+				TRACE_FREE(UNEXPECTED(trace_enabled), a, ptr);
+				ALLOC_DETACH(a);
+				unmark_own_alloc(&allocs_set, ptr);
+				alloc_buckets_free(&current_alloc_buckets, a);
+			}
+		} else {
+			result = realloc(ptr, size);
+			if (result != NULL && ALLOC_IS_TRACKED_SIZE(size)) {
 				a = alloc_buckets_alloc(&current_alloc_buckets, size);
 				if (track_mallocs) {
-					ALLOC_LIST_INSERT_HEAD(current_alloc_list, a);
+					ALLOC_ATTACH(a, current_frame);
+					TRACE_ALLOC(UNEXPECTED(trace_enabled), result, size);
 				}
-				mark_own_alloc(&allocs_set, ptr, a);
+				mark_own_alloc(&allocs_set, result, a);
 			}
 		}
 
@@ -585,7 +1362,9 @@ static void free_hook(void *ptr, const void *caller)
 			alloc * a;
 			if ((a = is_own_alloc(&allocs_set, ptr))) {
 				ALLOC_CHECK(a);
-				ALLOC_LIST_REMOVE(a);
+				ALLOC_FREED(a);
+				TRACE_FREE(UNEXPECTED(trace_enabled), a, ptr);
+				ALLOC_DETACH(a);
 				free(ptr);
 				unmark_own_alloc(&allocs_set, ptr);
 				alloc_buckets_free(&current_alloc_buckets, a);
@@ -604,10 +1383,11 @@ static void * memalign_hook(size_t alignment, size_t size, const void *caller)
 	WITHOUT_MALLOC_HOOKS {
 
 		result = memalign(alignment, size);
-		if (result != NULL) {
+		if (result != NULL && !memprof_paused && ALLOC_IS_TRACKED_SIZE(size)) {
 			alloc *a = alloc_buckets_alloc(&current_alloc_buckets, size);
 			if (track_mallocs) {
-				ALLOC_LIST_INSERT_HEAD(current_alloc_list, a);
+				ALLOC_ATTACH(a, current_frame);
+				TRACE_ALLOC(UNEXPECTED(trace_enabled), result, size);
 			}
 			mark_own_alloc(&allocs_set, result, a);
 		}	
@@ -628,7 +1408,13 @@ static void * memalign_hook(size_t alignment, size_t size, const void *caller)
 	track_mallocs = ___old_track_mallocs; \
 } while (0)
 
-static void * zend_malloc_handler(size_t size)
+/* The zend heap handlers are specialized for the features that are set
+ * when profiling is enabled, so that the disabled ones cost nothing: the
+ * *_ex() functions are inlined with constant feature arguments in each
+ * variant of ZEND_HANDLER_VARIANTS. */
+#define VARIANT_IS_TRACKED_SIZE(min_size, size) (!(min_size) || ALLOC_IS_TRACKED_SIZE(size))
+
+static zend_always_inline void * zend_malloc_handler_ex(size_t size, zend_bool min_size, zend_bool trace)
 {
 	void *result;
 
@@ -637,13 +1423,19 @@ static void * zend_malloc_handler(size_t size)
 	WITHOUT_MALLOC_HOOKS {
 
 		result = zend_mm_alloc(orig_zheap, size);
-		if (result != NULL) {
-			alloc * a = alloc_buckets_alloc(&current_alloc_buckets, size);
-			if (track_mallocs) {
-				ALLOC_LIST_INSERT_HEAD(current_alloc_list, a);
+		if (result != NULL && EXPECTED(!memprof_paused)) {
+			if (VARIANT_IS_TRACKED_SIZE(min_size, size)) {
+				alloc * a = alloc_buckets_alloc(&current_alloc_buckets, size);
+				if (track_mallocs) {
+					ALLOC_ATTACH(a, current_frame);
+					TRACE_ALLOC(trace, result, size);
+				}
+				mark_own_alloc(&allocs_set, result, a);
+				assert(is_own_alloc(&allocs_set, result));
+				/* Untracked blocks are left out: their size is not known
+				 * when they are freed */
+				ALLOC_TRIGGER_ADD(size);
 			}
-			mark_own_alloc(&allocs_set, result, a);
-			assert(is_own_alloc(&allocs_set, result));
 		}
 
 	} END_WITHOUT_MALLOC_HOOKS;
@@ -651,7 +1443,7 @@ static void * zend_malloc_handler(size_t size)
 	return result;
 }
 
-static void zend_free_handler(void * ptr)
+static zend_always_inline void zend_free_handler_ex(void * ptr, zend_bool free_sites, zend_bool trace)
 {
 	assert(MEMPROF_G(profile_flags).enabled);
 
@@ -661,7 +1453,12 @@ static void zend_free_handler(void * ptr)
 			alloc * a;
 			if ((a = is_own_alloc(&allocs_set, ptr))) {
 				ALLOC_CHECK(a);
-				ALLOC_LIST_REMOVE(a);
+				ALLOC_TRIGGER_SUB(alloc_size(a));
+				if (free_sites) {
+					free_sites_record(a);
+				}
+				TRACE_FREE(trace, a, ptr);
+				ALLOC_DETACH(a);
 				zend_mm_free(orig_zheap, ptr);
 				unmark_own_alloc(&allocs_set, ptr);
 				alloc_buckets_free(&current_alloc_buckets, a);
@@ -673,7 +1470,7 @@ static void zend_free_handler(void * ptr)
 	} END_WITHOUT_MALLOC_HOOKS;
 }
 
-static void * zend_realloc_handler(void * ptr, size_t size)
+static zend_always_inline void * zend_realloc_handler_ex(void * ptr, size_t size, zend_bool min_size, zend_bool free_sites, zend_bool growth, zend_bool trace)
 {
 	void *result;
 	alloc *a;
@@ -684,30 +1481,72 @@ static void * zend_realloc_handler(void * ptr, size_t size)
 
 		if (ptr != NULL && !(a = is_own_alloc(&allocs_set, ptr))) {
 			result = zend_mm_realloc(orig_zheap, ptr, size);
-		} else {
-			/* ptr may be freed by realloc, so we must remove it from list now */
+			if (result != NULL && min_size && EXPECTED(!memprof_paused)) {
+				/* ptr may be a small block, it's tracked once it grows past
+				 * the threshold */
+				if (VARIANT_IS_TRACKED_SIZE(min_size, size)) {
+					a = alloc_buckets_alloc(&current_alloc_buckets, size);
+					if (track_mallocs) {
+						ALLOC_ATTACH(a, current_frame);
+						TRACE_ALLOC(trace, result, size);
+					}
+					mark_own_alloc(&allocs_set, result, a);
+					ALLOC_TRIGGER_ADD(size);
+				}
+			}
+		} else if (UNEXPECTED(memprof_paused)) {
 			if (ptr != NULL) {
 				ALLOC_CHECK(a);
-				ALLOC_LIST_REMOVE(a);
+				ALLOC_TRIGGER_SUB(alloc_size(a));
+				if (free_sites) {
+					free_sites_record(a);
+				}
+				TRACE_FREE(trace, a, ptr);
+				ALLOC_DETACH(a);
 				unmark_own_alloc(&allocs_set, ptr);
 				alloc_buckets_free(&current_alloc_buckets, a);
 			}
+			result = zend_mm_realloc(orig_zheap, ptr, size);
+		} else if (ptr != NULL) {
+			ALLOC_CHECK(a);
 
+			/* On failure, ptr is left untouched */
 			result = zend_mm_realloc(orig_zheap, ptr, size);
 			if (result != NULL) {
-				/* succeeded; add result */
-				a = alloc_buckets_alloc(&current_alloc_buckets, size);
-				if (track_mallocs) {
-					ALLOC_LIST_INSERT_HEAD(current_alloc_list, a);
+				ALLOC_TRIGGER_SUB(alloc_size(a));
+				if (VARIANT_IS_TRACKED_SIZE(min_size, size)) {
+					/* The record is updated in place. Growing strings and
+					 * arrays are often resized without moving. */
+					if (result != ptr) {
+						unmark_own_alloc(&allocs_set, ptr);
+						mark_own_alloc(&allocs_set, result, a);
+					}
+					TRACE_REALLOC(trace, a, ptr, result, size);
+					alloc_realloc_ex(a, size, growth);
+					ALLOC_TRIGGER_ADD(size);
+				} else {
+					/* shrunk below the threshold */
+					if (free_sites) {
+						free_sites_record(a);
+					}
+					TRACE_FREE(trace, a, ptr);
+					ALLOC_DETACH(a);
+					unmark_own_alloc(&allocs_set, ptr);
+					alloc_buckets_free(&current_alloc_buckets, a);
 				}
-				mark_own_alloc(&allocs_set, result, a);
-			} else if (ptr != NULL) {
-				/* failed, re-add ptr, since it hasn't been freed */
-				a = alloc_buckets_alloc(&current_alloc_buckets, size);
-				if (track_mallocs) {
-					ALLOC_LIST_INSERT_HEAD(current_alloc_list, a);
+			}
+		} else {
+			result = zend_mm_realloc(orig_zheap, ptr, size);
+			if (result != NULL) {
+				if (VARIANT_IS_TRACKED_SIZE(min_size, size)) {
+					a = alloc_buckets_alloc(&current_alloc_buckets, size);
+					if (track_mallocs) {
+						ALLOC_ATTACH(a, current_frame);
+						TRACE_ALLOC(trace, result, size);
+					}
+					mark_own_alloc(&allocs_set, result, a);
+					ALLOC_TRIGGER_ADD(size);
 				}
-				mark_own_alloc(&allocs_set, ptr, a);
 			}
 		}
 
@@ -716,937 +1555,4817 @@ static void * zend_realloc_handler(void * ptr, size_t size)
 	return result;
 }
 
-// Some extensions override zend_error_cb and don't call the previous
-// zend_error_cb, so memprof needs to be the last to override it
-static void memprof_late_override_error_cb() {
-	old_zend_error_cb = zend_error_cb;
-	zend_error_cb = memprof_zend_error_cb;
-	zend_error_cb_overridden = 1;
+/* suffix, memprof.min_tracked_size is set, memprof.free_sites,
+ * memprof.realloc_growth, the trace profile flag */
+#define ZEND_HANDLER_VARIANTS(X) \
+	X(_0_0_0_0, 0, 0, 0, 0) \
+	X(_0_0_0_1, 0, 0, 0, 1) \
+	X(_0_0_1_0, 0, 0, 1, 0) \
+	X(_0_0_1_1, 0, 0, 1, 1) \
+	X(_0_1_0_0, 0, 1, 0, 0) \
+	X(_0_1_0_1, 0, 1, 0, 1) \
+	X(_0_1_1_0, 0, 1, 1, 0) \
+	X(_0_1_1_1, 0, 1, 1, 1) \
+	X(_1_0_0_0, 1, 0, 0, 0) \
+	X(_1_0_0_1, 1, 0, 0, 1) \
+	X(_1_0_1_0, 1, 0, 1, 0) \
+	X(_1_0_1_1, 1, 0, 1, 1) \
+	X(_1_1_0_0, 1, 1, 0, 0) \
+	X(_1_1_0_1, 1, 1, 0, 1) \
+	X(_1_1_1_0, 1, 1, 1, 0) \
+	X(_1_1_1_1, 1, 1, 1, 1)
+
+#define ZEND_HANDLERS_DEFINE(suffix, min_size, free_sites, growth, trace) \
+	static void * zend_malloc_handler##suffix(size_t size) { \
+		return zend_malloc_handler_ex(size, min_size, trace); \
+	} \
+	static void zend_free_handler##suffix(void * ptr) { \
+		zend_free_handler_ex(ptr, free_sites, trace); \
+	} \
+	static void * zend_realloc_handler##suffix(void * ptr, size_t size) { \
+		return zend_realloc_handler_ex(ptr, size, min_size, free_sites, growth, trace); \
+	}
+
+ZEND_HANDLER_VARIANTS(ZEND_HANDLERS_DEFINE)
+
+typedef struct _memprof_zend_handlers {
+	void * (*malloc_handler)(size_t size);
+	void (*free_handler)(void * ptr);
+	void * (*realloc_handler)(void * ptr, size_t size);
+} memprof_zend_handlers;
+
+#define ZEND_HANDLERS_ENTRY(suffix, min_size, free_sites, growth, trace) \
+	{ zend_malloc_handler##suffix, zend_free_handler##suffix, zend_realloc_handler##suffix },
+
+/* Indexed by ZEND_HANDLERS_INDEX() */
+static const memprof_zend_handlers zend_handlers_variants[] = {
+	ZEND_HANDLER_VARIANTS(ZEND_HANDLERS_ENTRY)
+};
+
+#define ZEND_HANDLERS_INDEX(min_size, free_sites, growth, trace) \
+	((!!(min_size) << 3) | (!!(free_sites) << 2) | (!!(growth) << 1) | !!(trace))
+
+#if MEMPROF_DEBUG
+/* Handlers of the heap installed during dumps from the reserve when
+ * memprof.debug_failing_allocator is set. Dumps from the reserve must not
+ * allocate. */
+ZEND_NORETURN static void failing_allocation()
+{
+	fprintf(stderr, "memprof: heap used during a dump from the reserve\n");
+	abort();
 }
 
-static void memprof_zend_execute(zend_execute_data *execute_data)
+static void * failing_malloc_handler(size_t size)
 {
-	if (UNEXPECTED(!zend_error_cb_overridden)) {
-		memprof_late_override_error_cb();
-	}
+	failing_allocation();
+}
 
-	WITHOUT_MALLOC_TRACKING {
+static void failing_free_handler(void * ptr)
+{
+	failing_allocation();
+}
 
-		current_frame = get_or_create_frame(execute_data, current_frame);
-		current_frame->calls++;
-		current_alloc_list = &current_frame->allocs;
+static void * failing_realloc_handler(void * ptr, size_t size)
+{
+	failing_allocation();
+}
+#endif
 
-	} END_WITHOUT_MALLOC_TRACKING;
+static size_t zend_mm_heap_usage()
+{
+	size_t usage;
 
-	old_zend_execute(execute_data);
+	zend_mm_set_heap(orig_zheap);
+	usage = zend_memory_usage(0);
+	zend_mm_set_heap(zheap);
 
-	if (MEMPROF_G(profile_flags).enabled) {
-		current_frame = current_frame->prev;
-		current_alloc_list = &current_frame->allocs;
-	}
+	return usage;
 }
 
-static void memprof_zend_execute_internal(zend_execute_data *execute_data_ptr, zval *return_value)
+static void alloc_trigger_arm()
 {
-	int ignore = 0;
-
-	if (UNEXPECTED(!zend_error_cb_overridden)) {
-		memprof_late_override_error_cb();
-	}
+	alloc_trigger_next = MIN(dump_threshold_next, cgroup_check_next);
+}
 
-	if (&execute_data_ptr->func->internal_function == &zend_pass_function) {
-		ignore = 1;
-	} else if (execute_data_ptr->func->common.function_name) {
-		zend_string * name = execute_data_ptr->func->common.function_name;
-		if (ZSTR_LEN(name) == sizeof("call_user_func")-1
-				&& 0 == memcmp(name, "call_user_func", sizeof("call_user_func")))
-		{
-			ignore = 1;
-		} else if (ZSTR_LEN(name) == sizeof("call_user_func_array")-1
-				&& 0 == memcmp(name, "call_user_func_array", sizeof("call_user_func_array")))
-		{
-			ignore = 1;
-		}
-	}
+/* Sets dump_threshold_next so that alloc_trigger_fire() is called no later
+ * than when the heap usage reaches the next dump threshold */
+static void dump_thresholds_arm()
+{
+	size_t usage;
 
-	WITHOUT_MALLOC_TRACKING {
+	dump_threshold_next = SIZE_MAX;
 
-		if (!ignore) {
-			current_frame = get_or_create_frame(execute_data_ptr, current_frame);
-			current_frame->calls++;
-			current_alloc_list = &current_frame->allocs;
-		}
+	if (!orig_zheap || dump_threshold_index >= dump_threshold_sizes_count) {
+		return;
+	}
 
-	} END_WITHOUT_MALLOC_TRACKING;
+	usage = zend_mm_heap_usage();
 
-	if (!old_zend_execute_internal) {
-		execute_internal(execute_data_ptr, return_value);
-	} else {
-		old_zend_execute_internal(execute_data_ptr, return_value);
+	while (dump_threshold_index < dump_threshold_sizes_count && dump_threshold_sizes[dump_threshold_index] <= usage) {
+		dump_threshold_index++;
 	}
 
-	if (!ignore && MEMPROF_G(profile_flags).enabled) {
-		current_frame = current_frame->prev;
-		current_alloc_list = &current_frame->allocs;
+	if (dump_threshold_index < dump_threshold_sizes_count) {
+		/* alloc_trigger_usage only counts tracked blocks, so the heap can
+		 * grow faster (memprof.min_tracked_size) or slower (e.g. if blocks
+		 * allocated before profiling was enabled are freed), and this may
+		 * fire late or early. alloc_trigger_fire() re-checks the actual
+		 * usage. */
+		dump_threshold_next = alloc_trigger_usage + (dump_threshold_sizes[dump_threshold_index] - usage);
 	}
 }
 
-static zend_bool should_autodump(int error_type, const char *message) {
-	if (EXPECTED(error_type != E_ERROR)) {
-		return 0;
+static void cgroup_check_arm()
+{
+	if (orig_zheap && MEMPROF_G(cgroup_dump_ratio) > 0) {
+		cgroup_check_next = alloc_trigger_usage + CGROUP_CHECK_BYTES;
+	} else {
+		cgroup_check_next = SIZE_MAX;
 	}
+}
 
-	if (EXPECTED(!MEMPROF_G(profile_flags).dump_on_limit)) {
-		return 0;
+/* Dumping from an allocation handler is not safe, so alloc_trigger_fire()
+ * only schedules the work for the next VM interruption */
+static void alloc_trigger_fire()
+{
+	if (alloc_trigger_usage >= dump_threshold_next) {
+		if (dump_threshold_index < dump_threshold_sizes_count
+				&& zend_mm_heap_usage() >= dump_threshold_sizes[dump_threshold_index]) {
+			dump_threshold_pending = 1;
+			MEMPROF_VM_INTERRUPT();
+		}
+		dump_thresholds_arm();
 	}
 
-	if (EXPECTED(strncmp(MEMORY_LIMIT_ERROR_PREFIX, message, strlen(MEMORY_LIMIT_ERROR_PREFIX)) != 0)) {
-		return 0;
+	if (alloc_trigger_usage >= cgroup_check_next) {
+		cgroup_check_pending = 1;
+		MEMPROF_VM_INTERRUPT();
+		cgroup_check_arm();
 	}
 
-	return 1;
+	alloc_trigger_arm();
 }
 
-static char * generate_filename(const char * format) {
-	char * filename;
-	struct timeval tv;
-	uint64_t ts;
-	const char * output_dir = MEMPROF_G(output_dir);
-	char slash[] = "\0";
+static void dump_thresholds_init()
+{
+	size_t i, j;
+	size_t count = 0;
+	zend_long memory_limit = PG(memory_limit);
 
-	gettimeofday(&tv, NULL);
-	ts = ((uint64_t) tv.tv_sec) * 0x100000 + (((uint64_t) tv.tv_usec) % 0x100000);
+	for (i = 0; i < MEMPROF_G(dump_thresholds_count); i++) {
+		const memprof_dump_threshold * threshold = &MEMPROF_G(dump_thresholds)[i];
+		size_t size;
+
+		if (threshold->percent) {
+			if (memory_limit <= 0) {
+				/* no memory limit */
+				continue;
+			}
+			size = (size_t) memory_limit / 100 * threshold->value
+				+ (size_t) memory_limit % 100 * threshold->value / 100;
+		} else {
+			size = threshold->value;
+		}
 
-	if (!IS_SLASH(output_dir[strlen(output_dir)-1])) {
-		slash[0] = DEFAULT_SLASH;
+		for (j = count; j > 0 && dump_threshold_sizes[j-1] > size; j--) {
+			dump_threshold_sizes[j] = dump_threshold_sizes[j-1];
+		}
+		dump_threshold_sizes[j] = size;
+		count++;
 	}
 
-	spprintf(&filename, 0, "%s%smemprof.%s.%" PRIu64, output_dir, slash, format,  ts);
+	dump_threshold_sizes_count = count;
+	dump_threshold_index = 0;
 
-	return filename;
+	dump_thresholds_arm();
+	alloc_trigger_arm();
 }
 
-static void memprof_zend_error_cb_dump(MEMPROF_ZEND_ERROR_CB_ARGS)
-{
-	char * filename = NULL;
-	php_stream * stream;
-	zend_bool error = 0;
-#if PHP_VERSION_ID < 80000
-	const char * message_chr = format;
-#else
-	const char * message_chr = ZSTR_VAL(message);
-#endif
-	zend_string * new_message = NULL;
+// Some extensions override zend_error_cb and don't call the previous
+// zend_error_cb, so memprof needs to be the last to override it
+static void memprof_late_override_error_cb() {
+	old_zend_error_cb = zend_error_cb;
+	zend_error_cb = memprof_zend_error_cb;
+	zend_error_cb_overridden = 1;
+}
 
-	zend_mm_set_heap(orig_zheap);
-	zend_set_memory_limit((size_t)Z_L(-1) >> (size_t)Z_L(1));
-	zend_mm_set_heap(zheap);
+/* Parses memprof.passthrough_functions and memprof.collapse_namespaces.
+ * Names are compared case-insensitively. */
+static void passthrough_init()
+{
+	const char * functions = MEMPROF_G(passthrough_functions);
+	const char * namespaces = MEMPROF_G(collapse_namespaces);
+	char * list;
+	char * saveptr;
+	char * item;
+
+	zend_hash_init(&passthrough_names, 8, NULL, NULL, 0);
+	zend_hash_init(&collapse_prefixes, 8, NULL, NULL, 0);
+
+	if (functions != NULL && functions[0] != '\0') {
+		list = estrdup(functions);
+		for (item = strtok_r(list, ", ", &saveptr); item != NULL; item = strtok_r(NULL, ", ", &saveptr)) {
+			zend_str_tolower(item, strlen(item));
+			zend_hash_str_add_empty_element(&passthrough_names, item, strlen(item));
+		}
+		efree(list);
+	}
 
-	WITHOUT_MALLOC_TRACKING {
-		if (MEMPROF_G(output_format) == FORMAT_CALLGRIND) {
-			filename = generate_filename("callgrind");
-			stream = php_stream_open_wrapper_ex(filename, "w", 0, NULL, NULL);
-			if (stream != NULL) {
-				error = !dump_callgrind(stream);
-				php_stream_free(stream, PHP_STREAM_FREE_CLOSE);
-			} else {
-				error = 1;
+	if (namespaces != NULL && namespaces[0] != '\0') {
+		list = estrdup(namespaces);
+		for (item = strtok_r(list, ", ", &saveptr); item != NULL; item = strtok_r(NULL, ", ", &saveptr)) {
+			size_t len;
+			/* "Foo\Bar", "\Foo\Bar" and "Foo\Bar\" all match the names
+			 * in Foo\Bar\ */
+			while (*item == '\\') {
+				item++;
 			}
-		} else if (MEMPROF_G(output_format) == FORMAT_PPROF) {
-			filename = generate_filename("pprof");
-			stream = php_stream_open_wrapper_ex(filename, "w", 0, NULL, NULL);
-			if (stream != NULL) {
-				error = !dump_pprof(stream);
-				php_stream_free(stream, PHP_STREAM_FREE_CLOSE);
-			} else {
-				error = 1;
+			len = strlen(item);
+			while (len > 0 && item[len-1] == '\\') {
+				len--;
 			}
-		}
-
-		if (filename != NULL) {
-			if (error == 0) {
-				new_message = strpprintf(0, "%s (memprof dumped to %s)", message_chr, filename);
-			} else {
-				new_message = strpprintf(0, "%s (memprof failed dumping to %s, please check file permissions or disk capacity)", message_chr, filename);
+			if (len == 0) {
+				continue;
 			}
-			efree(filename);
-		}
-
-		if (new_message != NULL) {
-#if PHP_VERSION_ID < 80000
-			format = ZSTR_VAL(new_message);
-#else
-			message = new_message;
-#endif
+			item[len] = '\\';
+			zend_str_tolower(item, len);
+			zend_hash_str_add_empty_element(&collapse_prefixes, item, len + 1);
 		}
-	} END_WITHOUT_MALLOC_TRACKING;
+		efree(list);
+	}
 
-	zend_mm_set_heap(orig_zheap);
-	zend_set_memory_limit(PG(memory_limit));
-	zend_mm_set_heap(zheap);
+	passthrough_enabled = zend_hash_num_elements(&passthrough_names) > 0
+		|| zend_hash_num_elements(&collapse_prefixes) > 0;
+}
 
-	old_zend_error_cb(MEMPROF_ZEND_ERROR_CB_ARGS_PASSTHRU);
+static void passthrough_destroy()
+{
+	Word_t ret;
 
-	WITHOUT_MALLOC_TRACKING {
-		if (new_message != NULL) {
-			zend_string_free(new_message);
-		}
-	} END_WITHOUT_MALLOC_TRACKING;
+	zend_hash_destroy(&passthrough_names);
+	zend_hash_destroy(&collapse_prefixes);
 
+	JLFA(ret, passthrough_cache);
+	passthrough_cache = (Pvoid_t) NULL;
+	passthrough_enabled = 0;
 }
 
-static void memprof_zend_error_cb(MEMPROF_ZEND_ERROR_CB_ARGS)
+static zend_bool function_match_passthrough(zend_function * func)
 {
-#if PHP_VERSION_ID < 80000
-	const char * message_chr = format;
-#else
-	const char * message_chr = ZSTR_VAL(message);
-#endif
+	char name[512];
+	size_t len;
+	zend_string * prefix;
 
-	if (EXPECTED(!MEMPROF_G(profile_flags).enabled)) {
-		old_zend_error_cb(MEMPROF_ZEND_ERROR_CB_ARGS_PASSTHRU);
-		return;
+	if (func->common.function_name == NULL) {
+		/* main script or include */
+		return 0;
 	}
 
-	if (EXPECTED(!should_autodump(type, message_chr))) {
-		old_zend_error_cb(MEMPROF_ZEND_ERROR_CB_ARGS_PASSTHRU);
-		return;
+	if (func->common.scope != NULL) {
+		len = snprintf(name, sizeof(name), "%s::%s", ZSTR_VAL(func->common.scope->name), ZSTR_VAL(func->common.function_name));
+	} else {
+		len = snprintf(name, sizeof(name), "%s", ZSTR_VAL(func->common.function_name));
+	}
+	if (len >= sizeof(name)) {
+		len = sizeof(name) - 1;
 	}
 
-	return memprof_zend_error_cb_dump(MEMPROF_ZEND_ERROR_CB_ARGS_PASSTHRU);
+	zend_str_tolower(name, len);
+
+	if (zend_hash_str_exists(&passthrough_names, name, len)) {
+		return 1;
+	}
+
+	ZEND_HASH_FOREACH_STR_KEY(&collapse_prefixes, prefix) {
+		if (ZSTR_LEN(prefix) <= len && memcmp(ZSTR_VAL(prefix), name, ZSTR_LEN(prefix)) == 0) {
+			return 1;
+		}
+	} ZEND_HASH_FOREACH_END();
+
+	return 0;
 }
 
-static PHP_INI_MH(OnChangeMemoryLimit)
+/* Whether calls to func are attributed to the caller. The decision is
+ * cached by function pointer, so that the lookup is done once per
+ * function. */
+static zend_bool function_is_passthrough(zend_function * func)
 {
-	int ret;
+	Word_t * p;
+	zend_bool match;
 
-	if (!origOnChangeMemoryLimit) {
-		return FAILURE;
+	if (UNEXPECTED(func->common.fn_flags & ZEND_ACC_CLOSURE)) {
+		/* Closures are copied per object, and their address may be reused
+		 * by an unrelated closure */
+		return function_match_passthrough(func);
 	}
 
-	ret = origOnChangeMemoryLimit(entry, new_value, mh_arg1, mh_arg2, mh_arg3, stage);
-
-	if (ret != SUCCESS) {
-		return ret;
+	JLG(p, passthrough_cache, (Word_t) func);
+	if (EXPECTED(p != NULL)) {
+		return *p == PASSTHROUGH_YES;
 	}
 
-	if (MEMPROF_G(profile_flags).enabled && orig_zheap) {
-		zend_mm_set_heap(orig_zheap);
-		zend_set_memory_limit(PG(memory_limit));
-		zend_mm_set_heap(zheap);
-	}
+	match = function_match_passthrough(func);
 
-	return SUCCESS;
+	WITHOUT_MALLOC_TRACKING {
+		JLI(p, passthrough_cache, (Word_t) func);
+		*p = match ? PASSTHROUGH_YES : PASSTHROUGH_NO;
+	} END_WITHOUT_MALLOC_TRACKING;
+
+	return match;
 }
 
-static void memprof_enable(memprof_profile_flags * pf)
+#if PHP_VERSION_ID >= 80100
+/* Frame cursor and active calls of a fiber context. The entries of the
+ * running fiber are on top of those of the context that resumed it in
+ * peak_stack; they are saved here when the fiber suspends. Generators need
+ * nothing of the sort: they run on the stack of the function that resumes
+ * them. */
+typedef struct _fiber_state {
+	zend_fiber_context * resumer;	/* NULL if not running */
+	frame * current_frame;			/* NULL if never switched from */
+	uint32_t peak_base;
+	peak_entry * peaks;
+	uint32_t peaks_len;
+	uint32_t peaks_size;
+	uint32_t trace_id;				/* 0 if not in the trace yet */
+} fiber_state;
+
+/* Maps zend_fiber_context pointers to fiber_state */
+static Pvoid_t fiber_states = (Pvoid_t) NULL;
+
+static fiber_state * fiber_state_get(zend_fiber_context * context)
 {
-	assert(pf->enabled);
+	Word_t * p;
 
-	alloc_buckets_init(&current_alloc_buckets);
+	JLI(p, fiber_states, (Word_t) context);
+	if (*p == 0) {
+		fiber_state * s = malloc_check(sizeof(*s));
+		memset(s, 0, sizeof(*s));
+		*p = (Word_t) s;
+	}
 
-	init_frame(&root_frame, &root_frame, "root", sizeof("root")-1);
-	root_frame.calls = 1;
+	return (fiber_state *) *p;
+}
 
-	current_frame = &root_frame;
-	current_alloc_list = &root_frame.allocs;
+/* Moves the entries of the running fiber from peak_stack to s */
+static void fiber_peaks_save(fiber_state * s)
+{
+	uint32_t n = peak_stack_len - peak_base;
+	uint32_t i;
 
-	if (pf->native) {
-		MALLOC_HOOK_SAVE_OLD();
-		MALLOC_HOOK_SET_OWN();
+	if (n > s->peaks_size) {
+		s->peaks = realloc_check(s->peaks, safe_size(n, sizeof(*s->peaks), 0));
+		s->peaks_size = n;
 	}
 
-	memprof_dumped = 0;
-
-	if (is_zend_mm()) {
-		/* There is no way to completely free a zend_mm_heap with custom
-		 * handlers, so we have to allocate it ourselves. We don't know the
-		 * actual size of a _zend_mm_heap struct, but this should be enough. */
-		zheap = malloc_check(zend_mm_heap_size);
-		memset(zheap, 0, zend_mm_heap_size);
-		zend_mm_set_custom_handlers(zheap, zend_malloc_handler, zend_free_handler, zend_realloc_handler);
-		orig_zheap = zend_mm_set_heap(zheap);
-	} else {
-		zheap = NULL;
-		orig_zheap = NULL;
+	for (i = peak_stack_len; i > peak_base; i--) {
+		peak_entry * e = &peak_stack[i-1];
+		e->f->peak_entry = e->prev_entry;
 	}
 
-	old_zend_execute = zend_execute_fn;
-	old_zend_execute_internal = zend_execute_internal;
-	zend_execute_fn = memprof_zend_execute;
-	zend_execute_internal = memprof_zend_execute_internal;
-
-	track_mallocs = 1;
+	memcpy(s->peaks, &peak_stack[peak_base], n * sizeof(*s->peaks));
+	s->peaks_len = n;
+	peak_stack_len = peak_base;
 }
 
-static void memprof_disable()
+static void fiber_peaks_restore(fiber_state * s)
 {
-	track_mallocs = 0;
+	uint32_t i;
 
-	zend_execute_fn = old_zend_execute;
-	zend_execute_internal = old_zend_execute_internal;
+	for (i = 0; i < s->peaks_len; i++) {
+		peak_entry * e;
 
-	if (zheap) {
-		zend_mm_set_heap(orig_zheap);
-		free(zheap);
+		peaks_push(s->peaks[i].f);
+		e = &peak_stack[peak_stack_len-1];
+		e->cur = s->peaks[i].cur;
+		e->max = s->peaks[i].max;
 	}
 
-	if (MEMPROF_G(profile_flags).native) {
-		MALLOC_HOOK_RESTORE_OLD();
+	s->peaks_len = 0;
+}
+
+static void memprof_fiber_switch(zend_fiber_context * from, zend_fiber_context * to)
+{
+	if (!MEMPROF_G(profile_flags).enabled) {
+		return;
 	}
 
-	MEMPROF_G(profile_flags).enabled = 0;
+	WITHOUT_MALLOC_TRACKING {
 
-	destroy_frame(&root_frame);
+		fiber_state * from_state = fiber_state_get(from);
+		fiber_state * to_state = fiber_state_get(to);
 
-	alloc_buckets_destroy(&current_alloc_buckets);
+		from_state->current_frame = current_frame;
 
-	JudyLFreeArray(&allocs_set, PJE0);
-	allocs_set = (Pvoid_t) NULL;
+		if (from_state->resumer == to) {
+			/* from suspended or returned */
+			fiber_peaks_save(from_state);
+			from_state->resumer = NULL;
+		} else {
+			/* to starts or resumes. A fiber that starts continues from
+			 * the frame of Fiber::start(). */
+			to_state->resumer = from;
+			to_state->peak_base = peak_stack_len;
+			fiber_peaks_restore(to_state);
+		}
 
-	if (!memprof_dumped) {
-		// Calling this during RSHUTDOWN breaks zend_deactivate_modules(), which
-		// causes corruption of global state.
-		// zend_error(E_WARNING, "Memprof profiling was enabled, but no profile was dumped. Did you forget to call one of memprof_dump_callgrind(), memprof_dump_pprof(), or memprof_dump_array() ?");
-	}
+		if (to_state->current_frame != NULL) {
+			current_frame = to_state->current_frame;
+		}
+		peak_base = to_state->peak_base;
+
+		if (UNEXPECTED(trace_enabled)) {
+			if (from_state->trace_id == 0) {
+				from_state->trace_id = ++event_trace.contexts;
+			}
+			if (to_state->trace_id == 0) {
+				to_state->trace_id = ++event_trace.contexts;
+			}
+			trace_switch(&event_trace, to_state->trace_id, trace_frame_id(current_frame));
+		}
+
+	} END_WITHOUT_MALLOC_TRACKING;
 }
 
-static void disable_opcache()
+static void fiber_state_free(fiber_state * s)
 {
-	zend_string *key = zend_string_init(ZEND_STRL("opcache.enable"), 0);
-	zend_alter_ini_entry_chars_ex(
-		key,
+	free(s->peaks);
+	free(s);
+}
+
+static void memprof_fiber_destroy(zend_fiber_context * context)
+{
+	Word_t * p;
+	int ret;
+
+	if (fiber_states == NULL) {
+		return;
+	}
+
+	WITHOUT_MALLOC_TRACKING {
+
+		JLG(p, fiber_states, (Word_t) context);
+		if (p != NULL) {
+			fiber_state_free((fiber_state *) *p);
+			JLD(ret, fiber_states, (Word_t) context);
+		}
+
+	} END_WITHOUT_MALLOC_TRACKING;
+}
+
+static void fiber_states_destroy()
+{
+	Word_t index = 0;
+	Word_t * p;
+
+	JLF(p, fiber_states, index);
+	while (p != NULL) {
+		fiber_state_free((fiber_state *) *p);
+		JLN(p, fiber_states, index);
+	}
+
+	JudyLFreeArray(&fiber_states, PJE0);
+	fiber_states = (Pvoid_t) NULL;
+}
+#endif /* PHP_VERSION_ID >= 80100 */
+
+static void memprof_zend_execute(zend_execute_data *execute_data)
+{
+	int ignore = memprof_paused;
+	frame * prev_frame = current_frame;
+	uint32_t peak_depth = peak_stack_len - peak_base;
+	uint32_t generation = profile_generation;
+
+	if (UNEXPECTED(!zend_error_cb_overridden)) {
+		memprof_late_override_error_cb();
+	}
+
+	if (!ignore && passthrough_enabled && function_is_passthrough(execute_data->func)) {
+		ignore = 1;
+	}
+
+	if (!ignore) {
+		WITHOUT_MALLOC_TRACKING {
+
+			current_frame = get_or_create_frame(execute_data, current_frame);
+			current_frame->calls++;
+			frame_touch(current_frame);
+			peaks_push(current_frame);
+			if (UNEXPECTED(trace_enabled)) {
+				trace_call(&event_trace, TRACE_EVENT_ENTER, trace_frame_id(current_frame));
+			}
+
+		} END_WITHOUT_MALLOC_TRACKING;
+
+		if (UNEXPECTED(delta_interval > 0) && ++delta_calls >= DELTA_CHECK_CALLS) {
+			delta_calls = 0;
+			delta_timed_dump();
+		}
+	}
+
+	old_zend_execute(execute_data);
+
+	if (!ignore && MEMPROF_G(profile_flags).enabled && generation == profile_generation) {
+		peaks_pop(peak_base + peak_depth);
+		current_frame = prev_frame;
+		if (UNEXPECTED(trace_enabled)) {
+			trace_call(&event_trace, TRACE_EVENT_EXIT, trace_frame_id(prev_frame));
+		}
+	}
+}
+
+static void memprof_zend_execute_internal(zend_execute_data *execute_data_ptr, zval *return_value)
+{
+	int ignore = 0;
+	frame * prev_frame = current_frame;
+	uint32_t peak_depth = peak_stack_len - peak_base;
+	uint32_t generation = profile_generation;
+
+	if (UNEXPECTED(!zend_error_cb_overridden)) {
+		memprof_late_override_error_cb();
+	}
+
+	if (memprof_paused) {
+		ignore = 1;
+	} else if (&execute_data_ptr->func->internal_function == &zend_pass_function) {
+		ignore = 1;
+	} else if (passthrough_enabled && function_is_passthrough(execute_data_ptr->func)) {
+		ignore = 1;
+	}
+
+	WITHOUT_MALLOC_TRACKING {
+
+		if (!ignore) {
+			current_frame = get_or_create_frame(execute_data_ptr, current_frame);
+			current_frame->calls++;
+			frame_touch(current_frame);
+			peaks_push(current_frame);
+			if (UNEXPECTED(trace_enabled)) {
+				trace_call(&event_trace, TRACE_EVENT_ENTER, trace_frame_id(current_frame));
+			}
+		}
+
+	} END_WITHOUT_MALLOC_TRACKING;
+
+	if (!old_zend_execute_internal) {
+		execute_internal(execute_data_ptr, return_value);
+	} else {
+		old_zend_execute_internal(execute_data_ptr, return_value);
+	}
+
+	if (!ignore && MEMPROF_G(profile_flags).enabled && generation == profile_generation) {
+		peaks_pop(peak_base + peak_depth);
+		current_frame = prev_frame;
+		if (UNEXPECTED(trace_enabled)) {
+			trace_call(&event_trace, TRACE_EVENT_EXIT, trace_frame_id(prev_frame));
+		}
+	}
+}
+
+static zend_bool should_autodump(int error_type, const char *message) {
+	if (EXPECTED(error_type != E_ERROR)) {
+		return 0;
+	}
+
+	if (EXPECTED(!MEMPROF_G(profile_flags).dump_on_limit)) {
+		return 0;
+	}
+
+	if (EXPECTED(strncmp(MEMORY_LIMIT_ERROR_PREFIX, message, strlen(MEMORY_LIMIT_ERROR_PREFIX)) != 0)) {
+		return 0;
+	}
+
+	return 1;
+}
+
+static const char * compression_suffix(memprof_compression compression) {
+	switch (compression) {
+		case COMPRESSION_GZIP:
+			return ".gz";
+		case COMPRESSION_ZSTD:
+			return ".zst";
+		default:
+			return "";
+	}
+}
+
+/* Snapshots are mapped by readers and timelines are appended to, so they are
+ * never compressed */
+static memprof_compression dump_compression(dump_func dump) {
+	if (dump == dump_snapshot || dump == dump_delta) {
+		return COMPRESSION_NONE;
+	}
+	return MEMPROF_G(output_compression);
+}
+
+/* Dump files are named <output_dir>/memprof.<format>.<timestamp><suffix> */
+#define DUMP_FILENAME_FORMAT "%s%smemprof.%s.%" PRIu64 "%s"
+
+static uint64_t dump_filename_ts() {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return ((uint64_t) tv.tv_sec) * 0x100000 + (((uint64_t) tv.tv_usec) % 0x100000);
+}
+
+static const char * dump_filename_slash(const char * output_dir) {
+	static const char slash[] = { DEFAULT_SLASH, '\0' };
+
+	return IS_SLASH(output_dir[strlen(output_dir)-1]) ? "" : slash;
+}
+
+static char * generate_filename(const char * format, memprof_compression compression) {
+	char * filename;
+	const char * output_dir = MEMPROF_G(output_dir);
+
+	spprintf(&filename, 0, DUMP_FILENAME_FORMAT, output_dir, dump_filename_slash(output_dir),
+			format, dump_filename_ts(), compression_suffix(compression));
+
+	return filename;
+}
+
+/* Same as generate_filename(), without allocating. Returns 0 if the name
+ * doesn't fit in buf. */
+static zend_bool format_filename(char * buf, size_t size, const char * format, memprof_compression compression) {
+	const char * output_dir = MEMPROF_G(output_dir);
+	int len;
+
+	len = snprintf(buf, size, DUMP_FILENAME_FORMAT, output_dir, dump_filename_slash(output_dir),
+			format, dump_filename_ts(), compression_suffix(compression));
+
+	return len >= 0 && (size_t) len < size;
+}
+
+/* Dumps to stream, compressed according to memprof.output_compression */
+static zend_bool dump_to_stream(php_stream * stream, dump_func dump, frame * root)
+{
+	memprof_writer w;
+	zend_bool success;
+
+	writer_init(&w, stream, dump_compression(dump));
+
+	if (root == &root_frame) {
+		peaks_flush();
+	}
+
+	success = dump(&w, root);
+
+	return writer_close(&w) && success;
+}
+
+/* Dumps the profile to a new file in memprof.output_dir. *filename_p is set
+ * to the name of the file, or to NULL if the output format is unknown. */
+static zend_bool dump_to_output_dir(char ** filename_p)
+{
+	char * filename = NULL;
+	php_stream * stream;
+	dump_func dump = NULL;
+	zend_bool error = 0;
+
+	if (MEMPROF_G(output_format) == FORMAT_CALLGRIND) {
+		dump = dump_callgrind;
+		filename = generate_filename("callgrind", dump_compression(dump));
+	} else if (MEMPROF_G(output_format) == FORMAT_PPROF) {
+		dump = dump_pprof;
+		filename = generate_filename("pprof", dump_compression(dump));
+	} else if (MEMPROF_G(output_format) == FORMAT_FOLDED) {
+		dump = dump_folded;
+		filename = generate_filename("folded", dump_compression(dump));
+	} else if (MEMPROF_G(output_format) == FORMAT_SNAPSHOT) {
+		dump = dump_snapshot;
+		filename = generate_filename("snapshot", dump_compression(dump));
+	}
+
+	if (filename != NULL) {
+		stream = php_stream_open_wrapper_ex(filename, "w", 0, NULL, NULL);
+		if (stream != NULL) {
+			error = !dump_to_stream(stream, dump, &root_frame);
+			php_stream_free(stream, PHP_STREAM_FREE_CLOSE);
+		} else {
+			error = 1;
+		}
+	}
+
+	*filename_p = filename;
+
+	return !error;
+}
+
+/* Dumps the profile to a new file in memprof.output_dir, using only the
+ * reserve. Returns 0 without dumping if the reserve can't be used with the
+ * current settings: compression and the pprof and snapshot formats need
+ * memory. Otherwise, *error_p is set if the dump failed, and the name of
+ * the file is in reserve->filename. */
+static zend_bool reserve_dump_to_output_dir(zend_bool * error_p)
+{
+	memprof_writer w;
+	dump_func dump;
+	const char * format;
+	zend_bool success;
+	int fd;
+
+	if (reserve == NULL || MEMPROF_G(output_compression) != COMPRESSION_NONE) {
+		return 0;
+	}
+
+	if (MEMPROF_G(output_format) == FORMAT_CALLGRIND) {
+		dump = dump_callgrind;
+		format = "callgrind";
+	} else if (MEMPROF_G(output_format) == FORMAT_FOLDED) {
+		dump = dump_folded;
+		format = "folded";
+	} else {
+		return 0;
+	}
+
+	if (!format_filename(reserve->filename, sizeof(reserve->filename), format, COMPRESSION_NONE)) {
+		*error_p = 1;
+		return 1;
+	}
+
+	fd = open(reserve->filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd == -1) {
+		*error_p = 1;
+		return 1;
+	}
+
+#if MEMPROF_DEBUG
+	if (failing_zheap != NULL) {
+		zend_mm_set_heap(failing_zheap);
+	}
+#endif
+
+	reserve_dumping = 1;
+
+	writer_init_fd(&w, fd, reserve->buf);
+	peaks_flush();
+	success = dump(&w, &root_frame);
+	success = writer_close(&w) && success;
+
+	reserve_dumping = 0;
+
+#if MEMPROF_DEBUG
+	if (failing_zheap != NULL) {
+		zend_mm_set_heap(zheap);
+	}
+#endif
+
+	if (close(fd) != 0) {
+		success = 0;
+	}
+
+	*error_p = !success;
+
+	return 1;
+}
+
+/* Makes a copy of the error message of the memory limit, with the result of
+ * the autodump, in the reserve. The copy is flagged as interned, so the
+ * engine doesn't try to free it. */
+#if PHP_VERSION_ID < 80000
+static const char * reserve_error_message(const char * message, zend_bool error)
+#else
+static zend_string * reserve_error_message(const char * message, zend_bool error)
+#endif
+{
+	char * buf = ZSTR_VAL(&reserve->message.str);
+	size_t size = AUTODUMP_MESSAGE_SIZE;
+	int len;
+
+	reserve->message_used = 1;
+
+	if (error == 0) {
+		len = snprintf(buf, size, "%s (memprof dumped to %s)", message, reserve->filename);
+	} else {
+		len = snprintf(buf, size, "%s (memprof failed dumping to %s, please check file permissions or disk capacity)", message, reserve->filename);
+	}
+
+	if (len < 0) {
+		len = 0;
+		buf[0] = '\0';
+	} else if ((size_t) len >= size) {
+		len = size - 1;
+	}
+
+#if PHP_VERSION_ID < 80000
+	return buf;
+#else
+	GC_SET_REFCOUNT(&reserve->message.str, 1);
+	GC_TYPE_INFO(&reserve->message.str) = GC_STRING | ((IS_STR_INTERNED | IS_STR_PERSISTENT) << GC_FLAGS_SHIFT);
+	ZSTR_H(&reserve->message.str) = 0;
+	ZSTR_LEN(&reserve->message.str) = len;
+
+	return &reserve->message.str;
+#endif
+}
+
+static void memprof_zend_error_cb_dump(MEMPROF_ZEND_ERROR_CB_ARGS)
+{
+	char * filename = NULL;
+	zend_bool error = 0;
+#if PHP_VERSION_ID < 80000
+	const char * message_chr = format;
+#else
+	const char * message_chr = ZSTR_VAL(message);
+#endif
+	zend_string * new_message = NULL;
+
+	zend_mm_set_heap(orig_zheap);
+	zend_set_memory_limit((size_t)Z_L(-1) >> (size_t)Z_L(1));
+	zend_mm_set_heap(zheap);
+
+	WITHOUT_MALLOC_TRACKING {
+		if (reserve_dump_to_output_dir(&error)) {
+#if PHP_VERSION_ID < 80000
+			format = reserve_error_message(message_chr, error);
+#else
+			message = reserve_error_message(message_chr, error);
+#endif
+			break;
+		}
+
+		error = !dump_to_output_dir(&filename);
+
+		if (filename != NULL) {
+			if (error == 0) {
+				new_message = strpprintf(0, "%s (memprof dumped to %s)", message_chr, filename);
+			} else {
+				new_message = strpprintf(0, "%s (memprof failed dumping to %s, please check file permissions or disk capacity)", message_chr, filename);
+			}
+			efree(filename);
+		}
+
+		if (new_message != NULL) {
+#if PHP_VERSION_ID < 80000
+			format = ZSTR_VAL(new_message);
+#else
+			message = new_message;
+#endif
+		}
+	} END_WITHOUT_MALLOC_TRACKING;
+
+	zend_mm_set_heap(orig_zheap);
+	zend_set_memory_limit(PG(memory_limit));
+	zend_mm_set_heap(zheap);
+
+	old_zend_error_cb(MEMPROF_ZEND_ERROR_CB_ARGS_PASSTHRU);
+
+	WITHOUT_MALLOC_TRACKING {
+		if (new_message != NULL) {
+			zend_string_free(new_message);
+		}
+	} END_WITHOUT_MALLOC_TRACKING;
+
+}
+
+static void memprof_zend_error_cb(MEMPROF_ZEND_ERROR_CB_ARGS)
+{
+#if PHP_VERSION_ID < 80000
+	const char * message_chr = format;
+#else
+	const char * message_chr = ZSTR_VAL(message);
+#endif
+
+	if (EXPECTED(!MEMPROF_G(profile_flags).enabled)) {
+		old_zend_error_cb(MEMPROF_ZEND_ERROR_CB_ARGS_PASSTHRU);
+		return;
+	}
+
+	if (EXPECTED(!should_autodump(type, message_chr))) {
+		old_zend_error_cb(MEMPROF_ZEND_ERROR_CB_ARGS_PASSTHRU);
+		return;
+	}
+
+	return memprof_zend_error_cb_dump(MEMPROF_ZEND_ERROR_CB_ARGS_PASSTHRU);
+}
+
+static void memprof_triggered_dump()
+{
+	char * filename = NULL;
+	time_t now = time(NULL);
+
+	if (last_triggered_dump != 0 && now - last_triggered_dump < MEMPROF_G(dump_min_interval)) {
+		return;
+	}
+
+	last_triggered_dump = now;
+
+	/* The dump itself must not hit the memory limit */
+	zend_mm_set_heap(orig_zheap);
+	zend_set_memory_limit((size_t)Z_L(-1) >> (size_t)Z_L(1));
+	zend_mm_set_heap(zheap);
+
+	WITHOUT_MALLOC_TRACKING {
+		zend_bool error;
+
+		if (reserve_dump_to_output_dir(&error)) {
+			break;
+		}
+
+		dump_to_output_dir(&filename);
+		if (filename != NULL) {
+			efree(filename);
+		}
+	} END_WITHOUT_MALLOC_TRACKING;
+
+	zend_mm_set_heap(orig_zheap);
+	zend_set_memory_limit(PG(memory_limit));
+	zend_mm_set_heap(zheap);
+}
+
+static const char * cgroup_dir()
+{
+	if (MEMPROF_G(cgroup_dir) != NULL && MEMPROF_G(cgroup_dir)[0] != '\0') {
+		return MEMPROF_G(cgroup_dir);
+	}
+
+	if (!cgroup_dir_detected) {
+		if (!cgroup_detect_dir(cgroup_dir_buf, sizeof(cgroup_dir_buf))) {
+			cgroup_dir_buf[0] = '\0';
+		}
+		cgroup_dir_detected = 1;
+	}
+
+	return cgroup_dir_buf[0] != '\0' ? cgroup_dir_buf : NULL;
+}
+
+static uint64_t monotonic_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Dumps the profile if the cgroup of the process is under memory pressure
+ * and this process is one of the largest of the cgroup */
+static void memprof_cgroup_check()
+{
+	const char * dir;
+	uint64_t now = monotonic_ms();
+	uint64_t current;
+	uint64_t max;
+	uint64_t events;
+	zend_bool pressure = 0;
+
+	if (last_cgroup_check != 0 && now - last_cgroup_check < (uint64_t) MEMPROF_G(cgroup_check_interval)) {
+		return;
+	}
+
+	last_cgroup_check = now;
+
+	dir = cgroup_dir();
+	if (dir == NULL) {
+		return;
+	}
+
+	if (cgroup_read_memory(dir, &current, &max) && max != 0) {
+		pressure = (double) current >= (double) max * MEMPROF_G(cgroup_dump_ratio);
+	}
+
+	if (cgroup_read_memory_events(dir, &events)) {
+		if (cgroup_events_read && events > last_cgroup_events) {
+			pressure = 1;
+		}
+		last_cgroup_events = events;
+		cgroup_events_read = 1;
+	}
+
+	if (!pressure) {
+		return;
+	}
+
+	if (cgroup_process_rank(dir, getpid()) >= (size_t) MEMPROF_G(cgroup_dump_top)) {
+		return;
+	}
+
+	memprof_triggered_dump();
+}
+
+static void memprof_zend_interrupt_function(zend_execute_data *execute_data)
+{
+	if (UNEXPECTED(dump_threshold_pending)) {
+		dump_threshold_pending = 0;
+		if (MEMPROF_G(profile_flags).enabled) {
+			memprof_triggered_dump();
+		}
+	}
+
+	if (UNEXPECTED(cgroup_check_pending)) {
+		cgroup_check_pending = 0;
+		if (MEMPROF_G(profile_flags).enabled) {
+			WITHOUT_MALLOC_TRACKING {
+				memprof_cgroup_check();
+			} END_WITHOUT_MALLOC_TRACKING;
+		}
+	}
+
+	if (old_zend_interrupt_function) {
+		old_zend_interrupt_function(execute_data);
+	}
+}
+
+static PHP_INI_MH(OnChangeMemoryLimit)
+{
+	int ret;
+
+	if (!origOnChangeMemoryLimit) {
+		return FAILURE;
+	}
+
+	ret = origOnChangeMemoryLimit(entry, new_value, mh_arg1, mh_arg2, mh_arg3, stage);
+
+	if (ret != SUCCESS) {
+		return ret;
+	}
+
+	if (MEMPROF_G(profile_flags).enabled && orig_zheap) {
+		zend_mm_set_heap(orig_zheap);
+		zend_set_memory_limit(PG(memory_limit));
+		zend_mm_set_heap(zheap);
+
+		/* Percentages of memory_limit have to be resolved again */
+		dump_thresholds_init();
+	}
+
+	return SUCCESS;
+}
+
+/* Parses a comma-separated list of sizes (optionally suffixed by K, M, or G)
+ * or of percentages of memory_limit */
+static zend_bool parse_dump_thresholds(const char * str, memprof_dump_threshold * thresholds, size_t * count)
+{
+	const char * p = str;
+	char * end;
+	size_t n = 0;
+
+	for (;;) {
+		unsigned long long value;
+		unsigned int shift = 0;
+		zend_bool percent = 0;
+
+		while (*p == ' ' || *p == ',') {
+			p++;
+		}
+
+		if (*p == '\0') {
+			break;
+		}
+
+		if (n == MEMPROF_MAX_DUMP_THRESHOLDS || *p < '0' || *p > '9') {
+			return 0;
+		}
+
+		errno = 0;
+		value = strtoull(p, &end, 10);
+		if (errno != 0) {
+			return 0;
+		}
+		p = end;
+
+		switch (*p) {
+			case '%':
+				percent = 1;
+				p++;
+				break;
+			case 'k':
+			case 'K':
+				shift = 10;
+				p++;
+				break;
+			case 'm':
+			case 'M':
+				shift = 20;
+				p++;
+				break;
+			case 'g':
+			case 'G':
+				shift = 30;
+				p++;
+				break;
+		}
+
+		if (*p != '\0' && *p != ',' && *p != ' ') {
+			return 0;
+		}
+
+		if (percent && (value == 0 || value > 100)) {
+			return 0;
+		}
+
+		if (value > (SIZE_MAX >> shift)) {
+			return 0;
+		}
+
+		thresholds[n].value = (size_t) value << shift;
+		thresholds[n].percent = percent;
+		n++;
+	}
+
+	*count = n;
+
+	return 1;
+}
+
+static zend_bool parse_output_format(const char * value, memprof_output_format * format)
+{
+	if (strcmp(value, "callgrind") == 0) {
+		*format = FORMAT_CALLGRIND;
+	} else if (strcmp(value, "pprof") == 0) {
+		*format = FORMAT_PPROF;
+	} else if (strcmp(value, "folded") == 0) {
+		*format = FORMAT_FOLDED;
+	} else if (strcmp(value, "snapshot") == 0) {
+		*format = FORMAT_SNAPSHOT;
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+static dump_func format_dump_func(memprof_output_format format)
+{
+	switch (format) {
+		case FORMAT_PPROF:
+			return dump_pprof;
+		case FORMAT_FOLDED:
+			return dump_folded;
+		case FORMAT_SNAPSHOT:
+			return dump_snapshot;
+		default:
+			return dump_callgrind;
+	}
+}
+
+static PHP_INI_MH(OnUpdateOutputFormat)
+{
+	const char * value = new_value ? ZSTR_VAL(new_value) : "";
+
+	if (!parse_output_format(value, &MEMPROF_G(output_format))) {
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+static PHP_INI_MH(OnUpdateOutputCompression)
+{
+	const char * value = new_value ? ZSTR_VAL(new_value) : "";
+
+	if (value[0] == '\0' || strcmp(value, "none") == 0) {
+		MEMPROF_G(output_compression) = COMPRESSION_NONE;
+#if HAVE_MEMPROF_ZLIB
+	} else if (strcmp(value, "gzip") == 0) {
+		MEMPROF_G(output_compression) = COMPRESSION_GZIP;
+#endif
+#if HAVE_MEMPROF_ZSTD
+	} else if (strcmp(value, "zstd") == 0) {
+		MEMPROF_G(output_compression) = COMPRESSION_ZSTD;
+#endif
+	} else {
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+static PHP_INI_MH(OnUpdateCgroupDumpRatio)
+{
+	int ret = OnUpdateReal(entry, new_value, mh_arg1, mh_arg2, mh_arg3, stage);
+
+	if (ret == SUCCESS && MEMPROF_G(profile_flags).enabled) {
+		cgroup_check_arm();
+		alloc_trigger_arm();
+	}
+
+	return ret;
+}
+
+static PHP_INI_MH(OnUpdateDumpThresholds)
+{
+	memprof_dump_threshold thresholds[MEMPROF_MAX_DUMP_THRESHOLDS];
+	size_t count;
+
+	if (!parse_dump_thresholds(new_value ? ZSTR_VAL(new_value) : "", thresholds, &count)) {
+		return FAILURE;
+	}
+
+	memcpy(MEMPROF_G(dump_thresholds), thresholds, count * sizeof(thresholds[0]));
+	MEMPROF_G(dump_thresholds_count) = count;
+
+	if (MEMPROF_G(profile_flags).enabled && orig_zheap) {
+		dump_thresholds_init();
+	}
+
+	return SUCCESS;
+}
+
+/* Opens <output_dir>/memprof.trace.<timestamp>. Profiling goes on without
+ * the trace if it can't be created. */
+static void trace_enable()
+{
+	if (!format_filename(trace_filename, sizeof(trace_filename), "trace", COMPRESSION_NONE)) {
+		zend_error(E_WARNING, "memprof: Could not create a trace: memprof.output_dir is too long");
+		return;
+	}
+
+	if (!trace_open(&event_trace, trace_filename)) {
+		zend_error(E_WARNING, "memprof: Could not create %s: %s", trace_filename, strerror(errno));
+		return;
+	}
+
+	/* The root frame is declared by trace_open() */
+	root_frame.trace_id = 1;
+	trace_enabled = 1;
+}
+
+/* Whether an autodump may happen while profiling is enabled. Must be called
+ * after dump_thresholds_init() and cgroup_check_arm(). */
+static zend_bool autodump_configured(const memprof_profile_flags * pf)
+{
+	return pf->dump_on_limit || (orig_zheap && dump_threshold_sizes_count > 0) || cgroup_check_next != SIZE_MAX;
+}
+
+static void reserve_release()
+{
+	if (reserve == NULL) {
+		return;
+	}
+
+	if (reserve->message_used) {
+		reserve->next_retired = retired_reserves;
+		retired_reserves = reserve;
+	} else {
+		free(reserve);
+	}
+
+	reserve = NULL;
+}
+
+static void retired_reserves_free()
+{
+	while (retired_reserves != NULL) {
+		autodump_reserve * next = retired_reserves->next_retired;
+		free(retired_reserves);
+		retired_reserves = next;
+	}
+}
+
+static void memprof_enable(memprof_profile_flags * pf)
+{
+	assert(pf->enabled);
+
+	alloc_buckets_init(&current_alloc_buckets);
+
+	init_frame(&root_frame, &root_frame, "root", sizeof("root")-1);
+	root_frame.calls = 1;
+
+	current_frame = &root_frame;
+	frames_count = 0;
+	profile_generation++;
+
+	peak_stack_len = 0;
+	peaks_push(&root_frame);
+
+	zend_hash_init(&label_ids, 8, NULL, NULL, 0);
+	zend_hash_init(&label_names, 8, NULL, ZVAL_PTR_DTOR, 0);
+	current_label = 0;
+	label_stack_len = 0;
+
+	passthrough_init();
+
+	min_tracked_size = MEMPROF_G(min_tracked_size) > 0 ? (size_t) MEMPROF_G(min_tracked_size) : 0;
+	realloc_growth = MEMPROF_G(realloc_growth);
+	free_sites_enabled = MEMPROF_G(free_sites);
+	pending_allocs_init(MEMPROF_G(alloc_batch));
+	delta_interval = MEMPROF_G(delta_interval);
+
+	if (pf->trace) {
+		trace_enable();
+	}
+
+	if (pf->native) {
+		MALLOC_HOOK_SAVE_OLD();
+		MALLOC_HOOK_SET_OWN();
+	}
+
+	memprof_dumped = 0;
+
+	if (is_zend_mm()) {
+		const memprof_zend_handlers * h = &zend_handlers_variants[ZEND_HANDLERS_INDEX(min_tracked_size > 0, free_sites_enabled, realloc_growth, trace_enabled)];
+
+		/* There is no way to completely free a zend_mm_heap with custom
+		 * handlers, so we have to allocate it ourselves. We don't know the
+		 * actual size of a _zend_mm_heap struct, but this should be enough. */
+		zheap = malloc_check(zend_mm_heap_size);
+		memset(zheap, 0, zend_mm_heap_size);
+		zend_mm_set_custom_handlers(zheap, h->malloc_handler, h->free_handler, h->realloc_handler);
+		orig_zheap = zend_mm_set_heap(zheap);
+	} else {
+		zheap = NULL;
+		orig_zheap = NULL;
+	}
+
+	old_zend_execute = zend_execute_fn;
+	old_zend_execute_internal = zend_execute_internal;
+	zend_execute_fn = memprof_zend_execute;
+	zend_execute_internal = memprof_zend_execute_internal;
+
+	alloc_trigger_usage = 0;
+	dump_threshold_pending = 0;
+	cgroup_check_pending = 0;
+	cgroup_check_arm();
+	dump_thresholds_init();
+
+	/* Pages are touched now, so that they are not allocated by the
+	 * system when memory is exhausted */
+	if (autodump_configured(pf)) {
+		reserve = malloc_check(sizeof(*reserve));
+		memset(reserve, 0, sizeof(*reserve));
+	}
+
+#if MEMPROF_DEBUG
+	if (zheap && MEMPROF_G(debug_failing_allocator)) {
+		failing_zheap = malloc_check(zend_mm_heap_size);
+		memset(failing_zheap, 0, zend_mm_heap_size);
+		zend_mm_set_custom_handlers(failing_zheap, failing_malloc_handler, failing_free_handler, failing_realloc_handler);
+	}
+#endif
+
+	memprof_paused = 0;
+	track_mallocs = 1;
+}
+
+static void memprof_disable()
+{
+	track_mallocs = 0;
+	memprof_paused = 0;
+
+	alloc_trigger_next = SIZE_MAX;
+	dump_threshold_next = SIZE_MAX;
+	cgroup_check_next = SIZE_MAX;
+	dump_threshold_pending = 0;
+	cgroup_check_pending = 0;
+
+	zend_execute_fn = old_zend_execute;
+	zend_execute_internal = old_zend_execute_internal;
+
+	if (zheap) {
+		zend_mm_set_heap(orig_zheap);
+		free(zheap);
+	}
+
+	if (MEMPROF_G(profile_flags).native) {
+		MALLOC_HOOK_RESTORE_OLD();
+	}
+
+	MEMPROF_G(profile_flags).enabled = 0;
+
+	destroy_frame(&root_frame);
+
+	free(peak_stack);
+	peak_stack = NULL;
+	peak_stack_len = 0;
+	peak_stack_size = 0;
+	peak_base = 0;
+#if PHP_VERSION_ID >= 80100
+	fiber_states_destroy();
+#endif
+
+	delta_destroy();
+
+	if (trace_enabled) {
+		trace_close(&event_trace);
+		trace_enabled = 0;
+	}
+
+	reserve_release();
+#if MEMPROF_DEBUG
+	free(failing_zheap);
+	failing_zheap = NULL;
+#endif
+	delta_interval = 0;
+
+	zend_hash_destroy(&label_ids);
+	zend_hash_destroy(&label_names);
+	if (label_stack != NULL) {
+		efree(label_stack);
+		label_stack = NULL;
+	}
+	label_stack_len = 0;
+	label_stack_size = 0;
+	current_label = 0;
+
+	passthrough_destroy();
+
+	alloc_buckets_destroy(&current_alloc_buckets);
+
+	JudyLFreeArray(&allocs_set, PJE0);
+	allocs_set = (Pvoid_t) NULL;
+	pending_allocs_destroy();
+
+	free_sites_destroy();
+	free_sites_enabled = 0;
+	tracked_addr_min = UINTPTR_MAX;
+	tracked_addr_max = 0;
+	tracked_addr_bits = 0;
+
+	if (!memprof_dumped) {
+		// Calling this during RSHUTDOWN breaks zend_deactivate_modules(), which
+		// causes corruption of global state.
+		// zend_error(E_WARNING, "Memprof profiling was enabled, but no profile was dumped. Did you forget to call one of memprof_dump_callgrind(), memprof_dump_pprof(), or memprof_dump_array() ?");
+	}
+}
+
+static void disable_opcache()
+{
+	zend_string *key = zend_string_init(ZEND_STRL("opcache.enable"), 0);
+	zend_alter_ini_entry_chars_ex(
+		key,
 		"0",
 		1,
 		ZEND_INI_USER,
 		ZEND_INI_STAGE_ACTIVATE,
 		0
 	);
-	zend_string_release(key);
+	zend_string_release(key);
+}
+
+static zend_string* read_env_get_post(char *name, size_t len)
+{
+	zval *value;
+
+	char *env = sapi_getenv(name, len);
+	if (env != NULL) {
+		zend_string *str = zend_string_init(env, strlen(env), 0);
+		efree(env);
+		return str;
+	}
+
+	env = getenv(name);
+	if (env != NULL) {
+		return zend_string_init(env, strlen(env), 0);
+	}
+
+	if (Z_ARR(PG(http_globals)[TRACK_VARS_GET]) != NULL) {
+		value = zend_hash_str_find(Z_ARR(PG(http_globals)[TRACK_VARS_GET]), name, len);
+		if (value != NULL) {
+			convert_to_string_ex(value);
+			zend_string_addref(Z_STR_P(value));
+			return Z_STR_P(value);
+		}
+	}
+
+	if (Z_ARR(PG(http_globals)[TRACK_VARS_POST]) != NULL) {
+		value = zend_hash_str_find(Z_ARR(PG(http_globals)[TRACK_VARS_POST]), name, len);
+		if (value != NULL) {
+			convert_to_string_ex(value);
+			zend_string_addref(Z_STR_P(value));
+			return Z_STR_P(value);
+		}
+	}
+
+	return NULL;
+}
+
+static void parse_trigger(memprof_profile_flags * pf)
+{
+	char *saveptr;
+	const char *delim = ",";
+	char *flag;
+
+	zend_string *value = read_env_get_post(MEMPROF_ENV_PROFILE, strlen(MEMPROF_ENV_PROFILE));
+	if (value == NULL) {
+		return;
+	}
+
+	pf->enabled = ZSTR_LEN(value) > 0;
+
+	for (flag = strtok_r(ZSTR_VAL(value), delim, &saveptr); flag != NULL; flag = strtok_r(NULL, delim, &saveptr)) {
+		if (HAVE_MALLOC_HOOKS && strcmp(MEMPROF_FLAG_NATIVE, flag) == 0) {
+			pf->native = 1;
+		}
+		if (strcmp(MEMPROF_FLAG_DUMP_ON_LIMIT, flag) == 0) {
+			pf->dump_on_limit = 1;
+		}
+		if (strcmp(MEMPROF_FLAG_TRACE, flag) == 0) {
+			pf->trace = 1;
+		}
+	}
+
+	zend_string_release(value);
+}
+
+/* xorshift64* */
+static double sample_random()
+{
+	uint64_t x = MEMPROF_G(sample_state);
+
+	if (UNEXPECTED(x == 0)) {
+		/* Seeded lazily, so that forked workers don't share a sequence */
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		x = ((uint64_t) getpid() << 32) ^ (uint64_t) ts.tv_nsec ^ ((uint64_t) ts.tv_sec << 20);
+		if (x == 0) {
+			x = 1;
+		}
+	}
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	MEMPROF_G(sample_state) = x;
+
+	return (double) ((x * UINT64_C(0x2545F4914F6CDD1D)) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Whether the request URI or the script matches one of the comma-separated
+ * patterns in filter */
+static zend_bool sample_filter_match(const char * filter)
+{
+	const char * uri = SG(request_info).request_uri;
+	const char * script = SG(request_info).path_translated;
+	char * patterns = estrdup(filter);
+	char * saveptr;
+	char * pattern;
+	zend_bool match = 0;
+
+	for (pattern = strtok_r(patterns, ", ", &saveptr); pattern != NULL; pattern = strtok_r(NULL, ", ", &saveptr)) {
+		if ((uri != NULL && fnmatch(pattern, uri, 0) == 0) || (script != NULL && fnmatch(pattern, script, 0) == 0)) {
+			match = 1;
+			break;
+		}
+	}
+
+	efree(patterns);
+
+	return match;
+}
+
+/* Decides whether to profile a request that wasn't explicitly selected by
+ * MEMPROF_PROFILE */
+static zend_bool sample_request()
+{
+	double rate = MEMPROF_G(request_sample_rate);
+	const char * filter = MEMPROF_G(request_sample_filter);
+
+	if (EXPECTED(rate <= 0)) {
+		return 0;
+	}
+
+	if (rate < 1 && sample_random() >= rate) {
+		return 0;
+	}
+
+	if (filter != NULL && filter[0] != '\0' && !sample_filter_match(filter)) {
+		return 0;
+	}
+
+	return 1;
+}
+
+static void sampled_request_dump()
+{
+	char * filename = NULL;
+
+	/* Errors can not be reported at this point */
+	WITHOUT_MALLOC_TRACKING {
+		dump_to_output_dir(&filename);
+	} END_WITHOUT_MALLOC_TRACKING;
+
+	if (filename != NULL) {
+		efree(filename);
+	}
+
+	memprof_dumped = 1;
+}
+
+ZEND_DLEXPORT int memprof_zend_startup(zend_extension *extension)
+{
+	return zend_startup_module(&memprof_module_entry);
+}
+
+#ifndef ZEND_EXT_API
+#define ZEND_EXT_API    ZEND_DLEXPORT
+#endif
+ZEND_EXTENSION();
+
+ZEND_DLEXPORT zend_extension zend_extension_entry = {
+	MEMPROF_NAME,
+	PHP_MEMPROF_VERSION,
+	"Arnaud Le Blanc",
+	"https://github.com/arnaud-lb/php-memory-profiler",
+	"Copyright (c) 2013",
+	memprof_zend_startup,
+	NULL,
+	NULL,           /* activate_func_t */
+	NULL,           /* deactivate_func_t */
+	NULL,           /* message_handler_func_t */
+	NULL,           /* op_array_handler_func_t */
+	NULL,           /* statement_handler_func_t */
+	NULL,           /* fcall_begin_handler_func_t */
+	NULL,           /* fcall_end_handler_func_t */
+	NULL,           /* op_array_ctor_func_t */
+	NULL,           /* op_array_dtor_func_t */
+	STANDARD_ZEND_EXTENSION_PROPERTIES
+};
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_memprof_memory_get_usage, 0, 0, 0)
+	ZEND_ARG_INFO(0, real)
+ZEND_END_ARG_INFO()
+
+/* {{{ memprof_functions_overrides[]
+ */
+const zend_function_entry memprof_function_overrides[] = {
+	PHP_FALIAS(memory_get_peak_usage, memprof_memory_get_peak_usage, arginfo_memprof_memory_get_usage)
+	PHP_FALIAS(memory_get_usage, memprof_memory_get_usage, arginfo_memprof_memory_get_usage)
+	PHP_FE_END    /* Must be the last line in memprof_function_overrides[] */
+};
+/* }}} */
+
+/* {{{ memprof_module_entry
+ */
+zend_module_entry memprof_module_entry = {
+	STANDARD_MODULE_HEADER,
+	MEMPROF_NAME,
+	ext_functions,
+	PHP_MINIT(memprof),
+	PHP_MSHUTDOWN(memprof),
+	PHP_RINIT(memprof),
+	PHP_RSHUTDOWN(memprof),
+	PHP_MINFO(memprof),
+	PHP_MEMPROF_VERSION,
+	PHP_MODULE_GLOBALS(memprof),
+	PHP_GINIT(memprof),
+	NULL,
+	NULL,
+	STANDARD_MODULE_PROPERTIES_EX
+};
+/* }}} */
+
+#ifdef COMPILE_DL_MEMPROF
+#	ifdef ZTS
+ZEND_TSRMLS_CACHE_DEFINE()
+#	endif
+ZEND_GET_MODULE(memprof)
+#endif
+
+#ifdef P_tmpdir
+#	define MEMPROF_TEMP_DIR P_tmpdir
+#else
+#	ifdef PHP_WIN32
+#		define MEMPROF_TEMP_DIR "C:\\Windows\\Temp"
+#	else
+#		define MEMPROF_TEMP_DIR "/tmp"
+#	endif
+#endif
+
+/* {{{ PHP_INI_BEGIN
+ */
+PHP_INI_BEGIN()
+	STD_PHP_INI_ENTRY("memprof.output_dir", MEMPROF_TEMP_DIR, PHP_INI_ALL, OnUpdateStringUnempty, output_dir, zend_memprof_globals, memprof_globals)
+	PHP_INI_ENTRY("memprof.output_format", "callgrind", PHP_INI_ALL, OnUpdateOutputFormat)
+	PHP_INI_ENTRY("memprof.output_compression", "none", PHP_INI_ALL, OnUpdateOutputCompression)
+	PHP_INI_ENTRY("memprof.dump_thresholds", "", PHP_INI_ALL, OnUpdateDumpThresholds)
+	STD_PHP_INI_ENTRY("memprof.dump_min_interval", "60", PHP_INI_ALL, OnUpdateLong, dump_min_interval, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.cgroup_dump_ratio", "0", PHP_INI_ALL, OnUpdateCgroupDumpRatio, cgroup_dump_ratio, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.cgroup_dir", "", PHP_INI_ALL, OnUpdateString, cgroup_dir, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.cgroup_check_interval", "1000", PHP_INI_ALL, OnUpdateLong, cgroup_check_interval, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.cgroup_dump_top", "1", PHP_INI_ALL, OnUpdateLong, cgroup_dump_top, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_BOOLEAN("memprof.aggregate", "0", PHP_INI_ALL, OnUpdateBool, aggregate, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.aggregate_nodes", "65536", PHP_INI_SYSTEM, OnUpdateLong, aggregate_nodes, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.passthrough_functions", "call_user_func,call_user_func_array", PHP_INI_ALL, OnUpdateString, passthrough_functions, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.collapse_namespaces", "", PHP_INI_ALL, OnUpdateString, collapse_namespaces, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.fold_recursion", "0", PHP_INI_ALL, OnUpdateLong, fold_recursion, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.max_frames", "0", PHP_INI_ALL, OnUpdateLong, max_frames, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.min_tracked_size", "0", PHP_INI_ALL, OnUpdateLong, min_tracked_size, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_BOOLEAN("memprof.realloc_growth", "0", PHP_INI_ALL, OnUpdateBool, realloc_growth, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_BOOLEAN("memprof.free_sites", "0", PHP_INI_ALL, OnUpdateBool, free_sites, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.alloc_batch", "0", PHP_INI_ALL, OnUpdateLong, alloc_batch, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.delta_interval", "0", PHP_INI_ALL, OnUpdateLong, delta_interval, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.retainers_max_nodes", "1000000", PHP_INI_ALL, OnUpdateLong, retainers_max_nodes, zend_memprof_globals, memprof_globals)
+#if MEMPROF_DEBUG
+	STD_PHP_INI_BOOLEAN("memprof.debug_failing_allocator", "0", PHP_INI_ALL, OnUpdateBool, debug_failing_allocator, zend_memprof_globals, memprof_globals)
+#endif
+	STD_PHP_INI_ENTRY("memprof.request_sample_rate", "0", PHP_INI_ALL, OnUpdateReal, request_sample_rate, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_ENTRY("memprof.request_sample_filter", "", PHP_INI_ALL, OnUpdateString, request_sample_filter, zend_memprof_globals, memprof_globals)
+	STD_PHP_INI_BOOLEAN("memprof.request_sample_dump", "1", PHP_INI_ALL, OnUpdateBool, request_sample_dump, zend_memprof_globals, memprof_globals)
+PHP_INI_END()
+/* }}} */
+
+/* {{{ PHP_MINIT_FUNCTION
+ */
+PHP_MINIT_FUNCTION(memprof)
+{
+	zend_ini_entry * entry;
+	const zend_function_entry * fentry;
+
+	REGISTER_INI_ENTRIES();
+
+	entry = zend_hash_str_find_ptr(EG(ini_directives), "memory_limit", sizeof("memory_limit")-1);
+
+	if (entry == NULL) {
+		zend_error(E_CORE_ERROR, "memory_limit ini entry not found");
+		return FAILURE;
+	}
+
+	origOnChangeMemoryLimit = entry->on_modify;
+	entry->on_modify = OnChangeMemoryLimit;
+
+	old_zend_interrupt_function = zend_interrupt_function;
+	zend_interrupt_function = memprof_zend_interrupt_function;
+
+#if PHP_VERSION_ID >= 80100
+	zend_observer_fiber_switch_register(memprof_fiber_switch);
+	zend_observer_fiber_destroy_register(memprof_fiber_destroy);
+#endif
+
+	for (fentry = memprof_function_overrides; fentry->fname; fentry++) {
+		size_t name_len = strlen(fentry->fname);
+		zend_internal_function * orig = zend_hash_str_find_ptr(CG(function_table), fentry->fname, name_len);
+		if (orig != NULL && orig->type == ZEND_INTERNAL_FUNCTION) {
+			orig->handler = fentry->handler;
+		} else {
+			zend_error(E_WARNING, "memprof: Could not override %s(), return value from this function may be be accurate.", fentry->fname);
+		}
+	}
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ PHP_MSHUTDOWN_FUNCTION
+ */
+PHP_MSHUTDOWN_FUNCTION(memprof)
+{
+	if (origOnChangeMemoryLimit) {
+		zend_ini_entry * entry;
+
+		entry = zend_hash_str_find_ptr(EG(ini_directives), "memory_limit", sizeof("memory_limit")-1);
+
+		if (entry != NULL) {
+			entry->on_modify = origOnChangeMemoryLimit;
+		}
+	}
+
+	zend_interrupt_function = old_zend_interrupt_function;
+
+	retired_reserves_free();
+
+	if (aggregate_store != NULL) {
+		aggregate_close(aggregate_store);
+		aggregate_store = NULL;
+	}
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ PHP_RINIT_FUNCTION
+ */
+PHP_RINIT_FUNCTION(memprof)
+{
+#if defined(ZTS) && defined(COMPILE_DL_FOO)
+	ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+
+	/* The previous request is over */
+	retired_reserves_free();
+
+	parse_trigger(&MEMPROF_G(profile_flags));
+
+	MEMPROF_G(request_sampled) = 0;
+
+	if (!MEMPROF_G(profile_flags).enabled && sample_request()) {
+		MEMPROF_G(profile_flags).enabled = 1;
+		MEMPROF_G(request_sampled) = 1;
+	}
+
+	if (MEMPROF_G(profile_flags).enabled) {
+		disable_opcache();
+		memprof_enable(&MEMPROF_G(profile_flags));
+	}
+
+	rinit_zend_error_cb = zend_error_cb;
+	zend_error_cb_overridden = 0;
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ PHP_RSHUTDOWN_FUNCTION
+ */
+PHP_RSHUTDOWN_FUNCTION(memprof)
+{
+	if (MEMPROF_G(profile_flags).enabled) {
+		if (MEMPROF_G(aggregate)) {
+			aggregate_merge();
+		}
+		if (delta_filename != NULL) {
+			/* The final state of the request */
+			delta_append();
+		}
+		if (MEMPROF_G(request_sampled) && MEMPROF_G(request_sample_dump) && !memprof_dumped) {
+			sampled_request_dump();
+		}
+		memprof_disable();
+	}
+
+	zend_error_cb = rinit_zend_error_cb;
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ PHP_MINFO_FUNCTION
+ */
+PHP_MINFO_FUNCTION(memprof)
+{
+	php_info_print_table_start();
+	php_info_print_table_header(2, "memprof support", "enabled");
+	php_info_print_table_header(2, "memprof version", PHP_MEMPROF_VERSION);
+	php_info_print_table_header(2, "memprof native malloc support", HAVE_MALLOC_HOOKS ? "Yes" : "No");
+	php_info_print_table_header(2, "memprof gzip support", HAVE_MEMPROF_ZLIB ? "Yes" : "No");
+	php_info_print_table_header(2, "memprof zstd support", HAVE_MEMPROF_ZSTD ? "Yes" : "No");
+#if MEMPROF_DEBUG
+	php_info_print_table_header(2, "debug build", "Yes");
+#endif
+	php_info_print_table_end();
+
+	DISPLAY_INI_ENTRIES();
+}
+/* }}} */
+
+/* {{{ PHP_GINIT_FUNCTION
+ */
+PHP_GINIT_FUNCTION(memprof)
+{
+	memprof_globals->output_dir = NULL;
+	memprof_globals->output_format = FORMAT_CALLGRIND;
+	memprof_globals->output_compression = COMPRESSION_NONE;
+	memprof_globals->dump_thresholds_count = 0;
+	memprof_globals->dump_min_interval = 60;
+	memprof_globals->cgroup_dump_ratio = 0;
+	memprof_globals->cgroup_dir = NULL;
+	memprof_globals->cgroup_check_interval = 1000;
+	memprof_globals->cgroup_dump_top = 1;
+	memprof_globals->aggregate = 0;
+	memprof_globals->aggregate_nodes = 65536;
+	memprof_globals->passthrough_functions = NULL;
+	memprof_globals->collapse_namespaces = NULL;
+	memprof_globals->fold_recursion = 0;
+	memprof_globals->max_frames = 0;
+	memprof_globals->min_tracked_size = 0;
+	memprof_globals->realloc_growth = 0;
+	memprof_globals->free_sites = 0;
+	memprof_globals->alloc_batch = 0;
+	memprof_globals->delta_interval = 0;
+	memprof_globals->retainers_max_nodes = 1000000;
+#if MEMPROF_DEBUG
+	memprof_globals->debug_failing_allocator = 0;
+#endif
+	memprof_globals->request_sample_rate = 0;
+	memprof_globals->request_sample_filter = NULL;
+	memprof_globals->request_sample_dump = 1;
+	memprof_globals->request_sampled = 0;
+	memprof_globals->sample_state = 0;
+}
+/* }}} */
+
+static uint32_t label_intern(zend_string * label)
+{
+	zval * zid;
+	zval tmp;
+	uint32_t id;
+
+	zid = zend_hash_find(&label_ids, label);
+	if (zid != NULL) {
+		return (uint32_t) Z_LVAL_P(zid);
+	}
+
+	id = zend_hash_num_elements(&label_ids) + 1;
+
+	ZVAL_LONG(&tmp, id);
+	zend_hash_add_new(&label_ids, label, &tmp);
+
+	ZVAL_STR_COPY(&tmp, label);
+	zend_hash_index_add_new(&label_names, id, &tmp);
+
+	return id;
+}
+
+static zend_string * label_name(uint32_t id)
+{
+	zval * zname = zend_hash_index_find(&label_names, id);
+
+	return zname != NULL ? Z_STR_P(zname) : NULL;
+}
+
+/* Whether labels must be reported when dumping the tree at root */
+/* Label costs are computed in allocated tables, so dumps from the reserve
+ * don't report them */
+static zend_bool has_labels(const frame * root)
+{
+	return root == &root_frame && !reserve_dumping && zend_hash_num_elements(&label_names) > 0;
+}
+
+typedef struct _label_cost {
+	size_t size;
+	size_t count;
+} label_cost;
+
+/* Computes the cost of the live blocks of each label. costs is indexed by
+ * label id and must have room for all ids. */
+static void label_totals(label_cost * costs)
+{
+	Word_t index = 0;
+	Word_t * p;
+
+	pending_allocs_flush();
+
+	JLF(p, allocs_set, index);
+	while (p != NULL) {
+		alloc * a = (alloc *) *p;
+		if (a->frame != NULL) {
+			costs[a->label].size += a->size;
+			costs[a->label].count++;
+		}
+		if (a->growth != NULL) {
+			costs[a->growth->label].size += a->growth->size;
+		}
+		JLN(p, allocs_set, index);
+	}
+}
+
+static void label_costs_dtor(zval * pDest)
+{
+	HashTable * costs = Z_PTR_P(pDest);
+	zend_hash_destroy(costs);
+	efree(costs);
+}
+
+static void label_cost_dtor(zval * pDest)
+{
+	efree(Z_PTR_P(pDest));
+}
+
+static void frame_label_cost_add(HashTable * dest, const alloc * a, size_t count)
+{
+	HashTable * costs;
+	label_cost * cost;
+
+	costs = zend_hash_index_find_ptr(dest, (zend_ulong) (uintptr_t) a->frame);
+	if (costs == NULL) {
+		costs = emalloc(sizeof(*costs));
+		zend_hash_init(costs, 8, NULL, label_cost_dtor, 0);
+		zend_hash_index_add_new_ptr(dest, (zend_ulong) (uintptr_t) a->frame, costs);
+	}
+
+	cost = zend_hash_index_find_ptr(costs, a->label);
+	if (cost == NULL) {
+		cost = ecalloc(1, sizeof(*cost));
+		zend_hash_index_add_new_ptr(costs, a->label, cost);
+	}
+
+	cost->size += a->size;
+	cost->count += count;
+}
+
+/* Maps frames to the costs of their labelled live blocks, by label id.
+ * Costs of unlabelled blocks are the rest of the frame's self cost. */
+static void frame_label_costs(HashTable * dest)
+{
+	Word_t index = 0;
+	Word_t * p;
+
+	zend_hash_init(dest, 8, NULL, label_costs_dtor, 0);
+
+	pending_allocs_flush();
+
+	JLF(p, allocs_set, index);
+	while (p != NULL) {
+		alloc * a = (alloc *) *p;
+		if (a->frame != NULL && a->label != 0) {
+			frame_label_cost_add(dest, a, 1);
+		}
+		if (a->growth != NULL && a->growth->label != 0) {
+			/* growth only counts bytes */
+			frame_label_cost_add(dest, a->growth, 0);
+		}
+		JLN(p, allocs_set, index);
+	}
+}
+
+static void frame_inclusive_cost(frame * f, size_t * inclusive_size, size_t * inclusive_count)
+{
+	size_t size = f->self_size;
+	size_t count = f->self_count;
+	HashPosition pos;
+	zval * znext;
+
+	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
+	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
+		zend_string * str_key;
+		zend_ulong num_key;
+		size_t call_size;
+		size_t call_count;
+		frame * next = Z_PTR_P(znext);
+
+		if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(&f->next_cache, &str_key, &num_key, &pos)) {
+			continue;
+		}
+
+		frame_inclusive_cost(next, &call_size, &call_count);
+
+		size += call_size;
+		count += call_count;
+
+		zend_hash_move_forward_ex(&f->next_cache, &pos);
+	}
+
+	*inclusive_size = size;
+	*inclusive_count = count;
+}
+
+static zend_bool dump_frame_array(zval * dest, frame * f)
+{
+	HashPosition pos;
+	zval * znext;
+	zval * zframe = dest;
+	zval zcalled_functions;
+	size_t inclusive_size;
+	size_t inclusive_count;
+
+	array_init(zframe);
+
+	add_assoc_long_ex(zframe, ZEND_STRL("memory_size"), f->self_size);
+	add_assoc_long_ex(zframe, ZEND_STRL("blocks_count"), f->self_count);
+
+	frame_inclusive_cost(f, &inclusive_size, &inclusive_count);
+	add_assoc_long_ex(zframe, ZEND_STRL("memory_size_inclusive"), inclusive_size);
+	add_assoc_long_ex(zframe, ZEND_STRL("blocks_count_inclusive"), inclusive_count);
+
+	add_assoc_long_ex(zframe, ZEND_STRL("calls"), f->calls);
+
+	array_init(&zcalled_functions);
+
+	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
+	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
+
+		zend_string * str_key;
+		zend_ulong num_key;
+		zval zcalled_function;
+		frame * next = Z_PTR_P(znext);
+
+		if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(&f->next_cache, &str_key, &num_key, &pos)) {
+			continue;
+		}
+
+		dump_frame_array(&zcalled_function, next);
+		add_assoc_zval_ex(&zcalled_functions, ZSTR_VAL(str_key), ZSTR_LEN(str_key), &zcalled_function);
+
+		zend_hash_move_forward_ex(&f->next_cache, &pos);
+	}
+
+	add_assoc_zval_ex(zframe, ZEND_STRL("called_functions"), &zcalled_functions);
+
+	return 1;
+}
+
+/* Adds per-label totals to the root frame's array */
+static void dump_labels_array(zval * dest)
+{
+	zval zlabels;
+	label_cost * costs;
+	uint32_t count = zend_hash_num_elements(&label_names);
+	uint32_t id;
+
+	costs = ecalloc(count + 1, sizeof(*costs));
+
+	label_totals(costs);
+
+	array_init(&zlabels);
+
+	for (id = 1; id <= count; id++) {
+		zend_string * name = label_name(id);
+		zval zlabel;
+
+		array_init(&zlabel);
+		add_assoc_long_ex(&zlabel, ZEND_STRL("memory_size"), costs[id].size);
+		add_assoc_long_ex(&zlabel, ZEND_STRL("blocks_count"), costs[id].count);
+		add_assoc_zval_ex(&zlabels, ZSTR_VAL(name), ZSTR_LEN(name), &zlabel);
+	}
+
+	add_assoc_zval_ex(dest, ZEND_STRL("labels"), &zlabels);
+
+	efree(costs);
+}
+
+typedef struct _flat_frame {
+	frame * f;
+	zend_long parent;
+} flat_frame;
+
+static void flat_array_init(zval * dest, size_t size)
+{
+	array_init_size(dest, size);
+	zend_hash_real_init(Z_ARRVAL_P(dest), 1);
+}
+
+/* Lists frames in breadth first order, so that parents come before their
+ * children. Returns the number of frames. */
+static size_t flat_frames(frame * root, flat_frame ** frames_p)
+{
+	size_t size = 64;
+	size_t len = 1;
+	size_t i;
+	flat_frame * frames = safe_emalloc(size, sizeof(*frames), 0);
+
+	frames[0].f = root;
+	frames[0].parent = -1;
+
+	for (i = 0; i < len; i++) {
+		frame * next;
+
+		ZEND_HASH_FOREACH_PTR(&frames[i].f->next_cache, next) {
+			if (len == size) {
+				size *= 2;
+				frames = safe_erealloc(frames, size, sizeof(*frames), 0);
+			}
+			frames[len].f = next;
+			frames[len].parent = i;
+			len++;
+		} ZEND_HASH_FOREACH_END();
+	}
+
+	*frames_p = frames;
+
+	return len;
+}
+
+/* Dumps the tree as parallel packed arrays, indexed by frame. Names are
+ * deduplicated. */
+static void dump_flat_array(zval * dest, frame * root)
+{
+	flat_frame * frames;
+	size_t len = flat_frames(root, &frames);
+	HashTable name_ids;
+	zval znames, zparents, zname_ids, zsizes, zcounts, zcalls;
+	zval tmp;
+	size_t i;
+
+	zend_hash_init(&name_ids, 64, NULL, NULL, 0);
+
+	array_init(&znames);
+	flat_array_init(&zparents, len);
+	flat_array_init(&zname_ids, len);
+	flat_array_init(&zsizes, len);
+	flat_array_init(&zcounts, len);
+	flat_array_init(&zcalls, len);
+
+	for (i = 0; i < len; i++) {
+		frame * f = frames[i].f;
+		zval * zid = zend_hash_str_find(&name_ids, f->name, f->name_len);
+
+		if (zid == NULL) {
+			ZVAL_LONG(&tmp, zend_hash_num_elements(Z_ARRVAL(znames)));
+			zid = zend_hash_str_add_new(&name_ids, f->name, f->name_len, &tmp);
+			add_next_index_stringl(&znames, f->name, f->name_len);
+		}
+
+		add_next_index_long(&zparents, frames[i].parent);
+		add_next_index_long(&zname_ids, Z_LVAL_P(zid));
+		add_next_index_long(&zsizes, f->self_size);
+		add_next_index_long(&zcounts, f->self_count);
+		add_next_index_long(&zcalls, f->calls);
+	}
+
+	zend_hash_destroy(&name_ids);
+	efree(frames);
+
+	array_init_size(dest, 6);
+	add_assoc_zval_ex(dest, ZEND_STRL("names"), &znames);
+	add_assoc_zval_ex(dest, ZEND_STRL("parent"), &zparents);
+	add_assoc_zval_ex(dest, ZEND_STRL("name"), &zname_ids);
+	add_assoc_zval_ex(dest, ZEND_STRL("memory_size"), &zsizes);
+	add_assoc_zval_ex(dest, ZEND_STRL("blocks_count"), &zcounts);
+	add_assoc_zval_ex(dest, ZEND_STRL("calls"), &zcalls);
+}
+
+typedef enum _top_key {
+	TOP_BY_SELF,
+	TOP_BY_INCLUSIVE,
+	TOP_BY_BLOCKS,
+} top_key;
+
+/* Costs of all the frames of a function */
+typedef struct _top_row {
+	zend_string * name;
+	size_t self_size;
+	size_t self_count;
+	size_t inclusive_size;
+	size_t inclusive_count;
+	size_t calls;
+	uint32_t active;	/* number of frames of the function on the current path */
+} top_row;
+
+static void top_row_dtor(zval * pDest)
+{
+	top_row * row = Z_PTR_P(pDest);
+	zend_string_release(row->name);
+	efree(row);
+}
+
+/* Adds the costs of f and its callees to rows, by function name. The
+ * inclusive cost of a frame is only added if no ancestor has the same name,
+ * so that recursive calls are not counted twice. */
+static void top_collect(HashTable * rows, frame * f, size_t * inclusive_size, size_t * inclusive_count)
+{
+	size_t size = f->self_size;
+	size_t count = f->self_count;
+	top_row * row;
+	frame * next;
+
+	row = zend_hash_str_find_ptr(rows, f->name, f->name_len);
+	if (row == NULL) {
+		row = ecalloc(1, sizeof(*row));
+		row->name = zend_string_init(f->name, f->name_len, 0);
+		zend_hash_add_new_ptr(rows, row->name, row);
+	}
+
+	row->active++;
+
+	ZEND_HASH_FOREACH_PTR(&f->next_cache, next) {
+		size_t call_size;
+		size_t call_count;
+
+		top_collect(rows, next, &call_size, &call_count);
+
+		size += call_size;
+		count += call_count;
+	} ZEND_HASH_FOREACH_END();
+
+	row->active--;
+
+	row->self_size += f->self_size;
+	row->self_count += f->self_count;
+	row->calls += f->calls;
+
+	if (row->active == 0) {
+		row->inclusive_size += size;
+		row->inclusive_count += count;
+	}
+
+	*inclusive_size = size;
+	*inclusive_count = count;
+}
+
+static size_t top_row_cost(const top_row * row, top_key by)
+{
+	switch (by) {
+		case TOP_BY_INCLUSIVE:
+			return row->inclusive_size;
+		case TOP_BY_BLOCKS:
+			return row->self_count;
+		default:
+			return row->self_size;
+	}
+}
+
+/* Restores the min-heap property of heap from index i down */
+static void top_heap_down(top_row ** heap, size_t len, size_t i, top_key by)
+{
+	for (;;) {
+		size_t min = i;
+		size_t l = 2*i + 1;
+		size_t r = 2*i + 2;
+		top_row * tmp;
+
+		if (l < len && top_row_cost(heap[l], by) < top_row_cost(heap[min], by)) {
+			min = l;
+		}
+		if (r < len && top_row_cost(heap[r], by) < top_row_cost(heap[min], by)) {
+			min = r;
+		}
+		if (min == i) {
+			return;
+		}
+
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+/* Selects the n costliest rows in a min-heap, then sorts them by
+ * decreasing cost. Returns the number of selected rows. */
+static size_t top_select(HashTable * rows, top_row ** heap, size_t n, top_key by)
+{
+	size_t len = 0;
+	size_t i;
+	top_row * row;
+
+	ZEND_HASH_FOREACH_PTR(rows, row) {
+		if (len < n) {
+			heap[len++] = row;
+			if (len == n) {
+				for (i = n / 2; i > 0; i--) {
+					top_heap_down(heap, len, i - 1, by);
+				}
+			}
+		} else if (top_row_cost(row, by) > top_row_cost(heap[0], by)) {
+			heap[0] = row;
+			top_heap_down(heap, len, 0, by);
+		}
+	} ZEND_HASH_FOREACH_END();
+
+	if (len < n) {
+		for (i = len / 2; i > 0; i--) {
+			top_heap_down(heap, len, i - 1, by);
+		}
+	}
+
+	/* Heap sort: the cheapest row is moved to the end */
+	for (i = len; i > 1; i--) {
+		row = heap[0];
+		heap[0] = heap[i - 1];
+		heap[i - 1] = row;
+		top_heap_down(heap, i - 1, 0, by);
+	}
+
+	return len;
+}
+
+static void dump_top_array(zval * dest, frame * root, size_t n, top_key by)
+{
+	HashTable rows;
+	top_row ** heap;
+	frame * next;
+	size_t len;
+	size_t i;
+
+	if (n == 0) {
+		array_init(dest);
+		return;
+	}
+
+	zend_hash_init(&rows, 64, NULL, top_row_dtor, 0);
+
+	/* root is not a function */
+	ZEND_HASH_FOREACH_PTR(&root->next_cache, next) {
+		size_t size;
+		size_t count;
+
+		top_collect(&rows, next, &size, &count);
+	} ZEND_HASH_FOREACH_END();
+
+	n = MIN(n, zend_hash_num_elements(&rows));
+	heap = safe_emalloc(n, sizeof(*heap), 0);
+
+	len = top_select(&rows, heap, n, by);
+
+	array_init_size(dest, len);
+
+	for (i = 0; i < len; i++) {
+		top_row * row = heap[i];
+		zval zrow;
+
+		array_init(&zrow);
+		add_assoc_str_ex(&zrow, ZEND_STRL("function"), zend_string_copy(row->name));
+		add_assoc_long_ex(&zrow, ZEND_STRL("memory_size"), row->self_size);
+		add_assoc_long_ex(&zrow, ZEND_STRL("blocks_count"), row->self_count);
+		add_assoc_long_ex(&zrow, ZEND_STRL("memory_size_inclusive"), row->inclusive_size);
+		add_assoc_long_ex(&zrow, ZEND_STRL("blocks_count_inclusive"), row->inclusive_count);
+		add_assoc_long_ex(&zrow, ZEND_STRL("calls"), row->calls);
+		add_next_index_zval(dest, &zrow);
+	}
+
+	efree(heap);
+	zend_hash_destroy(&rows);
+}
+
+static zend_bool dump_frame_callgrind(memprof_writer * w, frame * f, char * fname, size_t * inclusive_size, size_t * inclusive_count)
+{
+	size_t size = 0;
+	size_t count = 0;
+	HashPosition pos;
+	zval * znext;
+
+	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
+	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
+		zend_string * str_key;
+		zend_ulong num_key;
+		size_t call_size;
+		size_t call_count;
+		frame * next = Z_PTR_P(znext);
+
+		if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(&f->next_cache, &str_key, &num_key, &pos)) {
+			continue;
+		}
+
+		if (!dump_frame_callgrind(w, next, ZSTR_VAL(str_key), &call_size, &call_count)) {
+			return 0;
+		}
+
+		size += call_size;
+		count += call_count;
+
+		zend_hash_move_forward_ex(&f->next_cache, &pos);
+	}
+
+	if (
+		!writer_printf(w, "fl=/todo.php\n") ||
+		!writer_printf(w, "fn=%s\n", fname)
+	) {
+		return 0;
+	}
+
+	size += f->self_size;
+	count += f->self_count;
+
+	if (!writer_printf(w, "1 %zu %zu %zu\n", f->self_size, f->self_count, f->peak_self_size)) {
+		return 0;
+	}
+
+	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
+	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
+		zend_string * str_key;
+		zend_ulong num_key;
+		size_t call_size;
+		size_t call_count;
+		frame * next = Z_PTR_P(znext);
+
+		if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(&f->next_cache, &str_key, &num_key, &pos)) {
+			continue;
+		}
+
+		frame_inclusive_cost(next, &call_size, &call_count);
+
+		if (
+			!writer_printf(w, "cfl=/todo.php\n")						||
+			!writer_printf(w, "cfn=%s\n", ZSTR_VAL(str_key))			||
+			!writer_printf(w, "calls=%zu 1\n", next->calls)			||
+			!writer_printf(w, "1 %zu %zu %zu\n", call_size, call_count, next->peak_size)
+		) {
+			return 0;
+		}
+
+		zend_hash_move_forward_ex(&f->next_cache, &pos);
+	}
+
+	if (!writer_printf(w, "\n")) {
+		return 0;
+	}
+
+	if (inclusive_size) {
+		*inclusive_size = size;
+	}
+	if (inclusive_count) {
+		*inclusive_count = count;
+	}
+
+	return 1;
+}
+
+/* Label totals are written as comments, as callgrind has no notion of
+ * labels */
+static zend_bool dump_labels_callgrind(memprof_writer * w, frame * root) {
+	label_cost * costs;
+	uint32_t count;
+	uint32_t id;
+	zend_bool success = 1;
+
+	if (!has_labels(root)) {
+		return 1;
+	}
+
+	count = zend_hash_num_elements(&label_names);
+	costs = ecalloc(count + 1, sizeof(*costs));
+
+	label_totals(costs);
+
+	for (id = 1; id <= count && success; id++) {
+		zend_string * name = label_name(id);
+		success = writer_printf(w, "# label %s: %zu %zu\n", ZSTR_VAL(name), costs[id].size, costs[id].count);
+	}
+
+	efree(costs);
+
+	return success;
+}
+
+/* Blocks below memprof.min_tracked_size are missing from the profile */
+static zend_bool dump_min_tracked_size_callgrind(memprof_writer * w, frame * root)
+{
+	if (root != &root_frame || min_tracked_size == 0) {
+		return 1;
+	}
+
+	return writer_printf(w, "# min_tracked_size: %zu\n", min_tracked_size);
+}
+
+static zend_bool dump_callgrind(memprof_writer * w, frame * root) {
+	size_t total_size;
+	size_t total_count;
+
+	return (
+		writer_printf(w, "version: 1\n")						&&
+		writer_printf(w, "cmd: unknown\n")						&&
+		writer_printf(w, "positions: line\n")					&&
+		writer_printf(w, "events: MemorySize BlocksCount PeakMemorySize\n")	&&
+		dump_min_tracked_size_callgrind(w, root)				&&
+		writer_printf(w, "\n")									&&
+
+		dump_frame_callgrind(w, root, "root", &total_size, &total_count) &&
+
+		dump_labels_callgrind(w, root) &&
+
+		writer_printf(w, "total: %zu %zu %zu\n", total_size, total_count, root->peak_size)
+	);
+}
+
+/* Writes one sample. When label is not 0, the label is added to the stack
+ * as a pseudo-frame called by f. */
+static zend_bool dump_pprof_sample(memprof_writer * w, HashTable * symbols, frame * f, size_t size, uint32_t label)
+{
+	frame * prev;
+	size_t stack_depth = frame_stack_depth(f);
+
+	writer_write_word(w, size);
+	writer_write_word(w, stack_depth + (label != 0));
+
+	if (label != 0) {
+		/* label symbols are indexed by label id */
+		zend_uintptr_t symaddr = (zend_uintptr_t) zend_hash_index_find_ptr(symbols, label);
+		if (symaddr == 0 || !writer_write_word(w, symaddr)) {
+			return 0;
+		}
+	}
+
+	for (prev = f; !FRAME_IS_ROOT(prev); prev = prev->prev) {
+		zend_uintptr_t symaddr;
+		symaddr = (zend_uintptr_t) zend_hash_str_find_ptr(symbols, prev->name, prev->name_len);
+		if (symaddr == 0) {
+			/* shouldn't happen */
+			zend_error(E_CORE_ERROR, "symbol address not found");
+			return 0;
+		}
+		if (!writer_write_word(w, symaddr)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* With peaks, samples are the peak self sizes of the frames instead of the
+ * live sizes. labels must be NULL. */
+static zend_bool dump_frames_pprof(memprof_writer * w, HashTable * symbols, HashTable * labels, frame * f, zend_bool peaks)
+{
+	HashPosition pos;
+	zval * znext;
+	size_t size = peaks ? f->peak_self_size : f->self_size;
+	HashTable * costs = NULL;
+
+	if (labels != NULL) {
+		costs = zend_hash_index_find_ptr(labels, (zend_ulong) (uintptr_t) f);
+	}
+
+	if (costs != NULL) {
+		zend_ulong id;
+		label_cost * cost;
+
+		ZEND_HASH_FOREACH_NUM_KEY_PTR(costs, id, cost) {
+			size -= cost->size;
+			if (0 < cost->size && !dump_pprof_sample(w, symbols, f, cost->size, (uint32_t) id)) {
+				return 0;
+			}
+		} ZEND_HASH_FOREACH_END();
+	}
+
+	if (0 < size) {
+		if (!dump_pprof_sample(w, symbols, f, size, 0)) {
+			return 0;
+		}
+	}
+
+	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
+	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
+		zend_string * str_key;
+		zend_ulong num_key;
+		frame * next = Z_PTR_P(znext);
+
+		if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(&f->next_cache, &str_key, &num_key, &pos)) {
+			continue;
+		}
+
+		if (!dump_frames_pprof(w, symbols, labels, next, peaks)) {
+			return 0;
+		}
+
+		zend_hash_move_forward_ex(&f->next_cache, &pos);
+	}
+
+	return 1;
+}
+
+static zend_bool dump_frames_pprof_symbols(memprof_writer * w, HashTable * symbols, frame * f)
+{
+	HashPosition pos;
+	zval * znext;
+	zend_uintptr_t symaddr;
+
+	if (!zend_hash_str_exists(symbols, f->name, f->name_len)) {
+		/* addr only has to be unique */
+		symaddr = (symbols->nNumOfElements+1)<<3;
+		zend_hash_str_add_ptr(symbols, f->name, f->name_len, (void*) symaddr);
+		if (!writer_printf(w, "0x%0*x %s\n", (int) (sizeof(symaddr)*2), symaddr, f->name)) {
+			return 0;
+		}
+	}
+
+	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
+	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
+		zend_string * str_key;
+		zend_ulong num_key;
+		frame * next = Z_PTR_P(znext);
+
+		if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(&f->next_cache, &str_key, &num_key, &pos)) {
+			continue;
+		}
+
+		if (!dump_frames_pprof_symbols(w, symbols, next)) {
+			return 0;
+		}
+
+		zend_hash_move_forward_ex(&f->next_cache, &pos);
+	}
+
+	return 1;
+}
+
+static zend_bool dump_labels_pprof_symbols(memprof_writer * w, HashTable * symbols, frame * root)
+{
+	uint32_t count;
+	uint32_t id;
+
+	if (!has_labels(root)) {
+		return 1;
+	}
+
+	count = zend_hash_num_elements(&label_names);
+
+	for (id = 1; id <= count; id++) {
+		zend_uintptr_t symaddr = (symbols->nNumOfElements+1)<<3;
+		zend_hash_index_add_ptr(symbols, id, (void*) symaddr);
+		if (!writer_printf(w, "0x%0*x [label] %s\n", (int) (sizeof(symaddr)*2), symaddr, ZSTR_VAL(label_name(id)))) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static zend_bool dump_pprof_symbols_section(memprof_writer * w, HashTable * symbols, frame * root) {
+	return (
+		writer_printf(w, "--- symbol\n")					&&
+		writer_printf(w, "binary=todo.php\n")				&&
+
+		dump_frames_pprof_symbols(w, symbols, root)	&&
+		dump_labels_pprof_symbols(w, symbols, root)	&&
+
+		writer_printf(w, "---\n")
+	);
+}
+
+static zend_bool dump_pprof_profile_section(memprof_writer * w, HashTable * symbols, HashTable * labels, frame * root, zend_bool peaks) {
+	return (
+		writer_printf(w, "--- profile\n") &&
+
+		/* header count */
+		writer_write_word(w, 0)  &&
+
+		/* header words after this one */
+		writer_write_word(w, 3)  &&
+
+		/* format version */
+		writer_write_word(w, 0)  &&
+
+		/* sampling period */
+		writer_write_word(w, 0)  &&
+
+		/* unused padding */
+		writer_write_word(w, 0)  &&
+
+		dump_frames_pprof(w, symbols, labels, root, peaks)
+	);
+}
+
+static zend_bool dump_pprof_ex(memprof_writer * w, frame * root, zend_bool peaks) {
+	HashTable symbols;
+	HashTable labels;
+	zend_bool with_labels = !peaks && has_labels(root);
+
+	zend_hash_init(&symbols, 8, NULL, NULL, 0);
+
+	if (with_labels) {
+		frame_label_costs(&labels);
+	}
+
+	zend_bool success = (
+		dump_pprof_symbols_section(w, &symbols, root) &&
+		dump_pprof_profile_section(w, &symbols, with_labels ? &labels : NULL, root, peaks)
+	);
+
+	if (with_labels) {
+		zend_hash_destroy(&labels);
+	}
+
+	zend_hash_destroy(&symbols);
+
+	return success;
+}
+
+static zend_bool dump_pprof(memprof_writer * w, frame * root) {
+	return dump_pprof_ex(w, root, 0);
+}
+
+static zend_bool dump_pprof_peaks(memprof_writer * w, frame * root) {
+	return dump_pprof_ex(w, root, 1);
+}
+
+typedef struct _folded_path {
+	char * buf;
+	size_t len;
+	size_t size;
+	zend_bool fixed;	/* buf can not grow */
+} folded_path;
+
+/* Appends ";name" to path. Separators are replaced in name. Fails if a
+ * fixed path is full. */
+static zend_bool folded_path_push(folded_path * path, const char * name, size_t name_len)
+{
+	size_t need = safe_size(1, path->len, name_len + 1);
+	char * p;
+	size_t i;
+
+	if (need > path->size) {
+		if (path->fixed) {
+			return 0;
+		}
+		while (need > path->size) {
+			path->size = safe_size(2, path->size, 0);
+		}
+		path->buf = erealloc(path->buf, path->size);
+	}
+
+	p = path->buf + path->len;
+
+	if (path->len != 0) {
+		*p++ = ';';
+	}
+
+	for (i = 0; i < name_len; i++) {
+		p[i] = (name[i] == ';' || name[i] == '\n') ? ':' : name[i];
+	}
+
+	path->len = (p + name_len) - path->buf;
+
+	return 1;
+}
+
+static zend_bool dump_folded_line(memprof_writer * w, folded_path * path, size_t size, size_t count, zend_bool with_blocks)
+{
+	if (size == 0 && (!with_blocks || count == 0)) {
+		return 1;
+	}
+
+	if (!writer_write(w, path->buf, path->len)) {
+		return 0;
+	}
+
+	if (with_blocks) {
+		return writer_printf(w, " %zu %zu\n", size, count);
+	}
+
+	return writer_printf(w, " %zu\n", size);
+}
+
+static zend_bool dump_frame_folded(memprof_writer * w, folded_path * path, HashTable * labels, frame * f, zend_bool with_blocks)
+{
+	size_t prev_len = path->len;
+	size_t size = f->self_size;
+	size_t count = f->self_count;
+	HashTable * costs = NULL;
+	HashPosition pos;
+	zval * znext;
+
+	/* The path is maintained incrementally during the traversal, so that
+	 * lines can be written without walking back to the root */
+	if (!folded_path_push(path, f->name, f->name_len)) {
+		return 0;
+	}
+
+	if (labels != NULL) {
+		costs = zend_hash_index_find_ptr(labels, (zend_ulong) (uintptr_t) f);
+	}
+
+	/* Labelled blocks are reported under a "[label] name" pseudo-frame */
+	if (costs != NULL) {
+		size_t frame_len = path->len;
+		zend_ulong id;
+		label_cost * cost;
+
+		ZEND_HASH_FOREACH_NUM_KEY_PTR(costs, id, cost) {
+			zend_string * name = label_name((uint32_t) id);
+			char * pseudo;
+			size_t pseudo_len;
+
+			size -= cost->size;
+			count -= cost->count;
+
+			pseudo_len = spprintf(&pseudo, 0, "[label] %s", ZSTR_VAL(name));
+			if (!folded_path_push(path, pseudo, pseudo_len)) {
+				efree(pseudo);
+				return 0;
+			}
+			efree(pseudo);
+
+			if (!dump_folded_line(w, path, cost->size, cost->count, with_blocks)) {
+				return 0;
+			}
+
+			path->len = frame_len;
+		} ZEND_HASH_FOREACH_END();
+	}
+
+	if (!dump_folded_line(w, path, size, count, with_blocks)) {
+		return 0;
+	}
+
+	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
+	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
+		zend_string * str_key;
+		zend_ulong num_key;
+		frame * next = Z_PTR_P(znext);
+
+		if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(&f->next_cache, &str_key, &num_key, &pos)) {
+			continue;
+		}
+
+		if (!dump_frame_folded(w, path, labels, next, with_blocks)) {
+			return 0;
+		}
+
+		zend_hash_move_forward_ex(&f->next_cache, &pos);
+	}
+
+	path->len = prev_len;
+
+	return 1;
+}
+
+static zend_bool dump_folded_ex(memprof_writer * w, frame * root, zend_bool with_blocks) {
+	folded_path path;
+	HashTable labels;
+	zend_bool with_labels = has_labels(root);
+	zend_bool success;
+
+	if (reserve_dumping) {
+		path.size = AUTODUMP_PATH_SIZE;
+		path.buf = reserve->path;
+		path.fixed = 1;
+	} else {
+		path.size = 256;
+		path.buf = emalloc(path.size);
+		path.fixed = 0;
+	}
+	path.len = 0;
+
+	if (with_labels) {
+		frame_label_costs(&labels);
+	}
+
+	success = dump_frame_folded(w, &path, with_labels ? &labels : NULL, root, with_blocks);
+
+	if (with_labels) {
+		zend_hash_destroy(&labels);
+	}
+
+	if (!path.fixed) {
+		efree(path.buf);
+	}
+
+	return success;
+}
+
+static zend_bool dump_folded(memprof_writer * w, frame * root) {
+	return dump_folded_ex(w, root, 0);
+}
+
+static zend_bool dump_folded_with_blocks(memprof_writer * w, frame * root) {
+	return dump_folded_ex(w, root, 1);
+}
+
+static zend_bool dump_snapshot(memprof_writer * w, frame * root) {
+	flat_frame * frames;
+	size_t len = flat_frames(root, &frames);
+	snapshot_header header;
+	snapshot_frame * records;
+	snapshot_name * names;
+	size_t names_size = 16;
+	HashTable name_ids;
+	char * strings;
+	size_t strings_len = 0;
+	size_t strings_size = 1024;
+	zend_bool success;
+	size_t i;
+
+	zend_hash_init(&name_ids, 64, NULL, NULL, 0);
+
+	records = safe_emalloc(len, sizeof(*records), 0);
+	names = safe_emalloc(names_size, sizeof(*names), 0);
+	strings = emalloc(strings_size);
+
+	for (i = 0; i < len; i++) {
+		frame * f = frames[i].f;
+		snapshot_frame * r = &records[i];
+		zval * zid = zend_hash_str_find(&name_ids, f->name, f->name_len);
+
+		if (zid == NULL) {
+			uint32_t id = zend_hash_num_elements(&name_ids);
+			zval tmp;
+
+			if (id == names_size) {
+				names_size *= 2;
+				names = safe_erealloc(names, names_size, sizeof(*names), 0);
+			}
+
+			while (strings_size - strings_len <= f->name_len) {
+				strings_size = safe_size(2, strings_size, 0);
+				strings = erealloc(strings, strings_size);
+			}
+
+			names[id].off = strings_len;
+			names[id].len = f->name_len;
+			memcpy(strings + strings_len, f->name, f->name_len + 1);
+			strings_len += f->name_len + 1;
+
+			ZVAL_LONG(&tmp, id);
+			zid = zend_hash_str_add_new(&name_ids, f->name, f->name_len, &tmp);
+		}
+
+		r->parent = frames[i].parent < 0 ? SNAPSHOT_NONE : (uint32_t) frames[i].parent;
+		r->name = Z_LVAL_P(zid);
+		r->calls = f->calls;
+		r->self_size = f->self_size;
+		r->self_count = f->self_count;
+		r->peak_self_size = f->peak_self_size;
+		r->peak_size = f->peak_size;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.frames_count = len;
+	header.names_count = zend_hash_num_elements(&name_ids);
+	header.names_size = strings_len;
+
+	success = (
+		writer_write(w, (const char *) &header, sizeof(header)) &&
+		writer_write(w, (const char *) records, len * sizeof(*records)) &&
+		writer_write(w, (const char *) names, header.names_count * sizeof(*names)) &&
+		writer_write(w, strings, strings_len)
+	);
+
+	efree(strings);
+	zend_hash_destroy(&name_ids);
+	efree(names);
+	efree(records);
+	efree(frames);
+
+	return success;
+}
+
+static zend_bool dump_json_string(memprof_writer * w, const char * str, size_t len)
+{
+	size_t i;
+
+	if (!writer_write(w, "\"", 1)) {
+		return 0;
+	}
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = str[i];
+		zend_bool ok;
+
+		if (c == '"' || c == '\\') {
+			ok = writer_printf(w, "\\%c", c);
+		} else if (c < 0x20) {
+			ok = writer_printf(w, "\\u%04x", c);
+		} else {
+			ok = writer_write(w, (const char *) &c, 1);
+		}
+
+		if (!ok) {
+			return 0;
+		}
+	}
+
+	return writer_write(w, "\"", 1);
+}
+
+static zend_bool dump_frame_json(memprof_writer * w, frame * f)
+{
+	zend_bool first = 1;
+	frame * next;
+
+	if (
+		!writer_printf(w, "{\"name\":")												||
+		!dump_json_string(w, f->name, f->name_len)								||
+		!writer_printf(w, ",\"memory_size\":%zu,\"blocks_count\":%zu", f->self_size, f->self_count) ||
+		!writer_printf(w, ",\"peak_memory_size\":%zu,\"peak_memory_size_inclusive\":%zu", f->peak_self_size, f->peak_size) ||
+		!writer_printf(w, ",\"calls\":%zu,\"called_functions\":[", f->calls)
+	) {
+		return 0;
+	}
+
+	ZEND_HASH_FOREACH_PTR(&f->next_cache, next) {
+		if (!first && !writer_write(w, ",", 1)) {
+			return 0;
+		}
+		first = 0;
+		if (!dump_frame_json(w, next)) {
+			return 0;
+		}
+	} ZEND_HASH_FOREACH_END();
+
+	return writer_printf(w, "]}");
+}
+
+static zend_bool dump_json(memprof_writer * w, frame * root) {
+	return dump_frame_json(w, root) && writer_printf(w, "\n");
+}
+
+/* Writes a timeline record for f. The first record of a frame declares it
+ * with its parent and name, later records only update its costs. */
+static zend_bool delta_write_frame(memprof_writer * w, frame * f)
+{
+	if (f->delta_id != 0) {
+		f->delta_epoch = delta_epoch + 1;
+		return writer_printf(w, "u %" PRIu32 " %zu %zu %zu %zu %zu\n", f->delta_id - 1,
+				f->calls, f->self_size, f->self_count, f->peak_self_size, f->peak_size);
+	}
+
+	/* Parents are declared before their children */
+	if (!FRAME_IS_ROOT(f) && f->prev->delta_id == 0 && !delta_write_frame(w, f->prev)) {
+		return 0;
+	}
+
+	f->delta_id = ++delta_next_id;
+	f->delta_epoch = delta_epoch + 1;
+
+	return (
+		writer_printf(w, "f %" PRIu32 " %" PRId64 " %zu %zu %zu %zu %zu ", f->delta_id - 1,
+				FRAME_IS_ROOT(f) ? (int64_t) -1 : (int64_t) (f->prev->delta_id - 1),
+				f->calls, f->self_size, f->self_count, f->peak_self_size, f->peak_size) &&
+		writer_write(w, f->name, f->name_len) &&
+		writer_printf(w, "\n")
+	);
+}
+
+/* Writes the frames that changed since the previous delta. The first delta
+ * writes the whole tree and starts recording changes. */
+static zend_bool dump_delta(memprof_writer * w, frame * root)
+{
+	struct timeval tv;
+	zend_bool success;
+	size_t i;
+
+	ZEND_ASSERT(root == &root_frame);
+
+	gettimeofday(&tv, NULL);
+
+	success = (
+		(delta_tracking || writer_printf(w, "memprof timeline 1\n")) &&
+		writer_printf(w, "delta %" PRIu32 " %" PRIu64 "\n", delta_seq,
+				((uint64_t) tv.tv_sec) * 1000 + tv.tv_usec / 1000)
+	);
+
+	if (!delta_tracking) {
+		flat_frame * frames;
+		size_t len = flat_frames(root, &frames);
+
+		for (i = 0; success && i < len; i++) {
+			success = delta_write_frame(w, frames[i].f);
+		}
+
+		efree(frames);
+
+		delta_tracking = 1;
+	} else {
+		for (i = 0; success && i < delta_dirty_len; i++) {
+			frame * f = delta_dirty[i];
+			/* Frames are written once per delta, and parents may have been
+			 * declared before their own turn */
+			if (f->delta_epoch != delta_epoch + 1) {
+				success = delta_write_frame(w, f);
+			}
+		}
+	}
+
+	/* Frames are recorded once per epoch. The records of a failed write are
+	 * lost, like the rest of the write. */
+	delta_dirty_len = 0;
+	delta_epoch += 2;
+	delta_seq++;
+
+	return success;
+}
+
+/* Appends a delta to the timeline file of memprof.delta_interval */
+static void delta_append()
+{
+	php_stream * stream;
+
+	WITHOUT_MALLOC_TRACKING {
+
+		if (delta_filename == NULL) {
+			delta_filename = generate_filename("timeline", COMPRESSION_NONE);
+		}
+
+		stream = php_stream_open_wrapper_ex(delta_filename, "a", 0, NULL, NULL);
+		if (stream != NULL) {
+			dump_to_stream(stream, dump_delta, &root_frame);
+			php_stream_free(stream, PHP_STREAM_FREE_CLOSE);
+		}
+
+	} END_WITHOUT_MALLOC_TRACKING;
+}
+
+static void delta_timed_dump()
+{
+	uint64_t now = monotonic_ms();
+
+	if (last_delta_dump != 0 && now - last_delta_dump < (uint64_t) delta_interval) {
+		return;
+	}
+
+	last_delta_dump = now;
+
+	delta_append();
+}
+
+static void delta_destroy()
+{
+	free(delta_dirty);
+	delta_dirty = NULL;
+	delta_dirty_len = 0;
+	delta_dirty_size = 0;
+	delta_tracking = 0;
+	delta_epoch = 0;
+	delta_seq = 0;
+	delta_next_id = 0;
+	delta_calls = 0;
+	last_delta_dump = 0;
+	if (delta_filename != NULL) {
+		efree(delta_filename);
+		delta_filename = NULL;
+	}
+}
+
+/* Writes the call path of f, from the root. Double quotes are doubled when
+ * quote is set. */
+static zend_bool dump_frame_path(memprof_writer * w, frame * f, zend_bool quote)
+{
+	if (!FRAME_IS_ROOT(f) && (!dump_frame_path(w, f->prev, quote) || !writer_write(w, ";", 1))) {
+		return 0;
+	}
+
+	if (quote) {
+		const char * name = f->name;
+		const char * end = f->name + f->name_len;
+		const char * q;
+
+		while ((q = memchr(name, '"', end - name)) != NULL) {
+			if (!writer_write(w, name, q + 1 - name) || !writer_write(w, "\"", 1)) {
+				return 0;
+			}
+			name = q + 1;
+		}
+
+		return writer_write(w, name, end - name);
+	}
+
+	return writer_write(w, f->name, f->name_len);
+}
+
+typedef zend_bool (*free_site_func)(memprof_writer * w, frame * alloc_frame, frame * free_frame, const free_site * site, zend_bool first);
+
+/* Calls func for each pair of allocating and freeing frames. first is set
+ * for the first freeing frame of an allocating frame. */
+static zend_bool free_sites_apply(memprof_writer * w, free_site_func func)
+{
+	Word_t alloc_index = 0;
+	Word_t * p;
+
+	JLF(p, free_sites, alloc_index);
+	while (p != NULL) {
+		Pvoid_t sites = *(Pvoid_t *) p;
+		Word_t free_index = 0;
+		Word_t * q;
+		zend_bool first = 1;
+
+		JLF(q, sites, free_index);
+		while (q != NULL) {
+			if (!func(w, (frame *) alloc_index, (frame *) free_index, (const free_site *) *q, first)) {
+				return 0;
+			}
+			first = 0;
+			JLN(q, sites, free_index);
+		}
+
+		JLN(p, free_sites, alloc_index);
+	}
+
+	return 1;
+}
+
+static zend_bool dump_free_site_csv(memprof_writer * w, frame * alloc_frame, frame * free_frame, const free_site * site, zend_bool first)
+{
+	return (
+		writer_write(w, "\"", 1) &&
+		dump_frame_path(w, alloc_frame, 1) &&
+		writer_write(w, "\",\"", 3) &&
+		dump_frame_path(w, free_frame, 1) &&
+		writer_printf(w, "\",%zu,%zu\n", site->size, site->count)
+	);
 }
 
-static zend_string* read_env_get_post(char *name, size_t len)
+static zend_bool dump_free_sites_csv(memprof_writer * w)
+{
+	return (
+		writer_printf(w, "allocated_by,freed_by,memory_size,blocks_count\n") &&
+		free_sites_apply(w, dump_free_site_csv)
+	);
+}
+
+/* Allocating frames are functions, and freeing frames are their callees */
+static zend_bool dump_free_site_callgrind(memprof_writer * w, frame * alloc_frame, frame * free_frame, const free_site * site, zend_bool first)
+{
+	if (first && (
+		!writer_printf(w, "\nfl=/todo.php\nfn=") ||
+		!dump_frame_path(w, alloc_frame, 0) ||
+		!writer_printf(w, "\n1 0 0\n")
+	)) {
+		return 0;
+	}
+
+	return (
+		writer_printf(w, "cfl=/todo.php\ncfn=") &&
+		dump_frame_path(w, free_frame, 0) &&
+		writer_printf(w, "\ncalls=%zu 1\n", site->count) &&
+		writer_printf(w, "1 %zu %zu\n", site->size, site->count)
+	);
+}
+
+static zend_bool dump_free_sites_callgrind(memprof_writer * w)
+{
+	return (
+		writer_printf(w, "version: 1\n")						&&
+		writer_printf(w, "cmd: unknown\n")						&&
+		writer_printf(w, "positions: line\n")					&&
+		writer_printf(w, "events: FreedMemorySize FreedBlocksCount\n")	&&
+		free_sites_apply(w, dump_free_site_callgrind)
+	);
+}
+
+static memprof_aggregate * aggregate_store_get()
+{
+	const char * output_dir;
+	const char * slash = "/";
+	char * path;
+	zend_long nodes;
+
+	if (aggregate_store != NULL) {
+		return aggregate_store;
+	}
+
+	output_dir = MEMPROF_G(output_dir);
+	if (IS_SLASH(output_dir[strlen(output_dir)-1])) {
+		slash = "";
+	}
+
+	nodes = MEMPROF_G(aggregate_nodes);
+	if (nodes <= 0 || nodes > UINT32_MAX) {
+		nodes = UINT32_MAX;
+	}
+
+	spprintf(&path, 0, "%s%smemprof.aggregate", output_dir, slash);
+	aggregate_store = aggregate_open(path, (uint32_t) nodes);
+	efree(path);
+
+	return aggregate_store;
+}
+
+static void aggregate_merge_frame(memprof_aggregate * agg, uint32_t node, frame * f)
+{
+	HashPosition pos;
+	zval * znext;
+
+	aggregate_add(agg, node, f->calls, f->self_size, f->self_count);
+
+	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
+	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
+		frame * next = Z_PTR_P(znext);
+		uint32_t child = aggregate_child(agg, node, next->name, next->name_len);
+
+		/* When the store is full, subtrees that are not already there are
+		 * dropped */
+		if (child != AGGREGATE_NONE) {
+			aggregate_merge_frame(agg, child, next);
+		}
+
+		zend_hash_move_forward_ex(&f->next_cache, &pos);
+	}
+}
+
+/* Merges the frames of the current request into the aggregate store */
+static void aggregate_merge()
+{
+	memprof_aggregate * agg;
+
+	WITHOUT_MALLOC_TRACKING {
+
+		agg = aggregate_store_get();
+		if (agg != NULL) {
+			aggregate_merge_frame(agg, AGGREGATE_ROOT, &root_frame);
+		}
+
+	} END_WITHOUT_MALLOC_TRACKING;
+}
+
+/* Builds a frame tree from the aggregate store. The tree is a snapshot:
+ * nodes published after a node's parent was visited may be missing. */
+static void aggregate_build_tree(memprof_aggregate * agg, frame * root)
+{
+	uint32_t used = __atomic_load_n(&agg->header->nodes_used, __ATOMIC_ACQUIRE);
+	frame ** frames;
+	uint32_t i;
+
+	if (used > agg->header->nodes_cap) {
+		used = agg->header->nodes_cap;
+	}
+
+	init_frame(root, root, "root", sizeof("root")-1);
+	root->calls = __atomic_load_n(&agg->nodes[AGGREGATE_ROOT].calls, __ATOMIC_RELAXED);
+	root->self_size = __atomic_load_n(&agg->nodes[AGGREGATE_ROOT].self_size, __ATOMIC_RELAXED);
+	root->self_count = __atomic_load_n(&agg->nodes[AGGREGATE_ROOT].self_count, __ATOMIC_RELAXED);
+
+	frames = ecalloc(used, sizeof(*frames));
+	frames[AGGREGATE_ROOT] = root;
+
+	/* A node's parent always has a lower index */
+	for (i = AGGREGATE_ROOT+1; i < used; i++) {
+		aggregate_node * n = &agg->nodes[i];
+		frame * prev;
+		frame * f;
+
+		if (!__atomic_load_n(&n->ready, __ATOMIC_ACQUIRE) || n->parent >= i) {
+			continue;
+		}
+
+		prev = frames[n->parent];
+		if (prev == NULL) {
+			continue;
+		}
+
+		f = new_frame(prev, agg->names + n->name_off, n->name_len);
+		f->calls = __atomic_load_n(&n->calls, __ATOMIC_RELAXED);
+		f->self_size = __atomic_load_n(&n->self_size, __ATOMIC_RELAXED);
+		f->self_count = __atomic_load_n(&n->self_count, __ATOMIC_RELAXED);
+
+		if (zend_hash_str_add_ptr(&prev->next_cache, f->name, f->name_len, f) == NULL) {
+			/* shouldn't happen */
+			destroy_frame(f);
+			free(f);
+			continue;
+		}
+
+		frames[i] = f;
+	}
+
+	efree(frames);
+}
+
+/* Merges a snapshot into the tree of root. Live costs are added, peaks are
+ * the maximum of the merged peaks. */
+static void snapshot_merge_tree(memprof_snapshot * snapshot, frame * root)
+{
+	uint32_t count = snapshot->header->frames_count;
+	frame ** frames;
+	uint32_t i;
+
+	frames = safe_emalloc(count, sizeof(*frames), 0);
+
+	for (i = 0; i < count; i++) {
+		const snapshot_frame * r = &snapshot->frames[i];
+		const snapshot_name * name = &snapshot->names[r->name];
+		frame * f;
+
+		if (i == 0) {
+			f = root;
+		} else {
+			frame * prev = frames[r->parent];
+			f = zend_hash_str_find_ptr(&prev->next_cache, snapshot->strings + name->off, name->len);
+			if (f == NULL) {
+				f = new_frame(prev, (char *) snapshot->strings + name->off, name->len);
+				zend_hash_str_add_ptr(&prev->next_cache, f->name, f->name_len, f);
+			}
+		}
+
+		f->calls += r->calls;
+		f->self_size += r->self_size;
+		f->self_count += r->self_count;
+		f->peak_self_size = MAX(f->peak_self_size, r->peak_self_size);
+		f->peak_size = MAX(f->peak_size, r->peak_size);
+
+		frames[i] = f;
+	}
+
+	efree(frames);
+}
+
+/* Live objects of a class, see memprof_census() */
+typedef struct _census_class {
+	const char * name;
+	size_t count;
+	size_t size;
+} census_class;
+
+typedef struct _census {
+	HashTable classes;	/* class name => census_class */
+	zend_bool deep;
+	Pvoid_t visited;	/* with deep, the arrays, strings and references
+						 * counted so far */
+} census;
+
+/* The size of a tracked block is its allocated size */
+static size_t census_block_size(void * ptr, size_t size)
+{
+	alloc * a;
+
+	if (MEMPROF_G(profile_flags).enabled && (a = is_own_alloc(&allocs_set, ptr)) != NULL) {
+		return alloc_size(a);
+	}
+
+	return size;
+}
+
+static size_t census_table_size(HashTable * ht)
+{
+	size_t size = 0;
+
+	/* Uninitialized tables point to static data */
+	if (ht->nNumUsed > 0) {
+#if PHP_VERSION_ID >= 80200
+		size = HT_IS_PACKED(ht) ? HT_PACKED_SIZE(ht) : HT_SIZE(ht);
+#else
+		size = HT_SIZE(ht);
+#endif
+		size = census_block_size(HT_GET_DATA_ADDR(ht), size);
+	}
+
+	return census_block_size(ht, sizeof(HashTable)) + size;
+}
+
+/* Returns whether ptr was not counted yet */
+static zend_bool census_visit(census * c, void * ptr)
+{
+	int ret;
+
+	J1S(ret, c->visited, (Word_t) ptr);
+
+	return ret;
+}
+
+static size_t census_array_size(census * c, HashTable * ht);
+
+/* Size of what zv owns. Objects are counted on their own. */
+static size_t census_zval_size(census * c, zval * zv)
+{
+	switch (Z_TYPE_P(zv)) {
+		case IS_STRING:
+			if (ZSTR_IS_INTERNED(Z_STR_P(zv)) || !census_visit(c, Z_STR_P(zv))) {
+				return 0;
+			}
+			return census_block_size(Z_STR_P(zv), _ZSTR_STRUCT_SIZE(Z_STRLEN_P(zv)));
+		case IS_ARRAY:
+			return census_array_size(c, Z_ARRVAL_P(zv));
+		case IS_REFERENCE:
+			if (!census_visit(c, Z_REF_P(zv))) {
+				return 0;
+			}
+			return census_block_size(Z_REF_P(zv), sizeof(zend_reference)) + census_zval_size(c, Z_REFVAL_P(zv));
+		default:
+			/* IS_INDIRECT values of property tables are declared
+			 * properties, counted with their object */
+			return 0;
+	}
+}
+
+static size_t census_array_size(census * c, HashTable * ht)
+{
+	size_t size;
+	zval * zv;
+
+	if ((GC_FLAGS(ht) & IS_ARRAY_IMMUTABLE) || !census_visit(c, ht)) {
+		return 0;
+	}
+
+	size = census_table_size(ht);
+
+	ZEND_HASH_FOREACH_VAL(ht, zv) {
+		size += census_zval_size(c, zv);
+	} ZEND_HASH_FOREACH_END();
+
+	return size;
+}
+
+static void census_object(census * c, zend_object * obj)
+{
+	zend_class_entry * ce = obj->ce;
+	/* The names of anonymous classes continue after a NUL byte */
+	const char * name = ZSTR_VAL(ce->name);
+	size_t name_len = strlen(name);
+	census_class * cls;
+	size_t size;
+
+	size = census_block_size((char *) obj - obj->handlers->offset,
+			obj->handlers->offset + sizeof(zend_object) + zend_object_properties_size(ce));
+
+	if (c->deep) {
+		int i;
+
+		for (i = 0; i < ce->default_properties_count; i++) {
+			size += census_zval_size(c, OBJ_PROP_NUM(obj, i));
+		}
+		if (obj->properties != NULL) {
+			size += census_array_size(c, obj->properties);
+		}
+	} else if (obj->properties != NULL && !(GC_FLAGS(obj->properties) & IS_ARRAY_IMMUTABLE)) {
+		size += census_table_size(obj->properties);
+	}
+
+	cls = zend_hash_str_find_ptr(&c->classes, name, name_len);
+	if (cls == NULL) {
+		cls = ecalloc(1, sizeof(*cls));
+		cls->name = name;
+		zend_hash_str_add_new_ptr(&c->classes, name, name_len, cls);
+	}
+
+	cls->count++;
+	cls->size += size;
+}
+
+static int census_class_compare(const void * a, const void * b)
+{
+	size_t sa = (*(census_class * const *) a)->size;
+	size_t sb = (*(census_class * const *) b)->size;
+
+	return sa > sb ? -1 : sa < sb;
+}
+
+static void census_class_swap(void * a, void * b)
+{
+	census_class * tmp = *(census_class **) a;
+	*(census_class **) a = *(census_class **) b;
+	*(census_class **) b = tmp;
+}
+
+static void census_class_dtor(zval * pDest)
+{
+	efree(Z_PTR_P(pDest));
+}
+
+/* Counts the live objects of each class in one pass over the objects
+ * store. Returns the classes by decreasing size, to be freed with efree();
+ * the entries are owned by c->classes. */
+static census_class ** census_run(census * c, zend_bool deep, uint32_t * count)
+{
+	zend_objects_store * store = &EG(objects_store);
+	census_class ** classes;
+	census_class * cls;
+	uint32_t i;
+
+	zend_hash_init(&c->classes, 64, NULL, census_class_dtor, 0);
+	c->deep = deep;
+	c->visited = (Pvoid_t) NULL;
+
+	for (i = 1; i < store->top; i++) {
+		zend_object * obj = store->object_buckets[i];
+		if (IS_OBJ_VALID(obj)) {
+			census_object(c, obj);
+		}
+	}
+
+	if (c->visited != NULL) {
+		Word_t bytes;
+		J1FA(bytes, c->visited);
+	}
+
+	*count = zend_hash_num_elements(&c->classes);
+	classes = safe_emalloc(*count, sizeof(*classes), 0);
+
+	i = 0;
+	ZEND_HASH_FOREACH_PTR(&c->classes, cls) {
+		classes[i++] = cls;
+	} ZEND_HASH_FOREACH_END();
+
+	zend_sort(classes, *count, sizeof(*classes), census_class_compare, census_class_swap);
+
+	return classes;
+}
+
+static void census_destroy(census * c, census_class ** classes)
+{
+	efree(classes);
+	zend_hash_destroy(&c->classes);
+}
+
+/* Retainers, see memprof_retainers() */
+
+#define RETAINER_OBJECT	1	/* the node is a zend_object, otherwise a HashTable */
+#define RETAINER_OWNED	2	/* the parent holds the only reference to the node */
+#define RETAINER_ROOT	4	/* the parent is a root */
+#define RETAINER_FLAGS	7
+
+/* Steps of a path, after which the path is elided */
+#define RETAINERS_PATH_MAX 32
+
+typedef enum _retainer_root_kind {
+	RETAINER_ROOT_GLOBAL,
+	RETAINER_ROOT_STATIC_PROPERTY,
+	RETAINER_ROOT_STATIC_VARIABLE,
+	RETAINER_ROOT_STACK,
+	RETAINER_ROOT_OBJECTS_STORE,
+} retainer_root_kind;
+
+static const char * retainer_root_kinds[] = {
+	"global",
+	"static property",
+	"static variable",
+	"stack",
+	"objects store",
+};
+
+typedef struct _retainer_root {
+	retainer_root_kind kind;
+	zend_function * func;		/* static variables and stack */
+	zend_class_entry * ce;		/* static properties */
+	zend_string * name;			/* NULL for $this and the objects store */
+} retainer_root;
+
+/* Nodes are arrays and objects, stored in the order they are found: the
+ * parent of a node comes before it */
+typedef struct _retainer_node {
+	uintptr_t ptr;		/* node | RETAINER_* flags */
+	size_t parent;		/* index of the parent in nodes, or in roots */
+	size_t size;		/* the node and the strings it holds alone */
+	size_t retained;	/* size, and the retained size of the nodes it holds alone */
+} retainer_node;
+
+/* The nodes and roots are allocated with the system allocator, so that the
+ * walk does not count against the memory limit */
+typedef struct _retainers {
+	retainer_node * nodes;
+	size_t nodes_len;
+	size_t nodes_size;
+	size_t walked;
+	size_t max_nodes;	/* memprof.retainers_max_nodes, or SIZE_MAX */
+	retainer_root * roots;
+	size_t roots_len;
+	size_t roots_size;
+	Pvoid_t visited;	/* Judy1 set of the nodes */
+	zend_bool failed;	/* out of memory */
+	zend_bool truncated;	/* max_nodes was reached */
+} retainers;
+
+static void retainers_add(retainers * r, void * ptr, uintptr_t flags, size_t parent)
+{
+	retainer_node * node;
+	int ret;
+
+	if (r->failed) {
+		return;
+	}
+
+	/* The nodes that are already known are still tested, so that the walk
+	 * is only truncated by nodes that are left out */
+	if (r->nodes_len == r->max_nodes) {
+		int found;
+		J1T(found, r->visited, (Word_t) ptr);
+		if (!found) {
+			r->truncated = 1;
+		}
+		return;
+	}
+
+	J1S(ret, r->visited, (Word_t) ptr);
+	if (!ret) {
+		return;
+	}
+
+	if (r->nodes_len == r->nodes_size) {
+		size_t size = r->nodes_size ? MIN(r->nodes_size * 2, r->max_nodes) : MIN(1024, r->max_nodes);
+		retainer_node * nodes = realloc(r->nodes, size * sizeof(*nodes));
+		if (nodes == NULL) {
+			r->failed = 1;
+			return;
+		}
+		r->nodes = nodes;
+		r->nodes_size = size;
+	}
+
+	node = &r->nodes[r->nodes_len++];
+	node->ptr = (uintptr_t) ptr | flags;
+	node->parent = parent;
+	node->size = 0;
+	node->retained = 0;
+}
+
+/* Adds the array or object held by zv, if any */
+static void retainers_add_zval(retainers * r, zval * zv, uintptr_t flags, size_t parent)
+{
+	flags |= RETAINER_OWNED;
+
+	if (Z_TYPE_P(zv) == IS_INDIRECT) {
+		zv = Z_INDIRECT_P(zv);
+	}
+	if (Z_TYPE_P(zv) == IS_REFERENCE) {
+		if (GC_REFCOUNT(Z_REF_P(zv)) != 1) {
+			flags &= ~RETAINER_OWNED;
+		}
+		zv = Z_REFVAL_P(zv);
+	}
+
+	if (Z_TYPE_P(zv) == IS_ARRAY) {
+		HashTable * ht = Z_ARRVAL_P(zv);
+		/* $GLOBALS is a root */
+		if ((GC_FLAGS(ht) & IS_ARRAY_IMMUTABLE) || ht == &EG(symbol_table)) {
+			return;
+		}
+		if (GC_REFCOUNT(ht) != 1) {
+			flags &= ~RETAINER_OWNED;
+		}
+		retainers_add(r, ht, flags, parent);
+	} else if (Z_TYPE_P(zv) == IS_OBJECT) {
+		if (GC_REFCOUNT(Z_OBJ_P(zv)) != 1) {
+			flags &= ~RETAINER_OWNED;
+		}
+		retainers_add(r, Z_OBJ_P(zv), flags | RETAINER_OBJECT, parent);
+	}
+}
+
+static void retainers_add_root(retainers * r, zval * zv, retainer_root_kind kind, zend_function * func, zend_class_entry * ce, zend_string * name)
+{
+	size_t len = r->nodes_len;
+	retainer_root * root;
+
+	/* The objects found in the objects store share their root */
+	if (kind == RETAINER_ROOT_OBJECTS_STORE && r->roots_len > 0 && r->roots[r->roots_len - 1].kind == kind) {
+		retainers_add_zval(r, zv, RETAINER_ROOT, r->roots_len - 1);
+		return;
+	}
+
+	retainers_add_zval(r, zv, RETAINER_ROOT, r->roots_len);
+	if (r->nodes_len == len) {
+		return;
+	}
+
+	if (r->roots_len == r->roots_size) {
+		size_t size = r->roots_size ? r->roots_size * 2 : 64;
+		retainer_root * roots = realloc(r->roots, size * sizeof(*roots));
+		if (roots == NULL) {
+			r->failed = 1;
+			return;
+		}
+		r->roots = roots;
+		r->roots_size = size;
+	}
+
+	root = &r->roots[r->roots_len++];
+	root->kind = kind;
+	root->func = func;
+	root->ce = ce;
+	root->name = name;
+}
+
+static void retainers_add_static_vars(retainers * r, zend_function * func)
+{
+	HashTable * vars;
+	zend_string * name;
+	zval * zv;
+
+	if (func->type != ZEND_USER_FUNCTION || func->op_array.static_variables == NULL) {
+		return;
+	}
+
+#if PHP_VERSION_ID >= 70400
+	vars = ZEND_MAP_PTR_GET(func->op_array.static_variables_ptr);
+#else
+	vars = func->op_array.static_variables;
+#endif
+	if (vars == NULL) {
+		return;
+	}
+
+	ZEND_HASH_FOREACH_STR_KEY_VAL(vars, name, zv) {
+		retainers_add_root(r, zv, RETAINER_ROOT_STATIC_VARIABLE, func, NULL, name);
+	} ZEND_HASH_FOREACH_END();
+}
+
+static void retainers_add_class_roots(retainers * r, zend_class_entry * ce)
 {
-	zval *value;
+	zend_property_info * info;
+	zend_function * func;
+	zval * statics;
 
-	char *env = sapi_getenv(name, len);
-	if (env != NULL) {
-		zend_string *str = zend_string_init(env, strlen(env), 0);
-		efree(env);
-		return str;
+#if PHP_VERSION_ID >= 70400
+	if (!(ce->ce_flags & ZEND_ACC_LINKED)) {
+		return;
 	}
+#endif
 
-	env = getenv(name);
-	if (env != NULL) {
-		return zend_string_init(env, strlen(env), 0);
+	statics = ce->default_static_members_count > 0 ? CE_STATIC_MEMBERS(ce) : NULL;
+	if (statics != NULL) {
+		ZEND_HASH_FOREACH_PTR(&ce->properties_info, info) {
+			if ((info->flags & ZEND_ACC_STATIC) && info->ce == ce) {
+				retainers_add_root(r, &statics[info->offset], RETAINER_ROOT_STATIC_PROPERTY, NULL, ce, info->name);
+			}
+		} ZEND_HASH_FOREACH_END();
 	}
 
-	if (Z_ARR(PG(http_globals)[TRACK_VARS_GET]) != NULL) {
-		value = zend_hash_str_find(Z_ARR(PG(http_globals)[TRACK_VARS_GET]), name, len);
-		if (value != NULL) {
-			convert_to_string_ex(value);
-			zend_string_addref(Z_STR_P(value));
-			return Z_STR_P(value);
+	ZEND_HASH_FOREACH_PTR(&ce->function_table, func) {
+		retainers_add_static_vars(r, func);
+	} ZEND_HASH_FOREACH_END();
+}
+
+static void retainers_add_roots(retainers * r)
+{
+	zend_execute_data * ex;
+	zend_class_entry * ce;
+	zend_function * func;
+	zend_string * name;
+	zval * zv;
+
+	ZEND_HASH_FOREACH_STR_KEY_VAL(&EG(symbol_table), name, zv) {
+		if (name != NULL) {
+			retainers_add_root(r, zv, RETAINER_ROOT_GLOBAL, NULL, NULL, name);
+		}
+	} ZEND_HASH_FOREACH_END();
+
+	ZEND_HASH_FOREACH_PTR(EG(class_table), ce) {
+		retainers_add_class_roots(r, ce);
+	} ZEND_HASH_FOREACH_END();
+
+	ZEND_HASH_FOREACH_PTR(EG(function_table), func) {
+		retainers_add_static_vars(r, func);
+	} ZEND_HASH_FOREACH_END();
+
+	for (ex = EG(current_execute_data); ex != NULL; ex = ex->prev_execute_data) {
+		uint32_t i;
+
+		if (ex->func == NULL || !ZEND_USER_CODE(ex->func->type)) {
+			continue;
+		}
+		for (i = 0; i < (uint32_t) ex->func->op_array.last_var; i++) {
+			retainers_add_root(r, ZEND_CALL_VAR_NUM(ex, i), RETAINER_ROOT_STACK, ex->func, NULL, ex->func->op_array.vars[i]);
+		}
+		if (Z_TYPE(ex->This) == IS_OBJECT) {
+			retainers_add_root(r, &ex->This, RETAINER_ROOT_STACK, ex->func, NULL, NULL);
 		}
 	}
+}
 
-	if (Z_ARR(PG(http_globals)[TRACK_VARS_POST]) != NULL) {
-		value = zend_hash_str_find(Z_ARR(PG(http_globals)[TRACK_VARS_POST]), name, len);
-		if (value != NULL) {
-			convert_to_string_ex(value);
-			zend_string_addref(Z_STR_P(value));
-			return Z_STR_P(value);
+/* Size of the string or reference held by zv alone */
+static size_t retainers_value_size(zval * zv)
+{
+	size_t size = 0;
+
+	if (Z_TYPE_P(zv) == IS_INDIRECT) {
+		zv = Z_INDIRECT_P(zv);
+	}
+	if (Z_TYPE_P(zv) == IS_REFERENCE) {
+		if (GC_REFCOUNT(Z_REF_P(zv)) != 1) {
+			return 0;
 		}
+		size = census_block_size(Z_REF_P(zv), sizeof(zend_reference));
+		zv = Z_REFVAL_P(zv);
 	}
 
-	return NULL;
+	if (Z_TYPE_P(zv) == IS_STRING && !ZSTR_IS_INTERNED(Z_STR_P(zv)) && GC_REFCOUNT(Z_STR_P(zv)) == 1) {
+		size += census_block_size(Z_STR_P(zv), _ZSTR_STRUCT_SIZE(Z_STRLEN_P(zv)));
+	}
+
+	return size;
 }
 
-static void parse_trigger(memprof_profile_flags * pf)
+/* The values an object holds, as seen by the garbage collector */
+static HashTable * retainers_object_gc(zend_object * obj, zval ** table, int * n)
 {
-	char *saveptr;
-	const char *delim = ",";
-	char *flag;
+#if PHP_VERSION_ID < 80000
+	zval zv;
 
-	zend_string *value = read_env_get_post(MEMPROF_ENV_PROFILE, strlen(MEMPROF_ENV_PROFILE));
-	if (value == NULL) {
-		return;
+	ZVAL_OBJ(&zv, obj);
+
+	return obj->handlers->get_gc(&zv, table, n);
+#else
+	return obj->handlers->get_gc(obj, table, n);
+#endif
+}
+
+static void retainers_walk_object(retainers * r, size_t i, zend_object * obj)
+{
+	HashTable * ht;
+	zval * table;
+	zval * zv;
+	size_t size;
+	int n, j;
+
+	size = census_block_size((char *) obj - obj->handlers->offset,
+			obj->handlers->offset + sizeof(zend_object) + zend_object_properties_size(obj->ce));
+	if (obj->properties != NULL && !(GC_FLAGS(obj->properties) & IS_ARRAY_IMMUTABLE)) {
+		size += census_table_size(obj->properties);
 	}
 
-	pf->enabled = ZSTR_LEN(value) > 0;
+	ht = retainers_object_gc(obj, &table, &n);
 
-	for (flag = strtok_r(ZSTR_VAL(value), delim, &saveptr); flag != NULL; flag = strtok_r(NULL, delim, &saveptr)) {
-		if (HAVE_MALLOC_HOOKS && strcmp(MEMPROF_FLAG_NATIVE, flag) == 0) {
-			pf->native = 1;
+	for (j = 0; j < n; j++) {
+		size += retainers_value_size(&table[j]);
+		retainers_add_zval(r, &table[j], 0, i);
+	}
+	if (ht != NULL) {
+		ZEND_HASH_FOREACH_VAL(ht, zv) {
+			size += retainers_value_size(zv);
+			retainers_add_zval(r, zv, 0, i);
+		} ZEND_HASH_FOREACH_END();
+	}
+
+	r->nodes[i].size = size;
+}
+
+static void retainers_walk_array(retainers * r, size_t i, HashTable * ht)
+{
+	size_t size = census_table_size(ht);
+	zval * zv;
+
+	ZEND_HASH_FOREACH_VAL(ht, zv) {
+		size += retainers_value_size(zv);
+		retainers_add_zval(r, zv, 0, i);
+	} ZEND_HASH_FOREACH_END();
+
+	r->nodes[i].size = size;
+}
+
+/* Breadth first walk of the nodes found so far and their children */
+static void retainers_walk(retainers * r)
+{
+	for (; r->walked < r->nodes_len && !r->failed; r->walked++) {
+		uintptr_t ptr = r->nodes[r->walked].ptr;
+
+		if (ptr & RETAINER_OBJECT) {
+			retainers_walk_object(r, r->walked, (zend_object *) (ptr & ~RETAINER_FLAGS));
+		} else {
+			retainers_walk_array(r, r->walked, (HashTable *) (ptr & ~RETAINER_FLAGS));
 		}
-		if (strcmp(MEMPROF_FLAG_DUMP_ON_LIMIT, flag) == 0) {
-			pf->dump_on_limit = 1;
+	}
+}
+
+/* Finds the nodes reachable from the roots, with their shortest path from a
+ * root, and the size that each node retains. At most max_nodes nodes are
+ * found: the walk is breadth first, so these are the closest to the roots,
+ * and their retained size only counts the nodes found. Returns 0 if out of
+ * memory. */
+static zend_bool retainers_run(retainers * r, size_t max_nodes)
+{
+	zend_objects_store * store = &EG(objects_store);
+	uint32_t i;
+	size_t j;
+
+	memset(r, 0, sizeof(*r));
+	r->max_nodes = max_nodes;
+
+	retainers_add_roots(r);
+	retainers_walk(r);
+
+	/* Objects that are not reachable from the other roots, e.g. garbage
+	 * cycles, or objects held by extensions */
+	for (i = 1; i < store->top && !r->failed; i++) {
+		zend_object * obj = store->object_buckets[i];
+		zval zv;
+
+		if (!IS_OBJ_VALID(obj)) {
+			continue;
 		}
+
+		ZVAL_OBJ(&zv, obj);
+		retainers_add_root(r, &zv, RETAINER_ROOT_OBJECTS_STORE, NULL, NULL, NULL);
+		retainers_walk(r);
 	}
 
-	zend_string_release(value);
+	if (r->failed) {
+		return 0;
+	}
+
+	/* Children come after their parent */
+	for (j = r->nodes_len; j > 0; j--) {
+		retainer_node * node = &r->nodes[j - 1];
+
+		node->retained += node->size;
+		if ((node->ptr & (RETAINER_OWNED | RETAINER_ROOT)) == RETAINER_OWNED) {
+			r->nodes[node->parent].retained += node->retained;
+		}
+	}
+
+	return 1;
 }
 
-ZEND_DLEXPORT int memprof_zend_startup(zend_extension *extension)
+static void retainers_destroy(retainers * r)
 {
-	return zend_startup_module(&memprof_module_entry);
+	Word_t bytes;
+
+	free(r->nodes);
+	free(r->roots);
+	J1FA(bytes, r->visited);
 }
 
-#ifndef ZEND_EXT_API
-#define ZEND_EXT_API    ZEND_DLEXPORT
-#endif
-ZEND_EXTENSION();
+static void retainers_path_function(smart_str * path, zend_function * func)
+{
+	if (func->common.function_name == NULL) {
+		smart_str_appends(path, "main");
+		return;
+	}
+	if (func->common.scope != NULL) {
+		smart_str_append(path, func->common.scope->name);
+		smart_str_appends(path, "::");
+	}
+	smart_str_append(path, func->common.function_name);
+	smart_str_appends(path, "()");
+}
 
-ZEND_DLEXPORT zend_extension zend_extension_entry = {
-	MEMPROF_NAME,
-	PHP_MEMPROF_VERSION,
-	"Arnaud Le Blanc",
-	"https://github.com/arnaud-lb/php-memory-profiler",
-	"Copyright (c) 2013",
-	memprof_zend_startup,
-	NULL,
-	NULL,           /* activate_func_t */
-	NULL,           /* deactivate_func_t */
-	NULL,           /* message_handler_func_t */
-	NULL,           /* op_array_handler_func_t */
-	NULL,           /* statement_handler_func_t */
-	NULL,           /* fcall_begin_handler_func_t */
-	NULL,           /* fcall_end_handler_func_t */
-	NULL,           /* op_array_ctor_func_t */
-	NULL,           /* op_array_dtor_func_t */
-	STANDARD_ZEND_EXTENSION_PROPERTIES
-};
+static void retainers_path_root(smart_str * path, const retainer_root * root, uintptr_t ptr)
+{
+	const char * class_name;
+	const char * prop_name;
+	zend_object * obj;
+
+	switch (root->kind) {
+		case RETAINER_ROOT_GLOBAL:
+			smart_str_appendc(path, '$');
+			smart_str_append(path, root->name);
+			break;
+		case RETAINER_ROOT_STATIC_PROPERTY:
+			zend_unmangle_property_name(root->name, &class_name, &prop_name);
+			smart_str_append(path, root->ce->name);
+			smart_str_appends(path, "::$");
+			smart_str_appends(path, prop_name);
+			break;
+		case RETAINER_ROOT_STATIC_VARIABLE:
+		case RETAINER_ROOT_STACK:
+			retainers_path_function(path, root->func);
+			smart_str_appends(path, "::$");
+			if (root->name != NULL) {
+				smart_str_append(path, root->name);
+			} else {
+				smart_str_appends(path, "this");
+			}
+			break;
+		case RETAINER_ROOT_OBJECTS_STORE:
+			obj = (zend_object *) (ptr & ~RETAINER_FLAGS);
+			smart_str_appends(path, "object(");
+			smart_str_appends(path, ZSTR_VAL(obj->ce->name));
+			smart_str_appends(path, ")#");
+			smart_str_append_long(path, obj->handle);
+			break;
+	}
+}
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_memprof_memory_get_usage, 0, 0, 0)
-	ZEND_ARG_INFO(0, real)
-ZEND_END_ARG_INFO()
+static zend_bool retainers_zval_is(zval * zv, void * child)
+{
+	if (Z_TYPE_P(zv) == IS_INDIRECT) {
+		zv = Z_INDIRECT_P(zv);
+	}
+	ZVAL_DEREF(zv);
+
+	switch (Z_TYPE_P(zv)) {
+		case IS_ARRAY:
+			return (void *) Z_ARRVAL_P(zv) == child;
+		case IS_OBJECT:
+			return (void *) Z_OBJ_P(zv) == child;
+		default:
+			return 0;
+	}
+}
 
-/* {{{ memprof_functions_overrides[]
- */
-const zend_function_entry memprof_function_overrides[] = {
-	PHP_FALIAS(memory_get_peak_usage, memprof_memory_get_peak_usage, arginfo_memprof_memory_get_usage)
-	PHP_FALIAS(memory_get_usage, memprof_memory_get_usage, arginfo_memprof_memory_get_usage)
-	PHP_FE_END    /* Must be the last line in memprof_function_overrides[] */
-};
-/* }}} */
+static void retainers_path_key(smart_str * path, zend_ulong h, zend_string * key)
+{
+	if (key != NULL) {
+		smart_str_appends(path, "[\"");
+		smart_str_append(path, key);
+		smart_str_appends(path, "\"]");
+	} else {
+		smart_str_appendc(path, '[');
+		smart_str_append_long(path, (zend_long) h);
+		smart_str_appendc(path, ']');
+	}
+}
 
-/* {{{ memprof_module_entry
- */
-zend_module_entry memprof_module_entry = {
-	STANDARD_MODULE_HEADER,
-	MEMPROF_NAME,
-	ext_functions,
-	PHP_MINIT(memprof),
-	PHP_MSHUTDOWN(memprof),
-	PHP_RINIT(memprof),
-	PHP_RSHUTDOWN(memprof),
-	PHP_MINFO(memprof),
-	PHP_MEMPROF_VERSION,
-	PHP_MODULE_GLOBALS(memprof),
-	PHP_GINIT(memprof),
-	NULL,
-	NULL,
-	STANDARD_MODULE_PROPERTIES_EX
-};
-/* }}} */
+static void retainers_path_property(smart_str * path, zend_string * name)
+{
+	const char * class_name;
+	const char * prop_name;
 
-#ifdef COMPILE_DL_MEMPROF
-#	ifdef ZTS
-ZEND_TSRMLS_CACHE_DEFINE()
-#	endif
-ZEND_GET_MODULE(memprof)
-#endif
+	zend_unmangle_property_name(name, &class_name, &prop_name);
 
-#ifdef P_tmpdir
-#	define MEMPROF_TEMP_DIR P_tmpdir
-#else
-#	ifdef PHP_WIN32
-#		define MEMPROF_TEMP_DIR "C:\\Windows\\Temp"
-#	else
-#		define MEMPROF_TEMP_DIR "/tmp"
-#	endif
-#endif
+	smart_str_appends(path, "->");
+	smart_str_appends(path, prop_name);
+}
 
-/* {{{ PHP_INI_BEGIN
- */
-PHP_INI_BEGIN()
-	STD_PHP_INI_ENTRY("memprof.output_dir", MEMPROF_TEMP_DIR, PHP_INI_ALL, OnUpdateStringUnempty, output_dir, zend_memprof_globals, memprof_globals)
-PHP_INI_END()
-/* }}} */
+/* Appends the step from parent to child. Values that objects hold outside
+ * of their properties are shown as {internal}. */
+static void retainers_path_step(smart_str * path, uintptr_t parent, void * child)
+{
+	HashTable * ht;
+	zend_string * key;
+	zend_ulong h;
+	zval * zv;
+
+	if (parent & RETAINER_OBJECT) {
+		zend_object * obj = (zend_object *) (parent & ~RETAINER_FLAGS);
+		zval * table;
+		int n, j;
+
+		ht = retainers_object_gc(obj, &table, &n);
+
+		for (j = 0; j < n; j++) {
+			if (retainers_zval_is(&table[j], child)) {
+				zend_property_info * info;
+
+				if (table == obj->properties_table) {
+					ZEND_HASH_FOREACH_PTR(&obj->ce->properties_info, info) {
+						if (!(info->flags & ZEND_ACC_STATIC) && OBJ_PROP(obj, info->offset) == &table[j]) {
+							retainers_path_property(path, info->name);
+							return;
+						}
+					} ZEND_HASH_FOREACH_END();
+				}
+				smart_str_appends(path, "->{internal}");
+				return;
+			}
+		}
 
-/* {{{ PHP_MINIT_FUNCTION
- */
-PHP_MINIT_FUNCTION(memprof)
+		if (ht != NULL) {
+			ZEND_HASH_FOREACH_KEY_VAL(ht, h, key, zv) {
+				if (retainers_zval_is(zv, child)) {
+					if (ht == obj->properties && key != NULL) {
+						retainers_path_property(path, key);
+					} else {
+						smart_str_appends(path, "->{internal}");
+					}
+					return;
+				}
+			} ZEND_HASH_FOREACH_END();
+		}
+
+		smart_str_appends(path, "->{internal}");
+		return;
+	}
+
+	ht = (HashTable *) (parent & ~RETAINER_FLAGS);
+
+	ZEND_HASH_FOREACH_KEY_VAL(ht, h, key, zv) {
+		if (retainers_zval_is(zv, child)) {
+			retainers_path_key(path, h, key);
+			return;
+		}
+	} ZEND_HASH_FOREACH_END();
+}
+
+/* Returns the path from a root to node i. The middle of long paths is
+ * elided. */
+static zend_string * retainers_path(retainers * r, size_t i, const retainer_root ** root)
 {
-	zend_ini_entry * entry;
-	const zend_function_entry * fentry;
+	/* The last nodes of the path, from node i backward */
+	size_t chain[RETAINERS_PATH_MAX + 1];
+	size_t len = 0;
+	size_t j = i;
+	smart_str path = {0};
+
+	for (;;) {
+		if (len < RETAINERS_PATH_MAX + 1) {
+			chain[len++] = j;
+		}
+		if (r->nodes[j].ptr & RETAINER_ROOT) {
+			break;
+		}
+		j = r->nodes[j].parent;
+	}
 
-	REGISTER_INI_ENTRIES();
+	*root = &r->roots[r->nodes[j].parent];
+	retainers_path_root(&path, *root, r->nodes[j].ptr);
 
-	entry = zend_hash_str_find_ptr(EG(ini_directives), "memory_limit", sizeof("memory_limit")-1);
+	if (chain[len - 1] != j) {
+		smart_str_appends(&path, "...");
+	}
 
-	if (entry == NULL) {
-		zend_error(E_CORE_ERROR, "memory_limit ini entry not found");
-		return FAILURE;
+	for (; len > 1; len--) {
+		retainers_path_step(&path, r->nodes[chain[len - 1]].ptr, (void *) (r->nodes[chain[len - 2]].ptr & ~RETAINER_FLAGS));
 	}
 
-	origOnChangeMemoryLimit = entry->on_modify;
-	entry->on_modify = OnChangeMemoryLimit;
+	smart_str_0(&path);
 
-	for (fentry = memprof_function_overrides; fentry->fname; fentry++) {
-		size_t name_len = strlen(fentry->fname);
-		zend_internal_function * orig = zend_hash_str_find_ptr(CG(function_table), fentry->fname, name_len);
-		if (orig != NULL && orig->type == ZEND_INTERNAL_FUNCTION) {
-			orig->handler = fentry->handler;
-		} else {
-			zend_error(E_WARNING, "memprof: Could not override %s(), return value from this function may be be accurate.", fentry->fname);
+	return path.s;
+}
+
+/* Restores the min-heap property of heap from index i down */
+static void retainers_heap_down(retainer_node ** heap, size_t len, size_t i)
+{
+	for (;;) {
+		size_t min = i;
+		size_t l = 2*i + 1;
+		size_t r = 2*i + 2;
+		retainer_node * tmp;
+
+		if (l < len && heap[l]->retained < heap[min]->retained) {
+			min = l;
+		}
+		if (r < len && heap[r]->retained < heap[min]->retained) {
+			min = r;
+		}
+		if (min == i) {
+			return;
+		}
+
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+/* Selects the n nodes that retain the most memory, by decreasing retained
+ * size. Returns the number of selected nodes. */
+static size_t retainers_select(retainers * r, retainer_node ** heap, size_t n)
+{
+	size_t len = 0;
+	size_t i;
+
+	for (i = 0; i < r->nodes_len; i++) {
+		retainer_node * node = &r->nodes[i];
+
+		if (len < n) {
+			heap[len++] = node;
+			if (len == n) {
+				size_t k;
+				for (k = n / 2; k > 0; k--) {
+					retainers_heap_down(heap, len, k - 1);
+				}
+			}
+		} else if (node->retained > heap[0]->retained) {
+			heap[0] = node;
+			retainers_heap_down(heap, len, 0);
 		}
 	}
 
-	return SUCCESS;
+	if (len < n) {
+		for (i = len / 2; i > 0; i--) {
+			retainers_heap_down(heap, len, i - 1);
+		}
+	}
+
+	/* Heap sort: the smallest node is moved to the end */
+	for (i = len; i > 1; i--) {
+		retainer_node * node = heap[0];
+		heap[0] = heap[i - 1];
+		heap[i - 1] = node;
+		retainers_heap_down(heap, i - 1, 0);
+	}
+
+	return len;
 }
-/* }}} */
 
-/* {{{ PHP_MSHUTDOWN_FUNCTION
- */
-PHP_MSHUTDOWN_FUNCTION(memprof)
+static void dump_retainers_array(zval * dest, retainers * r, size_t n)
 {
-	if (origOnChangeMemoryLimit) {
-		zend_ini_entry * entry;
+	retainer_node ** heap;
+	size_t len;
+	size_t i;
 
-		entry = zend_hash_str_find_ptr(EG(ini_directives), "memory_limit", sizeof("memory_limit")-1);
+	n = MIN(n, r->nodes_len);
+	if (n == 0) {
+		array_init(dest);
+		return;
+	}
 
-		if (entry != NULL) {
-			entry->on_modify = origOnChangeMemoryLimit;
+	heap = safe_emalloc(n, sizeof(*heap), 0);
+	len = retainers_select(r, heap, n);
+
+	array_init_size(dest, len);
+
+	for (i = 0; i < len; i++) {
+		retainer_node * node = heap[i];
+		const retainer_root * root;
+		zend_string * path;
+		zval zrow;
+
+		path = retainers_path(r, node - r->nodes, &root);
+
+		array_init(&zrow);
+		if (node->ptr & RETAINER_OBJECT) {
+			zend_object * obj = (zend_object *) (node->ptr & ~RETAINER_FLAGS);
+			const char * name = ZSTR_VAL(obj->ce->name);
+			add_assoc_string_ex(&zrow, ZEND_STRL("type"), "object");
+			add_assoc_stringl_ex(&zrow, ZEND_STRL("class"), (char *) name, strlen(name));
+		} else {
+			add_assoc_string_ex(&zrow, ZEND_STRL("type"), "array");
 		}
+		add_assoc_long_ex(&zrow, ZEND_STRL("memory_size"), node->size);
+		add_assoc_long_ex(&zrow, ZEND_STRL("retained_size"), node->retained);
+		add_assoc_string_ex(&zrow, ZEND_STRL("root"), (char *) retainer_root_kinds[root->kind]);
+		add_assoc_str_ex(&zrow, ZEND_STRL("path"), path);
+		add_next_index_zval(dest, &zrow);
 	}
 
-	return SUCCESS;
+	efree(heap);
 }
-/* }}} */
 
-/* {{{ PHP_RINIT_FUNCTION
- */
-PHP_RINIT_FUNCTION(memprof)
+/* {{{ proto void memprof_dump_array(void)
+   Returns current memory usage as an array */
+PHP_FUNCTION(memprof_dump_array)
 {
-#if defined(ZTS) && defined(COMPILE_DL_FOO)
-	ZEND_TSRMLS_CACHE_UPDATE();
-#endif
+	zend_bool success;
 
-	parse_trigger(&MEMPROF_G(profile_flags));
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		return;
+	}
 
-	if (MEMPROF_G(profile_flags).enabled) {
-		disable_opcache();
-		memprof_enable(&MEMPROF_G(profile_flags));
+	if (!MEMPROF_G(profile_flags).enabled) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_array(): memprof is not enabled", 0);
+		return;
 	}
 
-	rinit_zend_error_cb = zend_error_cb;
-	zend_error_cb_overridden = 0;
+	WITHOUT_MALLOC_TRACKING {
 
-	return SUCCESS;
-}
-/* }}} */
+		success = dump_frame_array(return_value, &root_frame);
 
-/* {{{ PHP_RSHUTDOWN_FUNCTION
- */
-PHP_RSHUTDOWN_FUNCTION(memprof)
-{
-	if (MEMPROF_G(profile_flags).enabled) {
-		memprof_disable();
-	}
+		if (success && has_labels(&root_frame)) {
+			dump_labels_array(return_value);
+		}
 
-	zend_error_cb = rinit_zend_error_cb;
+		if (success && min_tracked_size > 0) {
+			add_assoc_long_ex(return_value, ZEND_STRL("min_tracked_size"), min_tracked_size);
+		}
 
-	return SUCCESS;
-}
-/* }}} */
+	} END_WITHOUT_MALLOC_TRACKING;
 
-/* {{{ PHP_MINFO_FUNCTION
- */
-PHP_MINFO_FUNCTION(memprof)
-{
-	php_info_print_table_start();
-	php_info_print_table_header(2, "memprof support", "enabled");
-	php_info_print_table_header(2, "memprof version", PHP_MEMPROF_VERSION);
-	php_info_print_table_header(2, "memprof native malloc support", HAVE_MALLOC_HOOKS ? "Yes" : "No");
-#if MEMPROF_DEBUG
-	php_info_print_table_header(2, "debug build", "Yes");
-#endif
-	php_info_print_table_end();
+	memprof_dumped = 1;
 
-	DISPLAY_INI_ENTRIES();
+	if (!success) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_array(): dump failed, please check file permissions or disk capacity", 0);
+		return;
+	}
 }
 /* }}} */
 
-/* {{{ PHP_GINIT_FUNCTION
- */
-PHP_GINIT_FUNCTION(memprof)
+/* {{{ proto array memprof_dump_flat()
+   Returns current memory usage as parallel arrays indexed by frame */
+PHP_FUNCTION(memprof_dump_flat)
 {
-	memprof_globals->output_dir = NULL;
-	memprof_globals->output_format = FORMAT_CALLGRIND;
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		return;
+	}
+
+	if (!MEMPROF_G(profile_flags).enabled) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_flat(): memprof is not enabled", 0);
+		return;
+	}
+
+	WITHOUT_MALLOC_TRACKING {
+		dump_flat_array(return_value, &root_frame);
+	} END_WITHOUT_MALLOC_TRACKING;
+
+	memprof_dumped = 1;
 }
 /* }}} */
 
-static void frame_inclusive_cost(frame * f, size_t * inclusive_size, size_t * inclusive_count)
+/* {{{ proto array memprof_top(int n [, string by])
+   Returns the n functions that hold the most memory */
+PHP_FUNCTION(memprof_top)
 {
-	size_t size = 0;
-	size_t count = 0;
-	alloc * alloc;
-	HashPosition pos;
-	zval * znext;
+	zend_long n;
+	char * by_str = "self";
+	size_t by_len = sizeof("self")-1;
+	top_key by;
 
-	LIST_FOREACH(alloc, &f->allocs, list) {
-		size += alloc->size;
-		count ++;
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "l|s", &n, &by_str, &by_len) == FAILURE) {
+		return;
 	}
 
-	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
-	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
-		zend_string * str_key;
-		zend_ulong num_key;
-		size_t call_size;
-		size_t call_count;
-		frame * next = Z_PTR_P(znext);
-
-		if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(&f->next_cache, &str_key, &num_key, &pos)) {
-			continue;
-		}
-
-		frame_inclusive_cost(next, &call_size, &call_count);
+	if (!MEMPROF_G(profile_flags).enabled) {
+		zend_throw_exception(EG(exception_class), "memprof_top(): memprof is not enabled", 0);
+		return;
+	}
 
-		size += call_size;
-		count += call_count;
+	if (n < 0) {
+		zend_throw_exception(EG(exception_class), "memprof_top(): n must be greater than or equal to 0", 0);
+		return;
+	}
 
-		zend_hash_move_forward_ex(&f->next_cache, &pos);
+	if (strcmp(by_str, "self") == 0) {
+		by = TOP_BY_SELF;
+	} else if (strcmp(by_str, "inclusive") == 0) {
+		by = TOP_BY_INCLUSIVE;
+	} else if (strcmp(by_str, "blocks") == 0) {
+		by = TOP_BY_BLOCKS;
+	} else {
+		zend_throw_exception(EG(exception_class), "memprof_top(): unknown sort key, expected one of self, inclusive, blocks", 0);
+		return;
 	}
 
-	*inclusive_size = size;
-	*inclusive_count = count;
+	WITHOUT_MALLOC_TRACKING {
+		dump_top_array(return_value, &root_frame, (size_t) n, by);
+	} END_WITHOUT_MALLOC_TRACKING;
 }
+/* }}} */
 
-static zend_bool dump_frame_array(zval * dest, frame * f)
+/* {{{ proto array memprof_census([bool deep])
+   Returns the number and size of the live objects of each class */
+PHP_FUNCTION(memprof_census)
 {
-	HashPosition pos;
-	zval * znext;
-	zval * zframe = dest;
-	zval zcalled_functions;
-	alloc * alloc;
-	size_t alloc_size = 0;
-	size_t alloc_count = 0;
-	size_t inclusive_size;
-	size_t inclusive_count;
+	zend_bool deep = 0;
+	census c;
+	census_class ** classes;
+	uint32_t count, i;
 
-	array_init(zframe);
-
-	LIST_FOREACH(alloc, &f->allocs, list) {
-		alloc_size += alloc->size;
-		alloc_count ++;
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "|b", &deep) == FAILURE) {
+		return;
 	}
 
-	add_assoc_long_ex(zframe, ZEND_STRL("memory_size"), alloc_size);
-	add_assoc_long_ex(zframe, ZEND_STRL("blocks_count"), alloc_count);
-
-	frame_inclusive_cost(f, &inclusive_size, &inclusive_count);
-	add_assoc_long_ex(zframe, ZEND_STRL("memory_size_inclusive"), inclusive_size);
-	add_assoc_long_ex(zframe, ZEND_STRL("blocks_count_inclusive"), inclusive_count);
-
-	add_assoc_long_ex(zframe, ZEND_STRL("calls"), f->calls);
-
-	array_init(&zcalled_functions);
+	WITHOUT_MALLOC_TRACKING {
+		classes = census_run(&c, deep, &count);
 
-	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
-	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
+		array_init_size(return_value, count);
 
-		zend_string * str_key;
-		zend_ulong num_key;
-		zval zcalled_function;
-		frame * next = Z_PTR_P(znext);
+		for (i = 0; i < count; i++) {
+			zval zcls;
 
-		if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(&f->next_cache, &str_key, &num_key, &pos)) {
-			continue;
+			array_init(&zcls);
+			add_assoc_long_ex(&zcls, ZEND_STRL("objects_count"), classes[i]->count);
+			add_assoc_long_ex(&zcls, ZEND_STRL("memory_size"), classes[i]->size);
+			add_assoc_zval(return_value, classes[i]->name, &zcls);
 		}
 
-		dump_frame_array(&zcalled_function, next);
-		add_assoc_zval_ex(&zcalled_functions, ZSTR_VAL(str_key), ZSTR_LEN(str_key), &zcalled_function);
-
-		zend_hash_move_forward_ex(&f->next_cache, &pos);
-	}
-
-	add_assoc_zval_ex(zframe, ZEND_STRL("called_functions"), &zcalled_functions);
-
-	return 1;
+		census_destroy(&c, classes);
+	} END_WITHOUT_MALLOC_TRACKING;
 }
+/* }}} */
 
-static zend_bool dump_frame_callgrind(php_stream * stream, frame * f, char * fname, size_t * inclusive_size, size_t * inclusive_count)
+/* {{{ proto void memprof_dump_census(resource handle [, bool deep])
+   Dumps the number and size of the live objects of each class to stream $handle, in CSV format */
+PHP_FUNCTION(memprof_dump_census)
 {
-	size_t size = 0;
-	size_t count = 0;
-	size_t self_size = 0;
-	size_t self_count = 0;
-	alloc * alloc;
-	HashPosition pos;
-	zval * znext;
+	zval *arg1;
+	php_stream *stream;
+	zend_bool deep = 0;
+	census c;
+	census_class ** classes;
+	uint32_t count, i;
+	memprof_writer w;
+	zend_bool success;
 
-	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
-	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
-		zend_string * str_key;
-		zend_ulong num_key;
-		size_t call_size;
-		size_t call_count;
-		frame * next = Z_PTR_P(znext);
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "r|b", &arg1, &deep) == FAILURE) {
+		return;
+	}
 
-		if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(&f->next_cache, &str_key, &num_key, &pos)) {
-			continue;
-		}
+	php_stream_from_zval(stream, arg1);
 
-		if (!dump_frame_callgrind(stream, next, ZSTR_VAL(str_key), &call_size, &call_count)) {
-			return 0;
+	WITHOUT_MALLOC_TRACKING {
+		classes = census_run(&c, deep, &count);
+
+		writer_init(&w, stream, MEMPROF_G(output_compression));
+		success = writer_printf(&w, "class,objects_count,memory_size\n");
+		for (i = 0; success && i < count; i++) {
+			success = writer_printf(&w, "\"%s\",%zu,%zu\n", classes[i]->name, classes[i]->count, classes[i]->size);
 		}
+		success = writer_close(&w) && success;
 
-		size += call_size;
-		count += call_count;
+		census_destroy(&c, classes);
+	} END_WITHOUT_MALLOC_TRACKING;
 
-		zend_hash_move_forward_ex(&f->next_cache, &pos);
+	if (!success) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_census(): dump failed, please check file permissions or disk capacity", 0);
+		return;
 	}
+}
+/* }}} */
 
-	if (
-		!stream_printf(stream, "fl=/todo.php\n") ||
-		!stream_printf(stream, "fn=%s\n", fname)
-	) {
-		return 0;
-	}
+/* {{{ proto array memprof_retainers([int n [, bool &truncated]])
+   Returns the n arrays and objects that retain the most memory, with the shortest path from a root to each of them */
+PHP_FUNCTION(memprof_retainers)
+{
+	zend_long n = 10;
+	zval * ztruncated = NULL;
+	retainers r;
+	zend_bool success;
+	size_t max_nodes;
 
-	LIST_FOREACH(alloc, &f->allocs, list) {
-		self_size += alloc->size;
-		self_count ++;
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "|lz", &n, &ztruncated) == FAILURE) {
+		return;
 	}
-	size += self_size;
-	count += self_count;
 
-	if (!stream_printf(stream, "1 %zu %zu\n", self_size, self_count)) {
-		return 0;
+	if (n < 0) {
+		zend_throw_exception(EG(exception_class), "memprof_retainers(): n must be greater than or equal to 0", 0);
+		return;
 	}
 
-	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
-	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
-		zend_string * str_key;
-		zend_ulong num_key;
-		size_t call_size;
-		size_t call_count;
-		frame * next = Z_PTR_P(znext);
-
-		if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(&f->next_cache, &str_key, &num_key, &pos)) {
-			continue;
-		}
-
-		frame_inclusive_cost(next, &call_size, &call_count);
+	max_nodes = MEMPROF_G(retainers_max_nodes) > 0 ? (size_t) MEMPROF_G(retainers_max_nodes) : SIZE_MAX;
 
-		if (
-			!stream_printf(stream, "cfl=/todo.php\n")						||
-			!stream_printf(stream, "cfn=%s\n", ZSTR_VAL(str_key))			||
-			!stream_printf(stream, "calls=%zu 1\n", next->calls)			||
-			!stream_printf(stream, "1 %zu %zu\n", call_size, call_count)
-		) {
-			return 0;
+	WITHOUT_MALLOC_TRACKING {
+		success = retainers_run(&r, max_nodes);
+		if (success) {
+			dump_retainers_array(return_value, &r, (size_t) n);
 		}
+		retainers_destroy(&r);
+	} END_WITHOUT_MALLOC_TRACKING;
 
-		zend_hash_move_forward_ex(&f->next_cache, &pos);
+	if (!success) {
+		zend_throw_exception(EG(exception_class), "memprof_retainers(): out of memory", 0);
+		return;
 	}
 
-	if (!stream_printf(stream, "\n")) {
-		return 0;
+	if (ztruncated != NULL) {
+#if PHP_VERSION_ID >= 70400
+		ZEND_TRY_ASSIGN_REF_BOOL(ztruncated, r.truncated);
+#else
+		ZVAL_DEREF(ztruncated);
+		zval_ptr_dtor(ztruncated);
+		ZVAL_BOOL(ztruncated, r.truncated);
+#endif
 	}
+}
+/* }}} */
 
-	if (inclusive_size) {
-		*inclusive_size = size;
-	}
-	if (inclusive_count) {
-		*inclusive_count = count;
+/* {{{ proto void memprof_dump_callgrind(resource handle)
+   Dumps current memory usage in callgrind format to stream $handle */
+PHP_FUNCTION(memprof_dump_callgrind)
+{
+	zval *arg1;
+	php_stream *stream;
+	zend_bool success;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "r", &arg1) == FAILURE) {
+		return;
 	}
 
-	return 1;
-}
+	if (!MEMPROF_G(profile_flags).enabled) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_callgrind(): memprof is not enabled", 0);
+		return;
+	}
 
-static zend_bool dump_callgrind(php_stream * stream) {
-	size_t total_size;
-	size_t total_count;
+	php_stream_from_zval(stream, arg1);
 
-	return (
-		stream_printf(stream, "version: 1\n")						&&
-		stream_printf(stream, "cmd: unknown\n")						&&
-		stream_printf(stream, "positions: line\n")					&&
-		stream_printf(stream, "events: MemorySize BlocksCount\n")	&&
-		stream_printf(stream, "\n")									&&
+	WITHOUT_MALLOC_TRACKING {
+		success = dump_to_stream(stream, dump_callgrind, &root_frame);
+	} END_WITHOUT_MALLOC_TRACKING;
 
-		dump_frame_callgrind(stream, &root_frame, "root", &total_size, &total_count) &&
+	memprof_dumped = 1;
 
-		stream_printf(stream, "total: %zu %zu\n", total_size, total_count)
-	);
+	if (!success) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_callgrind(): dump failed, please check file permissions or disk capacity", 0);
+		return;
+	}
 }
+/* }}} */
 
-static zend_bool dump_frames_pprof(php_stream * stream, HashTable * symbols, frame * f)
+/* {{{ proto void memprof_dump_pprof(resource handle [, bool peaks])
+   Dumps current memory usage in pprof heapprofile format to stream $handle */
+PHP_FUNCTION(memprof_dump_pprof)
 {
-	HashPosition pos;
-	frame * prev;
-	zval * znext;
-	size_t size = frame_alloc_size(f);
-	size_t stack_depth = frame_stack_depth(f);
+	zval *arg1;
+	php_stream *stream;
+	zend_bool peaks = 0;
+	zend_bool success;
 
-	if (0 < size) {
-		stream_write_word(stream, size);
-		stream_write_word(stream, stack_depth);
-
-		for (prev = f; prev != &root_frame; prev = prev->prev) {
-			zend_uintptr_t symaddr;
-			symaddr = (zend_uintptr_t) zend_hash_str_find_ptr(symbols, prev->name, prev->name_len);
-			if (symaddr == 0) {
-				/* shouldn't happen */
-				zend_error(E_CORE_ERROR, "symbol address not found");
-				return 0;
-			}
-			if (!stream_write_word(stream, symaddr)) {
-				return 0;
-			}
-		}
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "r|b", &arg1, &peaks) == FAILURE) {
+		return;
 	}
 
-	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
-	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
-		zend_string * str_key;
-		zend_ulong num_key;
-		frame * next = Z_PTR_P(znext);
+	if (!MEMPROF_G(profile_flags).enabled) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_pprof(): memprof is not enabled", 0);
+		return;
+	}
 
-		if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(&f->next_cache, &str_key, &num_key, &pos)) {
-			continue;
-		}
+	php_stream_from_zval(stream, arg1);
 
-		if (!dump_frames_pprof(stream, symbols, next)) {
-			return 0;
-		}
+	WITHOUT_MALLOC_TRACKING {
+		success = dump_to_stream(stream, peaks ? dump_pprof_peaks : dump_pprof, &root_frame);
+	} END_WITHOUT_MALLOC_TRACKING;
 
-		zend_hash_move_forward_ex(&f->next_cache, &pos);
-	}
+	memprof_dumped = 1;
 
-	return 1;
+	if (!success) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_pprof(): dump failed, please check file permissions or disk capacity", 0);
+		return;
+	}
 }
+/* }}} */
 
-static zend_bool dump_frames_pprof_symbols(php_stream * stream, HashTable * symbols, frame * f)
+/* {{{ proto void memprof_dump_folded(resource handle [, bool with_blocks])
+   Dumps current memory usage in collapsed stacks format to stream $handle */
+PHP_FUNCTION(memprof_dump_folded)
 {
-	HashPosition pos;
-	zval * znext;
-	zend_uintptr_t symaddr;
+	zval *arg1;
+	php_stream *stream;
+	zend_bool with_blocks = 0;
+	zend_bool success;
 
-	if (!zend_hash_str_exists(symbols, f->name, f->name_len)) {
-		/* addr only has to be unique */
-		symaddr = (symbols->nNumOfElements+1)<<3;
-		zend_hash_str_add_ptr(symbols, f->name, f->name_len, (void*) symaddr);
-		if (!stream_printf(stream, "0x%0*x %s\n", sizeof(symaddr)*2, symaddr, f->name)) {
-			return 0;
-		}
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "r|b", &arg1, &with_blocks) == FAILURE) {
+		return;
 	}
 
-	zend_hash_internal_pointer_reset_ex(&f->next_cache, &pos);
-	while ((znext = zend_hash_get_current_data_ex(&f->next_cache, &pos)) != NULL) {
-		zend_string * str_key;
-		zend_ulong num_key;
-		frame * next = Z_PTR_P(znext);
-
-		if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(&f->next_cache, &str_key, &num_key, &pos)) {
-			continue;
-		}
-
-		if (!dump_frames_pprof_symbols(stream, symbols, next)) {
-			return 0;
-		}
-
-		zend_hash_move_forward_ex(&f->next_cache, &pos);
+	if (!MEMPROF_G(profile_flags).enabled) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_folded(): memprof is not enabled", 0);
+		return;
 	}
 
-	return 1;
-}
+	php_stream_from_zval(stream, arg1);
 
-static zend_bool dump_pprof_symbols_section(php_stream * stream, HashTable * symbols) {
-	return (
-		stream_printf(stream, "--- symbol\n")					&&
-		stream_printf(stream, "binary=todo.php\n")				&&
+	WITHOUT_MALLOC_TRACKING {
+		success = dump_to_stream(stream, with_blocks ? dump_folded_with_blocks : dump_folded, &root_frame);
+	} END_WITHOUT_MALLOC_TRACKING;
 
-		dump_frames_pprof_symbols(stream, symbols, &root_frame)	&&
+	memprof_dumped = 1;
 
-		stream_printf(stream, "---\n")
-	);
+	if (!success) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_folded(): dump failed, please check file permissions or disk capacity", 0);
+		return;
+	}
 }
+/* }}} */
 
-static zend_bool dump_pprof_profile_section(php_stream * stream, HashTable * symbols) {
-	return (
-		stream_printf(stream, "--- profile\n") &&
-
-		/* header count */
-		stream_write_word(stream, 0)  &&
-
-		/* header words after this one */
-		stream_write_word(stream, 3)  &&
-
-		/* format version */
-		stream_write_word(stream, 0)  &&
+/* {{{ proto void memprof_dump_aggregate(resource handle [, string format])
+   Dumps the memory usage aggregated across requests to stream $handle */
+PHP_FUNCTION(memprof_dump_aggregate)
+{
+	zval *arg1;
+	php_stream *stream;
+	char * format_name = "callgrind";
+	size_t format_name_len = sizeof("callgrind")-1;
+	memprof_output_format format;
+	memprof_aggregate * agg;
+	frame root;
+	dump_func dump;
+	zend_bool success = 0;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "r|s", &arg1, &format_name, &format_name_len) == FAILURE) {
+		return;
+	}
 
-		/* sampling period */
-		stream_write_word(stream, 0)  &&
+	if (!parse_output_format(format_name, &format)) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_aggregate(): unknown format, expected one of callgrind, pprof, folded, snapshot", 0);
+		return;
+	}
 
-		/* unused padding */
-		stream_write_word(stream, 0)  &&
+	dump = format_dump_func(format);
 
-		dump_frames_pprof(stream, symbols, &root_frame)
-	);
-}
+	php_stream_from_zval(stream, arg1);
 
-static zend_bool dump_pprof(php_stream * stream) {
-	HashTable symbols;
+	WITHOUT_MALLOC_TRACKING {
 
-	zend_hash_init(&symbols, 8, NULL, NULL, 0);
+		agg = aggregate_store_get();
+		if (agg != NULL) {
+			aggregate_build_tree(agg, &root);
+			success = dump_to_stream(stream, dump, &root);
+			destroy_frame(&root);
+		}
 
-	zend_bool success = (
-		dump_pprof_symbols_section(stream, &symbols) &&
-		dump_pprof_profile_section(stream, &symbols)
-	);
+	} END_WITHOUT_MALLOC_TRACKING;
 
-	zend_hash_destroy(&symbols);
+	if (agg == NULL) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_aggregate(): could not open the aggregate store, please check memprof.output_dir", 0);
+		return;
+	}
 
-	return success;
+	if (!success) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_aggregate(): dump failed, please check file permissions or disk capacity", 0);
+		return;
+	}
 }
+/* }}} */
 
-/* {{{ proto void memprof_dump_array(void)
-   Returns current memory usage as an array */
-PHP_FUNCTION(memprof_dump_array)
+/* {{{ proto void memprof_dump_snapshot(resource handle)
+   Dumps current memory usage as a binary snapshot to stream $handle */
+PHP_FUNCTION(memprof_dump_snapshot)
 {
+	zval *arg1;
+	php_stream *stream;
 	zend_bool success;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "r", &arg1) == FAILURE) {
 		return;
 	}
 
 	if (!MEMPROF_G(profile_flags).enabled) {
-		zend_throw_exception(EG(exception_class), "memprof_dump_array(): memprof is not enabled", 0);
+		zend_throw_exception(EG(exception_class), "memprof_dump_snapshot(): memprof is not enabled", 0);
 		return;
 	}
 
-	WITHOUT_MALLOC_TRACKING {
-
-		success = dump_frame_array(return_value, &root_frame);
+	php_stream_from_zval(stream, arg1);
 
+	WITHOUT_MALLOC_TRACKING {
+		success = dump_to_stream(stream, dump_snapshot, &root_frame);
 	} END_WITHOUT_MALLOC_TRACKING;
 
 	memprof_dumped = 1;
 
 	if (!success) {
-		zend_throw_exception(EG(exception_class), "memprof_dump_array(): dump failed, please check file permissions or disk capacity", 0);
+		zend_throw_exception(EG(exception_class), "memprof_dump_snapshot(): dump failed, please check file permissions or disk capacity", 0);
 		return;
 	}
 }
 /* }}} */
 
-/* {{{ proto void memprof_dump_callgrind(resource handle)
-   Dumps current memory usage in callgrind format to stream $handle */
-PHP_FUNCTION(memprof_dump_callgrind)
+/* {{{ proto void memprof_convert_snapshots(array paths, resource handle [, string format])
+   Merges snapshot files and dumps them in the given format to stream $handle */
+PHP_FUNCTION(memprof_convert_snapshots)
+{
+	zval *zpaths;
+	zval *arg1;
+	zval *zpath;
+	php_stream *stream;
+	char * format_name = "callgrind";
+	size_t format_name_len = sizeof("callgrind")-1;
+	memprof_output_format format;
+	dump_func dump;
+	frame root;
+	zend_bool success = 1;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "ar|s", &zpaths, &arg1, &format_name, &format_name_len) == FAILURE) {
+		return;
+	}
+
+	if (strcmp(format_name, "json") == 0) {
+		dump = dump_json;
+	} else if (parse_output_format(format_name, &format)) {
+		dump = format_dump_func(format);
+	} else {
+		zend_throw_exception(EG(exception_class), "memprof_convert_snapshots(): unknown format, expected one of callgrind, pprof, folded, snapshot, json", 0);
+		return;
+	}
+
+	php_stream_from_zval(stream, arg1);
+
+	WITHOUT_MALLOC_TRACKING {
+
+		init_frame(&root, &root, "root", sizeof("root")-1);
+
+		ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(zpaths), zpath) {
+			memprof_snapshot * snapshot;
+
+			if (Z_TYPE_P(zpath) != IS_STRING) {
+				zend_throw_exception(EG(exception_class), "memprof_convert_snapshots(): paths must be strings", 0);
+				success = 0;
+				break;
+			}
+
+			snapshot = snapshot_open(Z_STRVAL_P(zpath));
+			if (snapshot == NULL) {
+				zend_throw_exception_ex(EG(exception_class), 0, "memprof_convert_snapshots(): %s is not a readable snapshot", Z_STRVAL_P(zpath));
+				success = 0;
+				break;
+			}
+
+			snapshot_merge_tree(snapshot, &root);
+			snapshot_close(snapshot);
+		} ZEND_HASH_FOREACH_END();
+
+		if (success && !dump_to_stream(stream, dump, &root)) {
+			zend_throw_exception(EG(exception_class), "memprof_convert_snapshots(): dump failed, please check file permissions or disk capacity", 0);
+		}
+
+		destroy_frame(&root);
+
+	} END_WITHOUT_MALLOC_TRACKING;
+}
+/* }}} */
+
+/* {{{ proto void memprof_dump_delta(resource handle)
+   Appends the frames that changed since the previous delta to stream $handle */
+PHP_FUNCTION(memprof_dump_delta)
 {
 	zval *arg1;
 	php_stream *stream;
@@ -1657,52 +6376,72 @@ PHP_FUNCTION(memprof_dump_callgrind)
 	}
 
 	if (!MEMPROF_G(profile_flags).enabled) {
-		zend_throw_exception(EG(exception_class), "memprof_dump_callgrind(): memprof is not enabled", 0);
+		zend_throw_exception(EG(exception_class), "memprof_dump_delta(): memprof is not enabled", 0);
 		return;
 	}
 
 	php_stream_from_zval(stream, arg1);
 
 	WITHOUT_MALLOC_TRACKING {
-		success = dump_callgrind(stream);
+		success = dump_to_stream(stream, dump_delta, &root_frame);
 	} END_WITHOUT_MALLOC_TRACKING;
 
 	memprof_dumped = 1;
 
 	if (!success) {
-		zend_throw_exception(EG(exception_class), "memprof_dump_callgrind(): dump failed, please check file permissions or disk capacity", 0);
+		zend_throw_exception(EG(exception_class), "memprof_dump_delta(): dump failed, please check file permissions or disk capacity", 0);
 		return;
 	}
 }
 /* }}} */
 
-/* {{{ proto void memprof_dump_pprof(resource handle)
-   Dumps current memory usage in pprof heapprofile format to stream $handle */
-PHP_FUNCTION(memprof_dump_pprof)
+/* {{{ proto void memprof_dump_free_sites(resource handle [, string format])
+   Dumps the bytes freed by each frame, for each frame that allocated them, to stream $handle */
+PHP_FUNCTION(memprof_dump_free_sites)
 {
 	zval *arg1;
 	php_stream *stream;
+	char * format = "callgrind";
+	size_t format_len = sizeof("callgrind")-1;
+	zend_bool (*dump)(memprof_writer * w);
+	memprof_writer w;
 	zend_bool success;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "r", &arg1) == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "r|s", &arg1, &format, &format_len) == FAILURE) {
 		return;
 	}
 
 	if (!MEMPROF_G(profile_flags).enabled) {
-		zend_throw_exception(EG(exception_class), "memprof_dump_pprof(): memprof is not enabled", 0);
+		zend_throw_exception(EG(exception_class), "memprof_dump_free_sites(): memprof is not enabled", 0);
+		return;
+	}
+
+	if (!free_sites_enabled) {
+		zend_throw_exception(EG(exception_class), "memprof_dump_free_sites(): memprof.free_sites was not enabled when profiling was enabled", 0);
+		return;
+	}
+
+	if (strcmp(format, "callgrind") == 0) {
+		dump = dump_free_sites_callgrind;
+	} else if (strcmp(format, "csv") == 0) {
+		dump = dump_free_sites_csv;
+	} else {
+		zend_throw_exception(EG(exception_class), "memprof_dump_free_sites(): unknown format, expected one of callgrind, csv", 0);
 		return;
 	}
 
 	php_stream_from_zval(stream, arg1);
 
 	WITHOUT_MALLOC_TRACKING {
-		success = dump_pprof(stream);
+		writer_init(&w, stream, MEMPROF_G(output_compression));
+		success = dump(&w);
+		success = writer_close(&w) && success;
 	} END_WITHOUT_MALLOC_TRACKING;
 
 	memprof_dumped = 1;
 
 	if (!success) {
-		zend_throw_exception(EG(exception_class), "memprof_dump_pprof(): dump failed, please check file permissions or disk capacity", 0);
+		zend_throw_exception(EG(exception_class), "memprof_dump_free_sites(): dump failed, please check file permissions or disk capacity", 0);
 		return;
 	}
 }
@@ -1789,6 +6528,115 @@ PHP_FUNCTION(memprof_disable)
 }
 /* }}} */
 
+/* {{{ proto void memprof_scope_push(string label)
+   Attributes the blocks allocated from now on to label, until the matching
+   memprof_scope_pop() */
+PHP_FUNCTION(memprof_scope_push)
+{
+	zend_string * label;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &label) == FAILURE) {
+		return;
+	}
+
+	if (!MEMPROF_G(profile_flags).enabled) {
+		zend_throw_exception(EG(exception_class), "memprof_scope_push(): memprof is not enabled", 0);
+		return;
+	}
+
+	WITHOUT_MALLOC_TRACKING {
+
+		if (label_stack_len == label_stack_size) {
+			label_stack_size = label_stack_size ? label_stack_size * 2 : 8;
+			label_stack = safe_erealloc(label_stack, label_stack_size, sizeof(*label_stack), 0);
+		}
+
+		label_stack[label_stack_len++] = current_label;
+		current_label = label_intern(label);
+
+	} END_WITHOUT_MALLOC_TRACKING;
+}
+/* }}} */
+
+/* {{{ proto string memprof_scope_pop()
+   Restores the label that was active before the last memprof_scope_push(),
+   and returns the label that was active */
+PHP_FUNCTION(memprof_scope_pop)
+{
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		return;
+	}
+
+	if (!MEMPROF_G(profile_flags).enabled) {
+		zend_throw_exception(EG(exception_class), "memprof_scope_pop(): memprof is not enabled", 0);
+		return;
+	}
+
+	if (label_stack_len == 0) {
+		zend_throw_exception(EG(exception_class), "memprof_scope_pop(): no scope was pushed", 0);
+		return;
+	}
+
+	RETVAL_STR_COPY(label_name(current_label));
+
+	current_label = label_stack[--label_stack_len];
+}
+/* }}} */
+
+/* {{{ proto bool memprof_pause()
+   Stops tracking new allocations and calls, until memprof_resume() is called */
+PHP_FUNCTION(memprof_pause)
+{
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		return;
+	}
+
+	if (!MEMPROF_G(profile_flags).enabled) {
+		zend_throw_exception(EG(exception_class), "memprof_pause(): memprof is not enabled", 0);
+		return;
+	}
+
+	if (memprof_paused) {
+		zend_throw_exception(EG(exception_class), "memprof_pause(): memprof is already paused", 0);
+		return;
+	}
+
+	memprof_paused = 1;
+
+	RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto bool memprof_resume()
+   Resumes tracking after memprof_pause() */
+PHP_FUNCTION(memprof_resume)
+{
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		return;
+	}
+
+	if (!MEMPROF_G(profile_flags).enabled) {
+		zend_throw_exception(EG(exception_class), "memprof_resume(): memprof is not enabled", 0);
+		return;
+	}
+
+	if (!memprof_paused) {
+		zend_throw_exception(EG(exception_class), "memprof_resume(): memprof is not paused", 0);
+		return;
+	}
+
+	memprof_paused = 0;
+
+	/* Allocations made while paused were not counted. Thresholds crossed in
+	 * the meantime are skipped. */
+	dump_thresholds_arm();
+	cgroup_check_arm();
+	alloc_trigger_arm();
+
+	RETURN_TRUE;
+}
+/* }}} */
+
 /* {{{ proto bool memprof_enabled()
    Returns whether memprof is enabled */
 PHP_FUNCTION(memprof_enabled)
@@ -1813,6 +6661,7 @@ PHP_FUNCTION(memprof_enabled_flags)
 	add_assoc_bool(return_value, "enabled", MEMPROF_G(profile_flags).enabled);
 	add_assoc_bool(return_value, "native", MEMPROF_G(profile_flags).native);
 	add_assoc_bool(return_value, "dump_on_limit", MEMPROF_G(profile_flags).dump_on_limit);
+	add_assoc_bool(return_value, "trace", MEMPROF_G(profile_flags).trace);
 }
 /* }}} */
 
@@ -13,8 +13,20 @@ function memprof_enable(): bool {}
 
 function memprof_disable(): bool {}
 
+function memprof_pause(): bool {}
+
+function memprof_resume(): bool {}
+
+function memprof_scope_push(string $label): void {}
+
+function memprof_scope_pop(): string {}
+
 function memprof_dump_array(): array {}
 
+function memprof_dump_flat(): array {}
+
+function memprof_top(int $n, string $by = "self"): array {}
+
 /**
  * @param resource $handle
  */
@@ -23,6 +35,45 @@ function memprof_dump_callgrind($handle): void {}
 /**
  * @param resource $handle
  */
-function memprof_dump_pprof($handle): void {}
+function memprof_dump_pprof($handle, bool $peaks = false): void {}
+
+/**
+ * @param resource $handle
+ */
+function memprof_dump_folded($handle, bool $with_blocks = false): void {}
+
+/**
+ * @param resource $handle
+ */
+function memprof_dump_aggregate($handle, string $format = "callgrind"): void {}
+
+/**
+ * @param resource $handle
+ */
+function memprof_dump_snapshot($handle): void {}
+
+/**
+ * @param resource $handle
+ */
+function memprof_convert_snapshots(array $paths, $handle, string $format = "callgrind"): void {}
+
+/**
+ * @param resource $handle
+ */
+function memprof_dump_delta($handle): void {}
+
+/**
+ * @param resource $handle
+ */
+function memprof_dump_free_sites($handle, string $format = "callgrind"): void {}
+
+function memprof_census(bool $deep = false): array {}
+
+/**
+ * @param resource $handle
+ */
+function memprof_dump_census($handle, bool $deep = false): void {}
+
+function memprof_retainers(int $n = 10, &$truncated = null): array {}
 
 function memprof_version(): string {}
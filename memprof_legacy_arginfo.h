@@ -1,5 +1,5 @@
 /* This is a generated file, edit the .stub.php file instead.
- * Stub hash: afb43b76aec85442c7267aba0b45bfd00d5c8cf1 */
+ * Stub hash: f80d8c3f300ce416f879d3aaf539185e5c39ca80 */
 
 ZEND_BEGIN_ARG_INFO_EX(arginfo_memprof_enabled, 0, 0, 0)
 ZEND_END_ARG_INFO()
@@ -10,13 +10,69 @@ ZEND_END_ARG_INFO()
 
 #define arginfo_memprof_disable arginfo_memprof_enabled
 
+#define arginfo_memprof_pause arginfo_memprof_enabled
+
+#define arginfo_memprof_resume arginfo_memprof_enabled
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_memprof_scope_push, 0, 0, 1)
+	ZEND_ARG_INFO(0, label)
+ZEND_END_ARG_INFO()
+
+#define arginfo_memprof_scope_pop arginfo_memprof_enabled
+
 #define arginfo_memprof_dump_array arginfo_memprof_enabled
 
+#define arginfo_memprof_dump_flat arginfo_memprof_enabled
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_memprof_top, 0, 0, 1)
+	ZEND_ARG_INFO(0, n)
+	ZEND_ARG_INFO(0, by)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_memprof_dump_callgrind, 0, 0, 1)
 	ZEND_ARG_INFO(0, handle)
 ZEND_END_ARG_INFO()
 
-#define arginfo_memprof_dump_pprof arginfo_memprof_dump_callgrind
+ZEND_BEGIN_ARG_INFO_EX(arginfo_memprof_dump_pprof, 0, 0, 1)
+	ZEND_ARG_INFO(0, handle)
+	ZEND_ARG_INFO(0, peaks)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_memprof_dump_folded, 0, 0, 1)
+	ZEND_ARG_INFO(0, handle)
+	ZEND_ARG_INFO(0, with_blocks)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_memprof_dump_aggregate, 0, 0, 1)
+	ZEND_ARG_INFO(0, handle)
+	ZEND_ARG_INFO(0, format)
+ZEND_END_ARG_INFO()
+
+#define arginfo_memprof_dump_snapshot arginfo_memprof_dump_callgrind
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_memprof_convert_snapshots, 0, 0, 2)
+	ZEND_ARG_INFO(0, paths)
+	ZEND_ARG_INFO(0, handle)
+	ZEND_ARG_INFO(0, format)
+ZEND_END_ARG_INFO()
+
+#define arginfo_memprof_dump_delta arginfo_memprof_dump_callgrind
+
+#define arginfo_memprof_dump_free_sites arginfo_memprof_dump_aggregate
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_memprof_census, 0, 0, 0)
+	ZEND_ARG_INFO(0, deep)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_memprof_dump_census, 0, 0, 1)
+	ZEND_ARG_INFO(0, handle)
+	ZEND_ARG_INFO(0, deep)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_memprof_retainers, 0, 0, 0)
+	ZEND_ARG_INFO(0, n)
+	ZEND_ARG_INFO(1, truncated)
+ZEND_END_ARG_INFO()
 
 #define arginfo_memprof_version arginfo_memprof_enabled
 
@@ -25,9 +81,24 @@ ZEND_FUNCTION(memprof_enabled);
 ZEND_FUNCTION(memprof_enabled_flags);
 ZEND_FUNCTION(memprof_enable);
 ZEND_FUNCTION(memprof_disable);
+ZEND_FUNCTION(memprof_pause);
+ZEND_FUNCTION(memprof_resume);
+ZEND_FUNCTION(memprof_scope_push);
+ZEND_FUNCTION(memprof_scope_pop);
 ZEND_FUNCTION(memprof_dump_array);
+ZEND_FUNCTION(memprof_dump_flat);
+ZEND_FUNCTION(memprof_top);
 ZEND_FUNCTION(memprof_dump_callgrind);
 ZEND_FUNCTION(memprof_dump_pprof);
+ZEND_FUNCTION(memprof_dump_folded);
+ZEND_FUNCTION(memprof_dump_aggregate);
+ZEND_FUNCTION(memprof_dump_snapshot);
+ZEND_FUNCTION(memprof_convert_snapshots);
+ZEND_FUNCTION(memprof_dump_delta);
+ZEND_FUNCTION(memprof_dump_free_sites);
+ZEND_FUNCTION(memprof_census);
+ZEND_FUNCTION(memprof_dump_census);
+ZEND_FUNCTION(memprof_retainers);
 ZEND_FUNCTION(memprof_version);
 
 
@@ -36,9 +107,24 @@ static const zend_function_entry ext_functions[] = {
 	ZEND_FE(memprof_enabled_flags, arginfo_memprof_enabled_flags)
 	ZEND_FE(memprof_enable, arginfo_memprof_enable)
 	ZEND_FE(memprof_disable, arginfo_memprof_disable)
+	ZEND_FE(memprof_pause, arginfo_memprof_pause)
+	ZEND_FE(memprof_resume, arginfo_memprof_resume)
+	ZEND_FE(memprof_scope_push, arginfo_memprof_scope_push)
+	ZEND_FE(memprof_scope_pop, arginfo_memprof_scope_pop)
 	ZEND_FE(memprof_dump_array, arginfo_memprof_dump_array)
+	ZEND_FE(memprof_dump_flat, arginfo_memprof_dump_flat)
+	ZEND_FE(memprof_top, arginfo_memprof_top)
 	ZEND_FE(memprof_dump_callgrind, arginfo_memprof_dump_callgrind)
 	ZEND_FE(memprof_dump_pprof, arginfo_memprof_dump_pprof)
+	ZEND_FE(memprof_dump_folded, arginfo_memprof_dump_folded)
+	ZEND_FE(memprof_dump_aggregate, arginfo_memprof_dump_aggregate)
+	ZEND_FE(memprof_dump_snapshot, arginfo_memprof_dump_snapshot)
+	ZEND_FE(memprof_convert_snapshots, arginfo_memprof_convert_snapshots)
+	ZEND_FE(memprof_dump_delta, arginfo_memprof_dump_delta)
+	ZEND_FE(memprof_dump_free_sites, arginfo_memprof_dump_free_sites)
+	ZEND_FE(memprof_census, arginfo_memprof_census)
+	ZEND_FE(memprof_dump_census, arginfo_memprof_dump_census)
+	ZEND_FE(memprof_retainers, arginfo_memprof_retainers)
 	ZEND_FE(memprof_version, arginfo_memprof_version)
 	ZEND_FE_END
 };
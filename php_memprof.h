@@ -40,18 +40,62 @@ extern zend_module_entry memprof_module_entry;
 typedef enum {
 	FORMAT_CALLGRIND = 0,
 	FORMAT_PPROF = 1,
+	FORMAT_FOLDED = 2,
+	FORMAT_SNAPSHOT = 3,
 } memprof_output_format;
 
+typedef enum {
+	COMPRESSION_NONE = 0,
+	COMPRESSION_GZIP = 1,
+	COMPRESSION_ZSTD = 2,
+} memprof_compression;
+
+#define MEMPROF_MAX_DUMP_THRESHOLDS 16
+
+typedef struct _memprof_dump_threshold {
+	size_t value;
+	zend_bool percent;
+} memprof_dump_threshold;
+
 typedef struct _memprof_profile_flags {
 	zend_bool enabled;
 	zend_bool native;
 	zend_bool dump_on_limit;
+	zend_bool trace;
 } memprof_profile_flags;
 
 ZEND_BEGIN_MODULE_GLOBALS(memprof)
 	const char * output_dir;
 	memprof_output_format output_format;
+	memprof_compression output_compression;
 	memprof_profile_flags profile_flags;
+	memprof_dump_threshold dump_thresholds[MEMPROF_MAX_DUMP_THRESHOLDS];
+	size_t dump_thresholds_count;
+	zend_long dump_min_interval;
+	double cgroup_dump_ratio;
+	const char * cgroup_dir;
+	zend_long cgroup_check_interval;
+	zend_long cgroup_dump_top;
+	zend_bool aggregate;
+	zend_long aggregate_nodes;
+	const char * passthrough_functions;
+	const char * collapse_namespaces;
+	zend_long fold_recursion;
+	zend_long max_frames;
+	zend_long min_tracked_size;
+	zend_bool realloc_growth;
+	zend_bool free_sites;
+	zend_long alloc_batch;
+	zend_long delta_interval;
+	zend_long retainers_max_nodes;
+#if MEMPROF_DEBUG
+	zend_bool debug_failing_allocator;
+#endif
+	double request_sample_rate;
+	const char * request_sample_filter;
+	zend_bool request_sample_dump;
+	zend_bool request_sampled;
+	uint64_t sample_state;
 ZEND_END_MODULE_GLOBALS(memprof)
 
 #define MEMPROF_G(v) ZEND_MODULE_GLOBALS_ACCESSOR(memprof, v)
@@ -65,11 +109,26 @@ PHP_GINIT_FUNCTION(memprof);
 
 PHP_FUNCTION(memprof_dump_callgrind);
 PHP_FUNCTION(memprof_dump_pprof);
+PHP_FUNCTION(memprof_dump_folded);
+PHP_FUNCTION(memprof_dump_aggregate);
+PHP_FUNCTION(memprof_dump_snapshot);
+PHP_FUNCTION(memprof_convert_snapshots);
+PHP_FUNCTION(memprof_dump_delta);
+PHP_FUNCTION(memprof_dump_free_sites);
+PHP_FUNCTION(memprof_census);
+PHP_FUNCTION(memprof_dump_census);
+PHP_FUNCTION(memprof_retainers);
 PHP_FUNCTION(memprof_dump_array);
+PHP_FUNCTION(memprof_dump_flat);
+PHP_FUNCTION(memprof_top);
 PHP_FUNCTION(memprof_memory_get_usage);
 PHP_FUNCTION(memprof_memory_get_peak_usage);
 PHP_FUNCTION(memprof_enable);
 PHP_FUNCTION(memprof_disable);
+PHP_FUNCTION(memprof_pause);
+PHP_FUNCTION(memprof_resume);
+PHP_FUNCTION(memprof_scope_push);
+PHP_FUNCTION(memprof_scope_pop);
 PHP_FUNCTION(memprof_enabled);
 PHP_FUNCTION(memprof_enabled_flags);
 
@@ -0,0 +1,119 @@
+/*
+  +----------------------------------------------------------------------+
+  | Memprof                                                              |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2012-2013 Arnaud Le Blanc                              |
+  +----------------------------------------------------------------------+
+  | Redistribution and use in source and binary forms, with or without   |
+  | modification, are permitted provided that the conditions mentioned   |
+  | in the accompanying LICENSE file are met.                            |
+  +----------------------------------------------------------------------+
+  | Author: Arnaud Le Blanc <arnaud.lb@gmail.com>                        |
+  +----------------------------------------------------------------------+
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php.h"
+#include "snapshot.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Checks that all offsets and indexes of a mapped snapshot are in bounds */
+static zend_bool snapshot_valid(const memprof_snapshot * s, size_t size)
+{
+	const snapshot_header * h = s->header;
+	uint64_t expected;
+	uint32_t i;
+
+	if (h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION || h->frames_count == 0) {
+		return 0;
+	}
+
+	expected = sizeof(*h)
+		+ (uint64_t) h->frames_count * sizeof(snapshot_frame)
+		+ (uint64_t) h->names_count * sizeof(snapshot_name)
+		+ h->names_size;
+
+	if (expected != size) {
+		return 0;
+	}
+
+	for (i = 0; i < h->names_count; i++) {
+		const snapshot_name * n = &s->names[i];
+		if ((uint64_t) n->off + n->len >= h->names_size || s->strings[n->off + n->len] != '\0') {
+			return 0;
+		}
+	}
+
+	if (s->frames[0].parent != SNAPSHOT_NONE) {
+		return 0;
+	}
+
+	for (i = 0; i < h->frames_count; i++) {
+		const snapshot_frame * f = &s->frames[i];
+		if ((i > 0 && f->parent >= i) || f->name >= h->names_count) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Maps the snapshot at path. Returns NULL if it can't be read or is not a
+ * valid snapshot. */
+memprof_snapshot * snapshot_open(const char * path)
+{
+	memprof_snapshot * s;
+	struct stat st;
+	void * map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(snapshot_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	s = malloc(sizeof(*s));
+	if (s == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	s->header = (const snapshot_header *) map;
+	s->frames = (const snapshot_frame *) (s->header + 1);
+	s->names = (const snapshot_name *) (s->frames + s->header->frames_count);
+	s->strings = (const char *) (s->names + s->header->names_count);
+	s->map_size = st.st_size;
+
+	if (!snapshot_valid(s, st.st_size)) {
+		snapshot_close(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+void snapshot_close(memprof_snapshot * s)
+{
+	munmap((void *) s->header, s->map_size);
+	free(s);
+}
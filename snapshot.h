@@ -0,0 +1,71 @@
+/*
+  +----------------------------------------------------------------------+
+  | Memprof                                                              |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2012-2013 Arnaud Le Blanc                              |
+  +----------------------------------------------------------------------+
+  | Redistribution and use in source and binary forms, with or without   |
+  | modification, are permitted provided that the conditions mentioned   |
+  | in the accompanying LICENSE file are met.                            |
+  +----------------------------------------------------------------------+
+  | Author: Arnaud Le Blanc <arnaud.lb@gmail.com>                        |
+  +----------------------------------------------------------------------+
+*/
+
+
+#ifndef MEMPROF_SNAPSHOT_H
+#define MEMPROF_SNAPSHOT_H
+
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC 0x4e53504d /* "MPSN" */
+#define SNAPSHOT_VERSION 1
+
+/* Parent of the root frame */
+#define SNAPSHOT_NONE ((uint32_t) -1)
+
+/* A snapshot is a raw copy of the call tree, in native byte order:
+ *
+ *   snapshot_header
+ *   snapshot_frame[frames_count]	parents come before their children
+ *   snapshot_name[names_count]
+ *   char[names_size]				NUL terminated names
+ *
+ * It's written in a few sequential writes by the profiled process, and can
+ * be mapped as is by readers. */
+typedef struct _snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t frames_count;
+	uint32_t names_count;
+	uint64_t names_size;
+	uint64_t reserved;
+} snapshot_header;
+
+typedef struct _snapshot_frame {
+	uint32_t parent;		/* index of the parent, SNAPSHOT_NONE for the root */
+	uint32_t name;			/* index of the name */
+	uint64_t calls;
+	uint64_t self_size;
+	uint64_t self_count;
+	uint64_t peak_self_size;
+	uint64_t peak_size;
+} snapshot_frame;
+
+typedef struct _snapshot_name {
+	uint32_t off;
+	uint32_t len;
+} snapshot_name;
+
+typedef struct _memprof_snapshot {
+	const snapshot_header * header;
+	const snapshot_frame * frames;
+	const snapshot_name * names;
+	const char * strings;
+	size_t map_size;
+} memprof_snapshot;
+
+memprof_snapshot * snapshot_open(const char * path);
+void snapshot_close(memprof_snapshot * snapshot);
+
+#endif /* MEMPROF_SNAPSHOT_H */
@@ -17,19 +17,19 @@ Warning: Calling memprof_enable() manually may not work as expected because of P
 version: 1
 cmd: unknown
 positions: line
-events: MemorySize BlocksCount
+events: MemorySize BlocksCount PeakMemorySize
 
 fl=/todo.php
 fn=Eater::eat
-1 8388640 1
+1 8388640 1 %d
 
 fl=/todo.php
 fn=root
-1 3145760 1
+1 3145760 1 %d
 cfl=/todo.php
 cfn=Eater::eat
 calls=1 1
-1 8388640 1
+1 8388640 1 %d
 
-total: 11534400 2
+total: 11534400 2 %d
 
@@ -9,11 +9,13 @@ var_dump(memprof_enabled_flags());
 memprof_dump_array();
 --EXPECT--
 bool(true)
-array(3) {
+array(4) {
   ["enabled"]=>
   bool(true)
   ["native"]=>
   bool(false)
   ["dump_on_limit"]=>
   bool(false)
+  ["trace"]=>
+  bool(false)
 }
@@ -10,11 +10,13 @@ var_dump(memprof_enabled());
 var_dump(memprof_enabled_flags());
 --EXPECT--
 bool(true)
-array(3) {
+array(4) {
   ["enabled"]=>
   bool(true)
   ["native"]=>
   bool(true)
   ["dump_on_limit"]=>
   bool(false)
+  ["trace"]=>
+  bool(false)
 }
@@ -0,0 +1,67 @@
+--TEST--
+memprof.alloc_batch
+--ENV--
+MEMPROF_PROFILE=1
+--INI--
+memprof.alloc_batch=16
+--FILE--
+<?php
+
+require __DIR__ . '/common.php';
+
+function totals($frame, &$size, &$count) {
+    $size += $frame['memory_size'];
+    $count += $frame['blocks_count'];
+    foreach ($frame['called_functions'] as $child) {
+        totals($child, $size, $count);
+    }
+}
+
+function churn() {
+    for ($i = 0; $i < 10000; $i++) {
+        $tmp = str_repeat('x', 100 + $i % 100);
+    }
+}
+
+function keep() {
+    $kept = [];
+    for ($i = 0; $i < 1000; $i++) {
+        $kept[] = str_repeat('x', 1000);
+    }
+    return $kept;
+}
+
+churn();
+$kept = keep();
+
+memprof_scope_push('batch');
+$a = eat();
+churn();
+memprof_scope_pop();
+
+$dump = memprof_dump_array();
+
+$size = 0;
+$count = 0;
+totals($dump['called_functions']['keep'], $size, $count);
+var_dump($size >= 1000 * 1000, $count >= 1000);
+
+$size = 0;
+$count = 0;
+totals($dump['called_functions']['churn'], $size, $count);
+var_dump($count < 10);
+
+printf("batch: %dMB\n", round($dump['labels']['batch']['memory_size'] / (1024 * 1024)));
+
+unset($kept, $a);
+
+$size = 0;
+$count = 0;
+totals(memprof_dump_array(), $size, $count);
+var_dump($size < 1024 * 1024);
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+batch: 3MB
+bool(true)
@@ -0,0 +1,46 @@
+--TEST--
+autodump: error_get_last() after memprof_disable()
+--ENV--
+MEMPROF_PROFILE=dump_on_limit
+--FILE--
+<?php
+
+$dir = sys_get_temp_dir() . '/' . microtime(true);
+var_dump(mkdir($dir));
+
+$buf = str_repeat("a", 5<<20);
+
+register_shutdown_function(function () use (&$buf, $dir) {
+    $buf = "";
+    // The error message was formatted in memory that memprof_disable()
+    // releases
+    var_dump(memprof_disable());
+    $churn = [];
+    for ($i = 0; $i < 1000; $i++) {
+        $churn[] = str_repeat("b", 200);
+    }
+    $error = error_get_last();
+    var_dump($error['message']);
+    foreach (glob("$dir/memprof.callgrind.*") as $file) {
+        unlink($file);
+    }
+    rmdir($dir);
+});
+
+ini_set("memprof.output_dir", $dir);
+ini_set("memory_limit", 15<<20);
+
+function f() {
+    $a = [];
+    for (;;) {
+        $a[] = str_repeat("a", 1<<20);
+    }
+}
+
+f();
+--EXPECTF--
+bool(true)
+
+Fatal error: Allowed memory size of 15728640 bytes exhausted%S (tried to allocate %d bytes) (memprof dumped to %smemprof.callgrind%s) in %s on line%a
+bool(true)
+string(%d) "Allowed memory size of 15728640 bytes exhausted%S (tried to allocate %d bytes) (memprof dumped to %smemprof.callgrind%s)"
@@ -31,13 +31,15 @@ f();
 --EXPECTF--
 string(%d) "/%s"
 bool(true)
-array(3) {
+array(4) {
   ["enabled"]=>
   bool(true)
   ["native"]=>
   bool(false)
   ["dump_on_limit"]=>
   bool(false)
+  ["trace"]=>
+  bool(false)
 }
 
 Fatal error: Allowed memory size of 15728640 bytes exhausted%S (tried to allocate %d bytes) in %s on line%a
@@ -21,13 +21,15 @@ function f() {
 
 f();
 --EXPECTF--
-array(3) {
+array(4) {
   ["enabled"]=>
   bool(true)
   ["native"]=>
   bool(false)
   ["dump_on_limit"]=>
   bool(true)
+  ["trace"]=>
+  bool(false)
 }
 
 Fatal error: Allowed memory size of 15728640 bytes exhausted%S (tried to allocate %d bytes) (memprof failed dumping to %smemprof.callgrind%s, please check file permissions or disk capacity) in %s on line%a
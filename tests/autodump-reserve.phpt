@@ -0,0 +1,50 @@
+--TEST--
+autodump doesn't allocate
+--SKIPIF--
+<?php if (ini_get('memprof.debug_failing_allocator') === false) die("skip debug builds only");
+--ENV--
+MEMPROF_PROFILE=dump_on_limit
+--INI--
+memprof.debug_failing_allocator=1
+--FILE--
+<?php
+
+// Any use of the heap during the dump aborts the process
+
+$dir = sys_get_temp_dir() . '/' . microtime(true);
+var_dump(mkdir($dir));
+
+$buf = str_repeat("a", 5<<20);
+
+register_shutdown_function(function () use (&$buf, $dir) {
+    $buf = "";
+    $files = glob("$dir/memprof.callgrind.*");
+    var_dump(count($files));
+    $dump = file_get_contents($files[0]);
+    var_dump(strpos($dump, "version: 1\n") === 0);
+    var_dump(strpos($dump, "fn=f\n") !== false);
+    var_dump(preg_match('/^total: \d+ \d+ \d+$/m', $dump));
+    unlink($files[0]);
+    rmdir($dir);
+});
+
+ini_set("memprof.output_dir", $dir);
+ini_set("memory_limit", 15<<20);
+
+function f() {
+    $a = [];
+    memprof_scope_push("loop");
+    for (;;) {
+        $a[] = str_repeat("a", 1<<20);
+    }
+}
+
+f();
+--EXPECTF--
+bool(true)
+
+Fatal error: Allowed memory size of 15728640 bytes exhausted%S (tried to allocate %d bytes) (memprof dumped to %smemprof.callgrind%s) in %s on line%a
+int(1)
+bool(true)
+bool(true)
+int(1)
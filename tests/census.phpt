@@ -0,0 +1,61 @@
+--TEST--
+memprof_census()
+--FILE--
+<?php
+
+class Small {
+    public $a = 1;
+}
+
+class Big {
+    public $data;
+    public function __construct() {
+        $this->data = str_repeat('x', 1 << 20);
+    }
+}
+
+$objects = [];
+for ($i = 0; $i < 100; $i++) {
+    $objects[] = new Small;
+}
+$objects[] = new Big;
+$objects[] = new Big;
+$objects[] = $objects[0];
+
+$census = memprof_census();
+var_dump($census['Small']['objects_count']);
+var_dump($census['Big']['objects_count']);
+var_dump($census['Small']['memory_size'] > $census['Big']['memory_size']);
+
+$deep = memprof_census(true);
+var_dump($deep['Big']['memory_size'] > 2 << 20);
+var_dump($deep['Small']['memory_size'] === $census['Small']['memory_size']);
+var_dump(key($deep));
+
+// Strings shared by several objects are counted once
+$objects[] = clone $objects[101];
+$shared = memprof_census(true);
+var_dump($shared['Big']['objects_count']);
+var_dump($shared['Big']['memory_size'] < 3 << 20);
+
+$fd = fopen('php://memory', 'w+');
+memprof_dump_census($fd, true);
+rewind($fd);
+$lines = explode("\n", stream_get_contents($fd));
+var_dump($lines[0]);
+var_dump(strpos($lines[1], '"Big",3,') === 0);
+
+unset($objects);
+var_dump(isset(memprof_census()['Small']));
+--EXPECT--
+int(100)
+int(2)
+bool(true)
+bool(true)
+bool(true)
+string(3) "Big"
+int(3)
+bool(true)
+string(31) "class,objects_count,memory_size"
+bool(true)
+bool(false)
@@ -0,0 +1,76 @@
+--TEST--
+cgroup memory pressure dumps
+--SKIPIF--
+<?php PHP_OS === 'Linux' || die("skip Linux only");
+--ENV--
+MEMPROF_PROFILE=1
+--INI--
+memprof.dump_min_interval=0
+memprof.cgroup_check_interval=0
+--FILE--
+<?php
+
+$dir = sys_get_temp_dir() . '/' . microtime(true);
+var_dump(mkdir($dir));
+
+$cgroup = $dir . '/cgroup';
+var_dump(mkdir($cgroup));
+
+function events($max, $oom) {
+    return "low 0\nhigh 0\nmax $max\noom $oom\noom_kill $oom\n";
+}
+
+file_put_contents("$cgroup/memory.current", "100\n");
+file_put_contents("$cgroup/memory.max", "1000\n");
+file_put_contents("$cgroup/memory.events", events(0, 0));
+file_put_contents("$cgroup/cgroup.procs", getmypid() . "\n");
+
+ini_set("memprof.output_dir", $dir);
+ini_set("memprof.cgroup_dir", $cgroup);
+ini_set("memprof.cgroup_dump_ratio", "0.9");
+
+function check($dir) {
+    $a = str_repeat("a", 2<<20);
+    // Checks happen on the next VM interruption
+    for ($i = 0; $i < 2; $i++) {
+    }
+    return count(preg_grep('/^memprof\.callgrind\./', scandir($dir)));
+}
+
+echo "Below ratio\n";
+var_dump(check($dir));
+
+echo "Above ratio\n";
+file_put_contents("$cgroup/memory.current", "950\n");
+var_dump(check($dir));
+
+echo "No limit\n";
+file_put_contents("$cgroup/memory.max", "max\n");
+var_dump(check($dir));
+
+echo "OOM event\n";
+file_put_contents("$cgroup/memory.events", events(0, 1));
+var_dump(check($dir));
+
+echo "No new event\n";
+var_dump(check($dir));
+
+echo "Not among the largest processes\n";
+ini_set("memprof.cgroup_dump_top", "0");
+file_put_contents("$cgroup/memory.events", events(1, 1));
+var_dump(check($dir));
+--EXPECT--
+bool(true)
+bool(true)
+Below ratio
+int(0)
+Above ratio
+int(1)
+No limit
+int(1)
+OOM event
+int(2)
+No new event
+int(2)
+Not among the largest processes
+int(2)
@@ -0,0 +1,38 @@
+--TEST--
+memprof.delta_interval
+--ENV--
+MEMPROF_PROFILE=1
+--INI--
+memprof.delta_interval=1
+--FILE--
+<?php
+
+$dir = sys_get_temp_dir() . '/memprof-delta-' . getmypid();
+@mkdir($dir);
+ini_set('memprof.output_dir', $dir);
+
+function f() {
+    return str_repeat('x', 100);
+}
+
+$a = [];
+for ($i = 0; $i < 10000; $i++) {
+    $a[] = f();
+    if ($i % 1000 === 0) {
+        usleep(2000);
+    }
+}
+
+$files = glob("$dir/memprof.timeline.*");
+var_dump(count($files));
+
+$lines = file($files[0], FILE_IGNORE_NEW_LINES);
+var_dump($lines[0]);
+var_dump(count(preg_grep('/^delta /', $lines)) > 1);
+
+unlink($files[0]);
+rmdir($dir);
+--EXPECT--
+int(1)
+string(18) "memprof timeline 1"
+bool(true)
@@ -0,0 +1,77 @@
+--TEST--
+memprof_dump_delta()
+--ENV--
+MEMPROF_PROFILE=1
+--FILE--
+<?php
+
+require __DIR__ . '/common.php';
+
+$path = tempnam(sys_get_temp_dir(), 'memprof');
+$fd = fopen($path, 'a');
+
+memprof_dump_delta($fd);
+$a = eat();
+memprof_dump_delta($fd);
+memprof_dump_delta($fd);
+unset($a);
+memprof_dump_delta($fd);
+
+fclose($fd);
+
+$lines = file($path, FILE_IGNORE_NEW_LINES);
+unlink($path);
+
+var_dump(array_shift($lines));
+
+$deltas = [];
+$names = [];
+foreach ($lines as $line) {
+    $fields = explode(' ', $line, 9);
+    if ($fields[0] === 'delta') {
+        $deltas[] = [];
+        continue;
+    }
+    if ($fields[0] === 'f') {
+        $names[$fields[1]] = $fields[8];
+    }
+    $deltas[count($deltas)-1][] = [
+        'type' => $fields[0],
+        'name' => $names[$fields[1]],
+        'self_size' => (int) $fields[$fields[0] === 'f' ? 4 : 3],
+    ];
+}
+
+function records($delta, $name) {
+    return array_values(array_filter($delta, function ($r) use ($name) {
+        return $r['name'] === $name;
+    }));
+}
+
+var_dump(count($deltas));
+
+// The first delta is the whole tree
+var_dump(records($deltas[0], 'root')[0]['type']);
+
+// New frames are declared
+$r = records($deltas[1], 'str_repeat');
+var_dump($r[0]['type'], $r[0]['self_size'] >= 3 * 1024 * 1024);
+var_dump(records($deltas[1], 'eat')[0]['type']);
+
+// Unchanged frames are not written again
+var_dump(count(records($deltas[2], 'str_repeat')), count(records($deltas[2], 'eat')));
+
+// Changed frames are updated
+$r = records($deltas[3], 'str_repeat');
+var_dump($r[0]['type'], $r[0]['self_size']);
+--EXPECT--
+string(18) "memprof timeline 1"
+int(4)
+string(1) "f"
+string(1) "f"
+bool(true)
+string(1) "f"
+int(0)
+int(0)
+string(1) "u"
+int(0)
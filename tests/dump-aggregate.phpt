@@ -0,0 +1,33 @@
+--TEST--
+memprof_dump_aggregate()
+--FILE--
+<?php
+
+$dir = sys_get_temp_dir() . '/memprof-aggregate-' . getmypid();
+@mkdir($dir);
+ini_set('memprof.output_dir', $dir);
+
+function dump($format) {
+    $fd = fopen('php://memory', 'w+');
+    memprof_dump_aggregate($fd, $format);
+    rewind($fd);
+    return stream_get_contents($fd);
+}
+
+var_dump(dump('folded'));
+var_dump(file_exists("$dir/memprof.aggregate"));
+var_dump(strpos(dump('callgrind'), "fn=root\n") !== false);
+
+try {
+    dump('lzma');
+} catch (Exception $e) {
+    echo $e->getMessage(), "\n";
+}
+
+unlink("$dir/memprof.aggregate");
+rmdir($dir);
+--EXPECT--
+string(0) ""
+bool(true)
+bool(true)
+memprof_dump_aggregate(): unknown format, expected one of callgrind, pprof, folded, snapshot
@@ -0,0 +1,35 @@
+--TEST--
+memprof.output_compression
+--SKIPIF--
+<?php
+if (!extension_loaded('zlib')) die("skip zlib extension required to read the output");
+if (!ini_set('memprof.output_compression', 'gzip')) die("skip memprof built without zlib");
+--ENV--
+MEMPROF_PROFILE=1
+--INI--
+memprof.output_compression=gzip
+--FILE--
+<?php
+
+require __DIR__ . '/common.php';
+
+$a = eat();
+
+var_dump(ini_set('memprof.output_compression', 'lzma'));
+
+$file = tempnam(sys_get_temp_dir(), 'memprof');
+
+memprof_dump_callgrind(fopen($file, 'w'));
+
+var_dump(bin2hex(file_get_contents($file, false, null, 0, 2)));
+$content = file_get_contents("compress.zlib://$file");
+var_dump(substr($content, 0, 11));
+var_dump(strpos($content, "fn=eat\n") !== false);
+
+unlink($file);
+--EXPECT--
+bool(false)
+string(4) "1f8b"
+string(11) "version: 1
+"
+bool(true)
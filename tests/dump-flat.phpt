@@ -0,0 +1,81 @@
+--TEST--
+memprof_dump_flat()
+--ENV--
+MEMPROF_PROFILE=1
+--FILE--
+<?php
+
+require __DIR__ . '/common.php';
+
+function path($dump, $i) {
+    $path = [];
+    for (; $i !== -1; $i = $dump['parent'][$i]) {
+        $path[] = $dump['names'][$dump['name'][$i]];
+    }
+    return implode(';', array_reverse($path));
+}
+
+$a = eat();
+$b = Eater::eat();
+
+$dump = memprof_dump_flat();
+
+var_dump(array_keys($dump));
+
+$n = count($dump['parent']);
+foreach (['name', 'memory_size', 'blocks_count', 'calls'] as $key) {
+    var_dump(count($dump[$key]) === $n);
+}
+
+var_dump($dump['parent'][0]);
+var_dump($dump['names'][$dump['name'][0]]);
+var_dump(count($dump['names']) === count(array_unique($dump['names'])));
+
+// Same costs as memprof_dump_array()
+function flatten($frame, $path, &$out) {
+    $out[$path] = [$frame['memory_size'], $frame['blocks_count'], $frame['calls']];
+    foreach ($frame['called_functions'] as $fn => $child) {
+        flatten($child, "$path;$fn", $out);
+    }
+}
+
+$flat = [];
+for ($i = 0; $i < $n; $i++) {
+    $flat[path($dump, $i)] = [$dump['memory_size'][$i], $dump['blocks_count'][$i], $dump['calls'][$i]];
+}
+
+$nested = [];
+flatten(memprof_dump_array(), 'root', $nested);
+
+$eat = null;
+foreach ($flat as $path => $costs) {
+    if (preg_match('/;Eater::eat$/', $path)) {
+        $eat = $costs;
+        var_dump($nested[$path] === $costs);
+    }
+}
+var_dump($eat[0] >= 8 * 1024 * 1024);
+--EXPECT--
+array(6) {
+  [0]=>
+  string(5) "names"
+  [1]=>
+  string(6) "parent"
+  [2]=>
+  string(4) "name"
+  [3]=>
+  string(11) "memory_size"
+  [4]=>
+  string(12) "blocks_count"
+  [5]=>
+  string(5) "calls"
+}
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+int(-1)
+string(4) "root"
+bool(true)
+bool(true)
+bool(true)
@@ -0,0 +1,36 @@
+--TEST--
+memprof_dump_folded()
+--ENV--
+MEMPROF_PROFILE=1
+--FILE--
+<?php
+
+require __DIR__ . '/common.php';
+
+$a = eat();
+$b = Eater::eat();
+
+function dump($withBlocks) {
+    $fd = fopen('php://memory', 'w+');
+    memprof_dump_folded($fd, $withBlocks);
+    rewind($fd);
+    return explode("\n", rtrim(stream_get_contents($fd), "\n"));
+}
+
+foreach (dump(false) as $line) {
+    if (!preg_match('/^root(;[^;]+)* \d+$/', $line)) {
+        echo "Unexpected line: $line\n";
+    }
+    if (preg_match('/^(.*;(?:str_repeat|Eater::eat)) (\d+)$/', $line, $m)) {
+        echo preg_replace('/require [^;]*/', 'require', $m[1]), " ", $m[2] >= 3<<20 ? "large" : "small", "\n";
+    }
+}
+
+foreach (dump(true) as $line) {
+    if (!preg_match('/^root(;[^;]+)* \d+ \d+$/', $line)) {
+        echo "Unexpected line: $line\n";
+    }
+}
+--EXPECT--
+root;require;eat;str_repeat large
+root;require;Eater::eat large
@@ -0,0 +1,48 @@
+--TEST--
+dump_thresholds
+--ENV--
+MEMPROF_PROFILE=1
+--INI--
+memory_limit=40M
+memprof.dump_thresholds=8M,50%
+memprof.dump_min_interval=0
+--FILE--
+<?php
+
+$dir = sys_get_temp_dir() . '/' . microtime(true);
+var_dump(mkdir($dir));
+
+ini_set("memprof.output_dir", $dir);
+
+var_dump(ini_set("memprof.dump_thresholds", "foo"));
+var_dump(ini_set("memprof.dump_thresholds", "150%"));
+
+function check($dir) {
+    // Threshold dumps happen on the next VM interruption
+    for ($i = 0; $i < 2; $i++) {
+    }
+    return count(scandir($dir)) - 2;
+}
+
+$a = str_repeat("a", 2<<20);
+var_dump(check($dir));
+
+$b = str_repeat("b", 8<<20);
+var_dump(check($dir));
+
+$c = str_repeat("c", 2<<20);
+var_dump(check($dir));
+
+$d = str_repeat("d", 10<<20);
+var_dump(check($dir));
+
+var_dump(count(preg_grep('/^memprof\.callgrind\./', scandir($dir))));
+--EXPECT--
+bool(true)
+bool(false)
+bool(false)
+int(0)
+int(1)
+int(1)
+int(2)
+int(2)
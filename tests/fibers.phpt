@@ -0,0 +1,66 @@
+--TEST--
+Fibers
+--SKIPIF--
+<?php PHP_VERSION_ID >= 80100 || die("skip Fibers require PHP 8.1");
+--ENV--
+MEMPROF_PROFILE=1
+--FILE--
+<?php
+
+function work() {
+    $x = str_repeat('x', 2 * 1024 * 1024);
+    Fiber::suspend();
+    $y = str_repeat('y', 2 * 1024 * 1024);
+    Fiber::suspend();
+    return [$x, $y];
+}
+
+function starter($fiber) {
+    $fiber->start();
+}
+
+function resumer($fiber) {
+    $fiber->resume();
+}
+
+$fiber = new Fiber('work');
+starter($fiber);
+$a = str_repeat('a', 1024 * 1024);
+resumer($fiber);
+$b = str_repeat('b', 1024 * 1024);
+resumer($fiber);
+$result = $fiber->getReturn();
+
+$fd = fopen('php://memory', 'w+');
+memprof_dump_folded($fd);
+rewind($fd);
+foreach (explode("\n", rtrim(stream_get_contents($fd), "\n")) as $line) {
+    list($path, $size) = explode(' ', $line);
+    if ($size >= 1024 * 1024) {
+        printf("%s %dMB\n", $path, round($size / (1024 * 1024)));
+    }
+}
+
+$fd = fopen('php://memory', 'w+');
+memprof_dump_callgrind($fd);
+rewind($fd);
+$fn = null;
+$cfn = null;
+$peaks = [];
+foreach (explode("\n", stream_get_contents($fd)) as $line) {
+    if (preg_match('/^fn=(.*)/', $line, $m)) {
+        $fn = $m[1];
+        $cfn = null;
+    } else if (preg_match('/^cfn=(.*)/', $line, $m)) {
+        $cfn = $m[1];
+    } else if (preg_match('/^1 \d+ \d+ (\d+)$/', $line, $m) && $fn === 'Fiber::start' && $cfn === 'work') {
+        $peaks[] = (int) $m[1];
+    }
+}
+
+// work() held both strings, across suspensions
+var_dump(max($peaks) >= 4 * 1024 * 1024);
+--EXPECT--
+root;starter;Fiber::start;work;str_repeat 4MB
+root;str_repeat 2MB
+bool(true)
@@ -0,0 +1,51 @@
+--TEST--
+memprof.fold_recursion
+--ENV--
+MEMPROF_PROFILE=1
+--INI--
+memprof.fold_recursion=1
+--FILE--
+<?php
+
+function rec($n) {
+    if ($n > 0) {
+        return rec($n - 1);
+    }
+    return str_repeat('X', 1024 * 1024);
+}
+
+function depth($frame, $name) {
+    $max = 0;
+    foreach ($frame['called_functions'] as $fn => $child) {
+        $max = max($max, depth($child, $name) + ($fn === $name ? 1 : 0));
+    }
+    return $max;
+}
+
+function find($frame, $name) {
+    foreach ($frame['called_functions'] as $fn => $child) {
+        if ($fn === $name) {
+            return $child;
+        }
+        if ($found = find($child, $name)) {
+            return $found;
+        }
+    }
+    return null;
+}
+
+$a = rec(100);
+
+$dump = memprof_dump_array();
+var_dump(depth($dump, 'rec'));
+var_dump(find($dump, 'rec')['calls']);
+
+// Re-entries are folded once the function appears 3 times on the path
+ini_set('memprof.fold_recursion', 3);
+$b = rec(100);
+$dump = memprof_dump_array();
+var_dump(depth($dump, 'rec'));
+--EXPECT--
+int(1)
+int(101)
+int(3)
@@ -0,0 +1,40 @@
+--TEST--
+memprof.free_sites: blocks shrunk below memprof.min_tracked_size
+--ENV--
+MEMPROF_PROFILE=1
+--INI--
+memprof.free_sites=1
+memprof.min_tracked_size=65536
+--FILE--
+<?php
+
+function shrink($fd) {
+    // fread() allocates the requested length, and truncates the string to
+    // what was actually read
+    return fread($fd, 1 << 20);
+}
+
+$fd = fopen('php://memory', 'w+');
+fwrite($fd, 'short');
+rewind($fd);
+$s = shrink($fd);
+
+$out = fopen('php://memory', 'w+');
+memprof_dump_free_sites($out, 'csv');
+rewind($out);
+
+foreach (explode("\n", stream_get_contents($out)) as $line) {
+    $row = str_getcsv($line);
+    if (count($row) === 4 && preg_match('/;shrink;fread$/', $row[0])) {
+        var_dump(preg_match('/;shrink;fread$/', $row[1]));
+        var_dump($row[2] >= 1 << 20);
+        var_dump($row[3]);
+    }
+}
+
+var_dump($s);
+--EXPECT--
+int(1)
+bool(true)
+string(1) "1"
+string(5) "short"
@@ -0,0 +1,57 @@
+--TEST--
+memprof.free_sites
+--ENV--
+MEMPROF_PROFILE=1
+--INI--
+memprof.free_sites=1
+--FILE--
+<?php
+
+function build() {
+    return str_repeat('x', 1 << 20);
+}
+
+function evict(&$cache) {
+    $cache = null;
+}
+
+$cache = build();
+evict($cache);
+
+function dump($format) {
+    $fd = fopen('php://memory', 'w+');
+    memprof_dump_free_sites($fd, $format);
+    rewind($fd);
+    return stream_get_contents($fd);
+}
+
+$csv = dump('csv');
+$lines = explode("\n", $csv);
+var_dump($lines[0]);
+
+foreach ($lines as $line) {
+    $row = str_getcsv($line);
+    if (count($row) === 4 && preg_match('/;build;str_repeat$/', $row[0])) {
+        var_dump(preg_match('/;evict$/', $row[1]));
+        var_dump($row[2] >= 1 << 20);
+        var_dump($row[3]);
+    }
+}
+
+$callgrind = dump('callgrind');
+var_dump(strpos($callgrind, "events: FreedMemorySize FreedBlocksCount\n") !== false);
+var_dump(preg_match('/^fn=root;.*;build;str_repeat\n1 0 0\n(cfl=.*\ncfn=.*\ncalls=.*\n1 .*\n)*cfl=\/todo.php\ncfn=root;.*;evict\ncalls=1 1\n1 \d+ 1$/m', $callgrind));
+
+try {
+    dump('xml');
+} catch (Exception $e) {
+    echo $e->getMessage(), "\n";
+}
+--EXPECT--
+string(46) "allocated_by,freed_by,memory_size,blocks_count"
+int(1)
+bool(true)
+string(1) "1"
+bool(true)
+int(1)
+memprof_dump_free_sites(): unknown format, expected one of callgrind, csv
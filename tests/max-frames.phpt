@@ -0,0 +1,37 @@
+--TEST--
+memprof.max_frames
+--ENV--
+MEMPROF_PROFILE=1
+--INI--
+memprof.max_frames=4
+--FILE--
+<?php
+
+function a() { return b(); }
+function b() { return c(); }
+function c() { return d(); }
+function d() { return str_repeat('X', 1024 * 1024); }
+
+// The main script, a, b, and c use up the budget
+$a = a();
+
+function paths($frame, $path, &$out) {
+    foreach ($frame['called_functions'] as $fn => $child) {
+        $out[] = "$path;$fn";
+        paths($child, "$path;$fn", $out);
+    }
+}
+
+$paths = [];
+paths(memprof_dump_array(), 'root', $paths);
+foreach ($paths as $path) {
+    $path = preg_replace('/^root;[^;]*/', 'root;main', $path);
+    if (strpos($path, ';a') !== false) {
+        echo $path, "\n";
+    }
+}
+--EXPECT--
+root;main;a
+root;main;a;b
+root;main;a;b;c
+root;main;a;b;c;[truncated]
@@ -0,0 +1,43 @@
+--TEST--
+memprof.min_tracked_size
+--ENV--
+MEMPROF_PROFILE=1
+--INI--
+memprof.min_tracked_size=65536
+--FILE--
+<?php
+
+function totals($frame, &$size, &$count) {
+    $size += $frame['memory_size'];
+    $count += $frame['blocks_count'];
+    foreach ($frame['called_functions'] as $child) {
+        totals($child, $size, $count);
+    }
+}
+
+$small = [];
+for ($i = 0; $i < 1000; $i++) {
+    $small[] = str_repeat('x', 100 + $i % 10);
+}
+
+$big = str_repeat('X', 1024 * 1024);
+
+$dump = memprof_dump_array();
+
+$size = 0;
+$count = 0;
+totals($dump, $size, $count);
+
+var_dump($dump['min_tracked_size']);
+var_dump($size >= 1024 * 1024);
+var_dump($count < 10);
+
+$fd = fopen('php://memory', 'w+');
+memprof_dump_callgrind($fd);
+rewind($fd);
+var_dump(strpos(stream_get_contents($fd), "# min_tracked_size: 65536\n") !== false);
+--EXPECT--
+int(65536)
+bool(true)
+bool(true)
+bool(true)
@@ -0,0 +1,57 @@
+--TEST--
+memprof.passthrough_functions / memprof.collapse_namespaces
+--ENV--
+MEMPROF_PROFILE=1
+--INI--
+memprof.passthrough_functions=call_user_func, pipeline::handle
+memprof.collapse_namespaces=\App\Middleware
+--FILE--
+<?php
+
+namespace App\Middleware {
+    function wrap($f) {
+        return $f();
+    }
+}
+
+namespace App\MiddlewareFactory {
+    function wrap($f) {
+        return $f();
+    }
+}
+
+namespace {
+    class Pipeline {
+        public static function handle($f) {
+            return $f();
+        }
+    }
+
+    function work() {
+        return str_repeat('X', 1024 * 1024);
+    }
+
+    function paths($frame, $path, &$out) {
+        foreach ($frame['called_functions'] as $fn => $child) {
+            $out["$path;$fn"] = $child['calls'];
+            paths($child, "$path;$fn", $out);
+        }
+    }
+
+    $a = Pipeline::handle('work');
+    $b = App\Middleware\wrap('work');
+    $c = call_user_func('work');
+    $d = App\MiddlewareFactory\wrap('work');
+
+    $paths = [];
+    paths(memprof_dump_array(), 'root', $paths);
+    foreach ($paths as $path => $calls) {
+        $path = preg_replace('/^root;[^;]*/', 'root;main', $path);
+        if (strpos($path, 'work') !== false && strpos($path, 'str_repeat') === false) {
+            echo "$path $calls\n";
+        }
+    }
+}
+--EXPECT--
+root;main;work 3
+root;main;App\MiddlewareFactory\wrap;work 1
@@ -0,0 +1,55 @@
+--TEST--
+memprof_pause() / memprof_resume()
+--ENV--
+MEMPROF_PROFILE=1
+--FILE--
+<?php
+
+require __DIR__ . '/common.php';
+
+function size() {
+    $dump = memprof_dump_array();
+    return round($dump['memory_size_inclusive'] / (1024 * 1024)) . "MB\n";
+}
+
+$a = eat();
+echo size();
+
+var_dump(memprof_pause());
+
+$b = eat();
+echo size();
+
+// Blocks tracked before the pause are still accounted for when freed
+unset($a);
+echo size();
+
+try {
+    memprof_pause();
+} catch (Exception $e) {
+    echo $e->getMessage(), "\n";
+}
+
+var_dump(memprof_resume());
+
+$c = eat();
+echo size();
+
+unset($b);
+echo size();
+
+try {
+    memprof_resume();
+} catch (Exception $e) {
+    echo $e->getMessage(), "\n";
+}
+--EXPECT--
+3MB
+bool(true)
+3MB
+0MB
+memprof_pause(): memprof is already paused
+bool(true)
+3MB
+3MB
+memprof_resume(): memprof is not paused
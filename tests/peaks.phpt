@@ -0,0 +1,59 @@
+--TEST--
+Peak memory sizes
+--ENV--
+MEMPROF_PROFILE=1
+--FILE--
+<?php
+
+function temp() {
+    $a = str_repeat('x', 4 * 1024 * 1024);
+    $b = str_repeat('y', 4 * 1024 * 1024);
+    return strlen($a . $b);
+}
+
+function outer() {
+    return temp();
+}
+
+outer();
+
+$fd = fopen('php://memory', 'w+');
+memprof_dump_callgrind($fd);
+rewind($fd);
+$lines = explode("\n", stream_get_contents($fd));
+
+$fn = null;
+$cfn = null;
+$self = [];
+$calls = [];
+foreach ($lines as $line) {
+    if (preg_match('/^fn=(.*)/', $line, $m)) {
+        $fn = $m[1];
+        $cfn = null;
+    } else if (preg_match('/^cfn=(.*)/', $line, $m)) {
+        $cfn = $m[1];
+    } else if (preg_match('/^1 (\d+) (\d+) (\d+)$/', $line, $m)) {
+        if ($cfn === null) {
+            $self[$fn] = [(int) $m[1], (int) $m[3]];
+        } else {
+            $calls[$fn][$cfn] = (int) $m[3];
+        }
+    }
+}
+
+// Nothing is live anymore
+var_dump($self['temp'][0]);
+// but temp() held at least 8MB, and outer() 16MB through temp()
+var_dump($self['temp'][1] >= 8 * 1024 * 1024);
+var_dump($calls['outer']['temp'] >= 16 * 1024 * 1024);
+var_dump($self['outer'][1] < 1024 * 1024);
+
+$fd = fopen('php://memory', 'w+');
+memprof_dump_pprof($fd, true);
+var_dump(ftell($fd) > 0);
+--EXPECT--
+int(0)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
@@ -0,0 +1,46 @@
+--TEST--
+memprof.realloc_growth
+--ENV--
+MEMPROF_PROFILE=1
+--INI--
+memprof.realloc_growth=1
+--FILE--
+<?php
+
+function a() {
+    return str_repeat('x', 100000);
+}
+
+function b(&$s) {
+    $s .= str_repeat('y', 200000);
+}
+
+function sizes($frame, &$out) {
+    foreach ($frame['called_functions'] as $fn => $child) {
+        $out[$fn] = ($out[$fn] ?? 0) + $child['memory_size'];
+        sizes($child, $out);
+    }
+}
+
+$s = a();
+b($s);
+
+$sizes = [];
+sizes(memprof_dump_array(), $sizes);
+
+// a keeps the bytes it allocated, b gets the growth
+var_dump($sizes['a'] >= 100000 && $sizes['a'] < 200000);
+var_dump($sizes['b'] >= 200000 && $sizes['b'] < 300000);
+
+unset($s);
+
+$sizes = [];
+sizes(memprof_dump_array(), $sizes);
+
+var_dump($sizes['a'] < 100000);
+var_dump($sizes['b'] < 200000);
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
@@ -0,0 +1,14 @@
+--TEST--
+memprof.request_sample_rate
+--INI--
+memprof.request_sample_rate=1
+memprof.request_sample_dump=0
+memprof.request_sample_filter=/nonexistent/*, *request-sampling.php
+--FILE--
+<?php
+
+var_dump(memprof_enabled());
+var_dump(memprof_enabled_flags()['native']);
+--EXPECT--
+bool(true)
+bool(false)
@@ -0,0 +1,29 @@
+--TEST--
+memprof.retainers_max_nodes
+--INI--
+memprof.retainers_max_nodes=5
+--FILE--
+<?php
+
+$list = [];
+for ($i = 0; $i < 100; $i++) {
+    $list[] = [new stdClass];
+}
+
+$rows = memprof_retainers(100, $truncated);
+var_dump($truncated);
+var_dump(count($rows) <= 5);
+var_dump($rows[0]['path']);
+
+ini_set('memprof.retainers_max_nodes', 0);
+$rows = memprof_retainers(1000, $truncated);
+var_dump($truncated);
+var_dump(count($rows) > 200);
+var_dump($rows[0]['path']);
+--EXPECT--
+bool(true)
+bool(true)
+string(5) "$list"
+bool(false)
+bool(true)
+string(5) "$list"
@@ -0,0 +1,81 @@
+--TEST--
+memprof_retainers()
+--FILE--
+<?php
+
+gc_disable();
+
+class Cache {
+    public static $items = [];
+}
+
+class Item {
+    public $data;
+    public function __construct($n) {
+        $this->data = str_repeat('x', $n);
+    }
+}
+
+function memo() {
+    static $memo;
+    $memo = [new Item(10)];
+}
+
+for ($i = 0; $i < 10; $i++) {
+    Cache::$items["k$i"] = new Item(100000);
+}
+$list = ['a' => ['b' => new Item(2000000)]];
+memo();
+
+// A garbage cycle is only reachable from the objects store
+$cycle = new stdClass;
+$cycle->self = $cycle;
+$cycle->data = str_repeat('x', 3000000);
+unset($cycle);
+
+$top = memprof_retainers(4);
+foreach ($top as $row) {
+    echo $row['type'], ' ', $row['class'] ?? '-', ' ', $row['root'], ' ', $row['path'], "\n";
+}
+var_dump($top[1]['retained_size'] > $top[2]['retained_size']);
+var_dump($top[3]['retained_size'] > 2000000);
+var_dump($top[1]['memory_size'] < 1000);
+
+$roots = array_column(memprof_retainers(100), 'root', 'path');
+var_dump($roots['Cache::$items'] ?? null);
+var_dump($roots['Cache::$items["k3"]'] ?? null);
+var_dump($roots['memo()::$memo'] ?? null);
+
+// Values held by several nodes are not retained by any of them
+$shared = new Item(4000000);
+$x1 = [$shared];
+$x2 = [$shared];
+foreach (memprof_retainers(100) as $row) {
+    if ($row['path'] === '$x1') {
+        var_dump($row['retained_size'] < 1000);
+    }
+}
+
+function stack() {
+    $local = [str_repeat('y', 5000000)];
+    return memprof_retainers(1)[0];
+}
+$row = stack();
+echo $row['root'], ' ', $row['path'], "\n";
+
+var_dump(memprof_retainers(0));
+--EXPECTF--
+object stdClass objects store object(stdClass)#%d
+array - global $list
+array - global $list["a"]
+object Item global $list["a"]["b"]
+bool(true)
+bool(true)
+bool(true)
+string(15) "static property"
+string(15) "static property"
+string(15) "static variable"
+bool(true)
+stack stack()::$local
+array(0) {
+}
@@ -0,0 +1,52 @@
+--TEST--
+memprof_scope_push() / memprof_scope_pop()
+--ENV--
+MEMPROF_PROFILE=1
+--FILE--
+<?php
+
+require __DIR__ . '/common.php';
+
+memprof_scope_push('tenant-a');
+$a = eat();
+memprof_scope_push('tenant-b');
+$b = eat();
+$c = eat();
+var_dump(memprof_scope_pop());
+$d = eat();
+var_dump(memprof_scope_pop());
+$e = eat();
+
+try {
+    memprof_scope_pop();
+} catch (Exception $ex) {
+    echo $ex->getMessage(), "\n";
+}
+
+$dump = memprof_dump_array();
+foreach ($dump['labels'] as $label => $info) {
+    printf("%s: %dMB %d\n", $label, round($info['memory_size'] / (1024 * 1024)), $info['blocks_count'] >= 2);
+}
+
+$fd = fopen('php://memory', 'w+');
+memprof_dump_folded($fd);
+rewind($fd);
+foreach (explode("\n", stream_get_contents($fd)) as $line) {
+    if (preg_match('/;eat;str_repeat;\[label\] (\S+) (\d+)$/', $line, $m)) {
+        printf("folded %s: %dMB\n", $m[1], round($m[2] / (1024 * 1024)));
+    }
+}
+
+$fd = fopen('php://memory', 'w+');
+memprof_dump_callgrind($fd);
+rewind($fd);
+echo implode("\n", preg_grep('/^# label/', explode("\n", stream_get_contents($fd)))) === '' ? "no labels\n" : "labels\n";
+--EXPECT--
+string(8) "tenant-b"
+string(8) "tenant-a"
+memprof_scope_pop(): no scope was pushed
+tenant-a: 6MB 1
+tenant-b: 6MB 1
+folded tenant-a: 6MB
+folded tenant-b: 6MB
+labels
@@ -0,0 +1,70 @@
+--TEST--
+memprof_dump_snapshot() and memprof_convert_snapshots()
+--ENV--
+MEMPROF_PROFILE=1
+--FILE--
+<?php
+
+require __DIR__ . '/common.php';
+
+$a = eat();
+$b = Eater::eat();
+
+$path = tempnam(sys_get_temp_dir(), 'memprof');
+memprof_dump_snapshot(fopen($path, 'w'));
+
+function convert($paths, $format) {
+    $fd = fopen('php://memory', 'w+');
+    memprof_convert_snapshots($paths, $fd, $format);
+    rewind($fd);
+    return stream_get_contents($fd);
+}
+
+function eater_size($folded) {
+    foreach (explode("\n", $folded) as $line) {
+        if (preg_match('/;Eater::eat (\d+)$/', $line, $m)) {
+            return (int) $m[1];
+        }
+    }
+}
+
+$size = eater_size(convert([$path], 'folded'));
+var_dump($size >= 8 * 1024 * 1024);
+
+// Merged snapshots are summed
+var_dump(eater_size(convert([$path, $path], 'folded')) === 2 * $size);
+
+$json = json_decode(convert([$path], 'json'), true);
+var_dump($json['name']);
+var_dump(is_array($json['called_functions']));
+
+var_dump(strpos(convert([$path], 'callgrind'), "events: MemorySize BlocksCount PeakMemorySize\n") === 0);
+
+// A merged snapshot converts the same
+$merged = tempnam(sys_get_temp_dir(), 'memprof');
+file_put_contents($merged, convert([$path, $path], 'snapshot'));
+var_dump(eater_size(convert([$merged], 'folded')) === 2 * $size);
+
+try {
+    convert([__FILE__], 'folded');
+} catch (Exception $e) {
+    echo str_replace(__FILE__, 'FILE', $e->getMessage()), "\n";
+}
+
+try {
+    convert([$path], 'xml');
+} catch (Exception $e) {
+    echo $e->getMessage(), "\n";
+}
+
+unlink($path);
+unlink($merged);
+--EXPECT--
+bool(true)
+bool(true)
+string(4) "root"
+bool(true)
+bool(true)
+bool(true)
+memprof_convert_snapshots(): FILE is not a readable snapshot
+memprof_convert_snapshots(): unknown format, expected one of callgrind, pprof, folded, snapshot, json
@@ -0,0 +1,55 @@
+--TEST--
+memprof_top()
+--ENV--
+MEMPROF_PROFILE=1
+--FILE--
+<?php
+
+function rec($n) {
+    if ($n > 0) {
+        return rec($n - 1);
+    }
+    return str_repeat('X', 1024 * 1024);
+}
+
+$a = rec(5);
+
+$top = memprof_top(1);
+var_dump(count($top));
+var_dump($top[0]['function']);
+var_dump($top[0]['memory_size'] >= 1024 * 1024);
+
+// Recursive calls are not counted twice
+foreach (memprof_top(100, 'inclusive') as $row) {
+    if ($row['function'] === 'rec') {
+        var_dump($row['calls']);
+        var_dump($row['memory_size_inclusive'] >= 1024 * 1024);
+        var_dump($row['memory_size_inclusive'] < 2 * 1024 * 1024);
+    }
+}
+
+$top = memprof_top(100, 'blocks');
+var_dump($top[0]['blocks_count'] >= $top[count($top) - 1]['blocks_count']);
+
+// The root frame is not a function
+var_dump(in_array('root', array_column($top, 'function'), true));
+
+var_dump(memprof_top(0));
+
+try {
+    memprof_top(1, 'peak');
+} catch (Exception $e) {
+    echo $e->getMessage(), "\n";
+}
+--EXPECT--
+int(1)
+string(10) "str_repeat"
+bool(true)
+int(6)
+bool(true)
+bool(true)
+bool(true)
+bool(false)
+array(0) {
+}
+memprof_top(): unknown sort key, expected one of self, inclusive, blocks
@@ -0,0 +1,65 @@
+--TEST--
+MEMPROF_PROFILE=trace: fiber switches
+--SKIPIF--
+<?php PHP_VERSION_ID >= 80100 || die("skip Fibers require PHP 8.1");
+--ENV--
+MEMPROF_PROFILE=trace
+--INI--
+memprof.output_dir={PWD}
+--FILE--
+<?php
+
+function work() {
+    $x = str_repeat('x', 2 * 1024 * 1024);
+    Fiber::suspend();
+    $y = str_repeat('y', 2 * 1024 * 1024);
+    Fiber::suspend();
+    return [$x, $y];
+}
+
+function starter($fiber) {
+    $fiber->start();
+}
+
+function resumer($fiber) {
+    $fiber->resume();
+}
+
+$fiber = new Fiber('work');
+starter($fiber);
+resumer($fiber);
+resumer($fiber);
+$result = $fiber->getReturn();
+
+$files = glob(__DIR__ . '/memprof.trace.*');
+
+function tool($args) {
+    global $files;
+    $cmd = escapeshellarg(PHP_BINARY) . ' -n ' . escapeshellarg(__DIR__ . '/../memprof-trace')
+        . " $args " . escapeshellarg($files[0]);
+    exec($cmd, $lines);
+    return $lines;
+}
+
+$summary = [];
+foreach (tool('-s') as $line) {
+    list($key, $value) = explode(': ', $line);
+    $summary[$key] = (int) $value;
+}
+var_dump($summary['fiber_contexts']);
+var_dump($summary['fiber_switches']);
+
+// Both blocks are attributed to the fiber, not to resumer()
+$size = 0;
+foreach (tool('') as $line) {
+    if (preg_match('/;starter;Fiber::start;work;str_repeat (\d+)$/', $line, $m)) {
+        $size += $m[1];
+    }
+}
+printf("work: %dMB\n", round($size / (1024 * 1024)));
+
+unlink($files[0]);
+--EXPECT--
+int(2)
+int(6)
+work: 4MB
@@ -0,0 +1,79 @@
+--TEST--
+MEMPROF_PROFILE=trace
+--ENV--
+MEMPROF_PROFILE=trace
+--INI--
+memprof.output_dir={PWD}
+--FILE--
+<?php
+
+require __DIR__ . '/common.php';
+
+var_dump(memprof_enabled_flags()['trace']);
+
+function churn() {
+    for ($i = 0; $i < 1000; $i++) {
+        $tmp = str_repeat('x', 100 + $i);
+    }
+}
+
+churn();
+$a = eat();
+$b = eat();
+unset($b);
+
+$files = glob(__DIR__ . '/memprof.trace.*');
+var_dump(count($files));
+
+function tool($args) {
+    global $files;
+    $cmd = escapeshellarg(PHP_BINARY) . ' -n ' . escapeshellarg(__DIR__ . '/../memprof-trace')
+        . " $args " . escapeshellarg($files[0]);
+    exec($cmd, $lines);
+    return $lines;
+}
+
+function eaten($lines) {
+    $size = 0;
+    foreach ($lines as $line) {
+        if (preg_match('/;eat;str_repeat (\d+)$/', $line, $m)) {
+            $size += $m[1];
+        }
+    }
+    return round($size / (1024 * 1024));
+}
+
+$summary = [];
+foreach (tool('-s') as $line) {
+    list($key, $value) = explode(': ', $line);
+    $summary[$key] = (int) $value;
+}
+var_dump($summary['events'] > 2000);
+var_dump($summary['peak'] >= 6 * 1024 * 1024);
+
+printf("live: %dMB\n", eaten(tool('')));
+printf("peak: %dMB\n", eaten(tool('-p')));
+printf("start: %dMB\n", eaten(tool('-e 1')));
+
+$callgrind = implode("\n", tool('-f callgrind'));
+var_dump(strpos($callgrind, "fn=str_repeat\n") !== false);
+
+foreach (tool('-l') as $line) {
+    $fields = explode("\t", $line);
+    if (preg_match('/;churn;str_repeat$/', $fields[0])) {
+        var_dump((int) $fields[1] >= 1000, (int) $fields[2]);
+    }
+}
+
+unlink($files[0]);
+--EXPECT--
+bool(true)
+int(1)
+bool(true)
+bool(true)
+live: 3MB
+peak: 6MB
+start: 0MB
+bool(true)
+bool(true)
+int(0)
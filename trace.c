@@ -0,0 +1,140 @@
+/*
+  +----------------------------------------------------------------------+
+  | Memprof                                                              |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2012-2013 Arnaud Le Blanc                              |
+  +----------------------------------------------------------------------+
+  | Redistribution and use in source and binary forms, with or without   |
+  | modification, are permitted provided that the conditions mentioned   |
+  | in the accompanying LICENSE file are met.                            |
+  +----------------------------------------------------------------------+
+  | Author: Arnaud Le Blanc <arnaud.lb@gmail.com>                        |
+  +----------------------------------------------------------------------+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php.h"
+#include "trace.h"
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Maps the window starting at the page that contains offset */
+static zend_bool trace_map(memprof_trace * t, uint64_t offset)
+{
+	uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+	uint64_t map_off = offset & ~(page - 1);
+	void * map;
+
+	if (ftruncate(t->fd, map_off + TRACE_WINDOW_SIZE) != 0) {
+		return 0;
+	}
+
+	map = mmap(NULL, TRACE_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, map_off);
+	if (map == MAP_FAILED) {
+		return 0;
+	}
+
+	t->map = map;
+	t->map_off = map_off;
+	t->pos = offset - map_off;
+
+	return 1;
+}
+
+/* Moves the window to the write position. On failure, the trace stops and
+ * the file ends at the last complete event written. */
+zend_bool trace_advance(memprof_trace * t)
+{
+	uint64_t offset = t->map_off + t->pos;
+
+	munmap(t->map, TRACE_WINDOW_SIZE);
+	t->map = NULL;
+
+	return trace_map(t, offset);
+}
+
+zend_bool trace_open(memprof_trace * t, const char * path)
+{
+	struct timeval tv;
+
+	memset(t, 0, sizeof(*t));
+
+	t->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (t->fd == -1) {
+		return 0;
+	}
+
+	if (!trace_map(t, 0)) {
+		close(t->fd);
+		t->fd = -1;
+		return 0;
+	}
+
+	gettimeofday(&tv, NULL);
+
+	memcpy(t->map, TRACE_MAGIC, sizeof(TRACE_MAGIC)-1);
+	t->pos = sizeof(TRACE_MAGIC)-1;
+	t->map[t->pos++] = TRACE_VERSION;
+	/* Start time, in microseconds */
+	trace_put_varint(t, (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec);
+
+	trace_frame(t, 0, "root", sizeof("root")-1);
+
+	return 1;
+}
+
+/* Truncates the file to the events written */
+void trace_close(memprof_trace * t)
+{
+	if (t->fd == -1) {
+		return;
+	}
+
+	if (t->map != NULL) {
+		munmap(t->map, TRACE_WINDOW_SIZE);
+		t->map = NULL;
+	}
+
+	if (ftruncate(t->fd, t->map_off + t->pos) != 0) {
+		/* The end of the stream is still marked by zeros */
+	}
+
+	close(t->fd);
+	t->fd = -1;
+}
+
+/* Declares a frame. Returns its id. */
+uint32_t trace_frame(memprof_trace * t, uint32_t parent, const char * name, size_t name_len)
+{
+	uint32_t id = ++t->frames;
+
+	if (!trace_reserve(t)) {
+		return id;
+	}
+
+	t->map[t->pos++] = TRACE_EVENT_FRAME;
+	trace_put_varint(t, parent);
+	trace_put_varint(t, name_len);
+
+	while (name_len > 0) {
+		size_t n;
+
+		if (t->pos == TRACE_WINDOW_SIZE && !trace_advance(t)) {
+			break;
+		}
+
+		n = MIN(name_len, TRACE_WINDOW_SIZE - t->pos);
+		memcpy(t->map + t->pos, name, n);
+		t->pos += n;
+		name += n;
+		name_len -= n;
+	}
+
+	return id;
+}
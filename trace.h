@@ -0,0 +1,137 @@
+/*
+  +----------------------------------------------------------------------+
+  | Memprof                                                              |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2012-2013 Arnaud Le Blanc                              |
+  +----------------------------------------------------------------------+
+  | Redistribution and use in source and binary forms, with or without   |
+  | modification, are permitted provided that the conditions mentioned   |
+  | in the accompanying LICENSE file are met.                            |
+  +----------------------------------------------------------------------+
+  | Author: Arnaud Le Blanc <arnaud.lb@gmail.com>                        |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef MEMPROF_TRACE_H
+#define MEMPROF_TRACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define TRACE_MAGIC "MPTR"
+#define TRACE_VERSION 2
+
+/* A trace is a stream of events, each a tag byte followed by unsigned
+ * varints. Addresses are encoded as the zigzagged difference with the
+ * previous address of the stream. Frames are numbered from 1 in the order
+ * they are declared; frame 1 is the root. A zero byte ends the stream: the
+ * file is extended by zero filled windows. */
+#define TRACE_EVENT_END		0
+#define TRACE_EVENT_ALLOC	'A'	/* addr, size */
+#define TRACE_EVENT_FREE	'F'	/* addr */
+#define TRACE_EVENT_REALLOC	'R'	/* old addr, new addr - old addr, size */
+#define TRACE_EVENT_FRAME	'N'	/* parent id, name length, name */
+#define TRACE_EVENT_ENTER	'E'	/* id */
+#define TRACE_EVENT_EXIT	'X'	/* id of the frame returned to */
+#define TRACE_EVENT_SWITCH	'S'	/* context id, id of the frame switched to */
+
+/* The file is written through a window of this size, remapped further as
+ * it fills up */
+#define TRACE_WINDOW_SIZE (8*1024*1024)
+
+/* Room for a tag and three varints */
+#define TRACE_EVENT_MAX_SIZE 32
+
+typedef struct _memprof_trace {
+	int fd;
+	unsigned char * map;	/* NULL if the trace is closed or failed */
+	uint64_t map_off;		/* file offset of map */
+	size_t pos;				/* write position in map */
+	uintptr_t last_addr;
+	uint32_t frames;		/* number of declared frames */
+	uint32_t contexts;		/* number of fiber contexts switched to */
+} memprof_trace;
+
+zend_bool trace_open(memprof_trace * t, const char * path);
+void trace_close(memprof_trace * t);
+zend_bool trace_advance(memprof_trace * t);
+uint32_t trace_frame(memprof_trace * t, uint32_t parent, const char * name, size_t name_len);
+
+/* Makes room for an event. Events are dropped once remapping failed. */
+static zend_always_inline zend_bool trace_reserve(memprof_trace * t)
+{
+	if (EXPECTED(t->pos <= TRACE_WINDOW_SIZE - TRACE_EVENT_MAX_SIZE)) {
+		return t->map != NULL;
+	}
+	return t->map != NULL && trace_advance(t);
+}
+
+static zend_always_inline void trace_put_varint(memprof_trace * t, uint64_t v)
+{
+	unsigned char * p = t->map + t->pos;
+
+	while (v >= 0x80) {
+		*p++ = (unsigned char) v | 0x80;
+		v >>= 7;
+	}
+	*p++ = (unsigned char) v;
+
+	t->pos = p - t->map;
+}
+
+static zend_always_inline void trace_put_addr(memprof_trace * t, const void * ptr, uintptr_t * base)
+{
+	int64_t delta = (int64_t) ((uintptr_t) ptr - *base);
+
+	trace_put_varint(t, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+	*base = (uintptr_t) ptr;
+}
+
+static zend_always_inline void trace_alloc(memprof_trace * t, const void * ptr, size_t size)
+{
+	if (trace_reserve(t)) {
+		t->map[t->pos++] = TRACE_EVENT_ALLOC;
+		trace_put_addr(t, ptr, &t->last_addr);
+		trace_put_varint(t, size);
+	}
+}
+
+static zend_always_inline void trace_free(memprof_trace * t, const void * ptr)
+{
+	if (trace_reserve(t)) {
+		t->map[t->pos++] = TRACE_EVENT_FREE;
+		trace_put_addr(t, ptr, &t->last_addr);
+	}
+}
+
+static zend_always_inline void trace_realloc(memprof_trace * t, const void * ptr, const void * result, size_t size)
+{
+	if (trace_reserve(t)) {
+		t->map[t->pos++] = TRACE_EVENT_REALLOC;
+		trace_put_addr(t, ptr, &t->last_addr);
+		trace_put_addr(t, result, &t->last_addr);
+		trace_put_varint(t, size);
+	}
+}
+
+/* ENTER and EXIT */
+static zend_always_inline void trace_call(memprof_trace * t, unsigned char event, uint32_t id)
+{
+	if (trace_reserve(t)) {
+		t->map[t->pos++] = event;
+		trace_put_varint(t, id);
+	}
+}
+
+/* Fiber switch. Contexts are numbered from 1 in the order they are first
+ * switched to or from. */
+static zend_always_inline void trace_switch(memprof_trace * t, uint32_t context, uint32_t id)
+{
+	if (trace_reserve(t)) {
+		t->map[t->pos++] = TRACE_EVENT_SWITCH;
+		trace_put_varint(t, context);
+		trace_put_varint(t, id);
+	}
+}
+
+#endif /* MEMPROF_TRACE_H */
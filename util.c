@@ -13,30 +13,7 @@
 */
 
 #include "php.h"
-#include <stdarg.h>
-
-zend_bool stream_printf(php_stream * stream, const char * format, ...)
-{
-	char * buf;
-	va_list ap;
-	int len;
-	zend_bool result;
-
-	va_start(ap, format);
-	len = vspprintf(&buf, 0, format, ap);
-	va_end(ap);
-
-	result = php_stream_write(stream, buf, len) == len;
-
-	efree(buf);
-
-	return result;
-}
-
-zend_bool stream_write_word(php_stream * stream, zend_uintptr_t word)
-{
-	return php_stream_write(stream, (char*) &word, sizeof(word)) == sizeof(word);
-}
+#include <stdio.h>
 
 size_t get_function_name(zend_execute_data * execute_data, char * buf, size_t buf_size)
 {
@@ -110,3 +87,152 @@ size_t get_function_name(zend_execute_data * execute_data, char * buf, size_t bu
 	return len >= buf_size ? buf_size-1 : len;
 }
 
+
+static FILE * cgroup_fopen(const char * dir, const char * name)
+{
+	char path[MAXPATHLEN];
+
+	if ((size_t) snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path)) {
+		return NULL;
+	}
+
+	return fopen(path, "r");
+}
+
+/* Finds the cgroup v2 directory of the current process */
+zend_bool cgroup_detect_dir(char * buf, size_t buf_size)
+{
+	char line[MAXPATHLEN];
+	zend_bool found = 0;
+	FILE * fp = fopen("/proc/self/cgroup", "r");
+
+	if (fp == NULL) {
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		/* The unified hierarchy is the one with id 0 and no controllers */
+		if (strncmp(line, "0::", 3) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			found = (size_t) snprintf(buf, buf_size, "/sys/fs/cgroup%s", line+3) < buf_size;
+			break;
+		}
+	}
+
+	fclose(fp);
+
+	return found;
+}
+
+/* Reads memory.current and memory.max. *max is set to 0 if there is no
+ * limit. */
+zend_bool cgroup_read_memory(const char * dir, uint64_t * current, uint64_t * max)
+{
+	char value[32];
+	unsigned long long ull;
+	FILE * fp;
+
+	fp = cgroup_fopen(dir, "memory.current");
+	if (fp == NULL) {
+		return 0;
+	}
+	if (fscanf(fp, "%llu", &ull) != 1) {
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	*current = ull;
+
+	fp = cgroup_fopen(dir, "memory.max");
+	if (fp == NULL) {
+		return 0;
+	}
+	if (fscanf(fp, "%31s", value) != 1) {
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+
+	if (strcmp(value, "max") == 0) {
+		*max = 0;
+	} else {
+		*max = strtoull(value, NULL, 10);
+	}
+
+	return 1;
+}
+
+/* Returns the number of times the cgroup reached its high or max boundary,
+ * or ran out of memory, according to memory.events */
+zend_bool cgroup_read_memory_events(const char * dir, uint64_t * events)
+{
+	char key[32];
+	unsigned long long value;
+	uint64_t total = 0;
+	FILE * fp = cgroup_fopen(dir, "memory.events");
+
+	if (fp == NULL) {
+		return 0;
+	}
+
+	while (fscanf(fp, "%31s %llu", key, &value) == 2) {
+		if (strcmp(key, "high") == 0 || strcmp(key, "max") == 0 || strcmp(key, "oom") == 0) {
+			total += value;
+		}
+	}
+
+	fclose(fp);
+
+	*events = total;
+
+	return 1;
+}
+
+static zend_bool process_rss(pid_t pid, unsigned long * rss)
+{
+	char path[64];
+	FILE * fp;
+	int n;
+
+	snprintf(path, sizeof(path), "/proc/%ld/statm", (long) pid);
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return 0;
+	}
+
+	n = fscanf(fp, "%*lu %lu", rss);
+	fclose(fp);
+
+	return n == 1;
+}
+
+/* Returns the number of processes of the cgroup that have a larger resident
+ * set than pid */
+size_t cgroup_process_rank(const char * dir, pid_t pid)
+{
+	unsigned long rss;
+	unsigned long other_rss;
+	long other;
+	size_t rank = 0;
+	FILE * fp;
+
+	if (!process_rss(pid, &rss)) {
+		return 0;
+	}
+
+	fp = cgroup_fopen(dir, "cgroup.procs");
+	if (fp == NULL) {
+		return 0;
+	}
+
+	while (fscanf(fp, "%ld", &other) == 1) {
+		if ((pid_t) other != pid && process_rss((pid_t) other, &other_rss) && other_rss > rss) {
+			rank++;
+		}
+	}
+
+	fclose(fp);
+
+	return rank;
+}
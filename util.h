@@ -12,8 +12,10 @@
   +----------------------------------------------------------------------+
 */
 
-zend_bool stream_printf(php_stream * stream, const char * format, ...);
-zend_bool stream_write_word(php_stream * stream, zend_uintptr_t word);
-
 size_t get_function_name(zend_execute_data * execute_data, char * buf, size_t buf_size);
 
+zend_bool cgroup_detect_dir(char * buf, size_t buf_size);
+zend_bool cgroup_read_memory(const char * dir, uint64_t * current, uint64_t * max);
+zend_bool cgroup_read_memory_events(const char * dir, uint64_t * events);
+size_t cgroup_process_rank(const char * dir, pid_t pid);
+
@@ -0,0 +1,301 @@
+/*
+  +----------------------------------------------------------------------+
+  | Memprof                                                              |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2012-2013 Arnaud Le Blanc                              |
+  +----------------------------------------------------------------------+
+  | Redistribution and use in source and binary forms, with or without   |
+  | modification, are permitted provided that the conditions mentioned   |
+  | in the accompanying LICENSE file are met.                            |
+  +----------------------------------------------------------------------+
+  | Author: Arnaud Le Blanc <arnaud.lb@gmail.com>                        |
+  +----------------------------------------------------------------------+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php.h"
+#include "php_memprof.h"
+#include "writer.h"
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+
+static zend_bool writer_output_fd(memprof_writer * w, const char * data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(w->fd, data, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			w->error = 1;
+			return 0;
+		}
+		data += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+static zend_bool writer_output(memprof_writer * w, const char * data, size_t len)
+{
+	if (w->stream == NULL) {
+		return writer_output_fd(w, data, len);
+	}
+
+	if (len != 0 && php_stream_write(w->stream, data, len) != len) {
+		w->error = 1;
+		return 0;
+	}
+
+	return 1;
+}
+
+#if HAVE_MEMPROF_ZLIB
+static void writer_flush_gzip(memprof_writer * w, zend_bool finish)
+{
+	int ret;
+
+	w->zstream.next_in = (Bytef *) w->buf;
+	w->zstream.avail_in = w->buf_len;
+
+	do {
+		w->zstream.next_out = (Bytef *) w->out;
+		w->zstream.avail_out = WRITER_BUFFER_SIZE;
+
+		ret = deflate(&w->zstream, finish ? Z_FINISH : Z_NO_FLUSH);
+		if (ret == Z_STREAM_ERROR) {
+			w->error = 1;
+			return;
+		}
+
+		if (!writer_output(w, w->out, WRITER_BUFFER_SIZE - w->zstream.avail_out)) {
+			return;
+		}
+	} while (w->zstream.avail_out == 0);
+}
+#endif
+
+#if HAVE_MEMPROF_ZSTD
+static void writer_flush_zstd(memprof_writer * w, zend_bool finish)
+{
+	ZSTD_inBuffer in = { w->buf, w->buf_len, 0 };
+	size_t remaining;
+
+	do {
+		ZSTD_outBuffer out = { w->out, WRITER_BUFFER_SIZE, 0 };
+
+		remaining = ZSTD_compressStream2(w->zstd, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+		if (ZSTD_isError(remaining)) {
+			w->error = 1;
+			return;
+		}
+
+		if (!writer_output(w, w->out, out.pos)) {
+			return;
+		}
+	} while (finish ? remaining != 0 : in.pos != in.size);
+}
+#endif
+
+static void writer_flush(memprof_writer * w, zend_bool finish)
+{
+	if (w->error) {
+		return;
+	}
+
+	switch (w->compression) {
+#if HAVE_MEMPROF_ZLIB
+		case COMPRESSION_GZIP:
+			writer_flush_gzip(w, finish);
+			break;
+#endif
+#if HAVE_MEMPROF_ZSTD
+		case COMPRESSION_ZSTD:
+			writer_flush_zstd(w, finish);
+			break;
+#endif
+		default:
+			writer_output(w, w->buf, w->buf_len);
+			break;
+	}
+
+	w->buf_len = 0;
+}
+
+zend_bool writer_init(memprof_writer * w, php_stream * stream, memprof_compression compression)
+{
+	w->stream = stream;
+	w->fd = -1;
+	w->own_buf = 1;
+	w->compression = COMPRESSION_NONE;
+	w->error = 0;
+	w->buf = emalloc(WRITER_BUFFER_SIZE);
+	w->buf_len = 0;
+	w->out = NULL;
+
+	switch (compression) {
+		case COMPRESSION_NONE:
+			break;
+#if HAVE_MEMPROF_ZLIB
+		case COMPRESSION_GZIP:
+			memset(&w->zstream, 0, sizeof(w->zstream));
+			/* windowBits=15+16 produces a gzip stream; windowBits and
+			 * memLevel bound the size of the deflate state */
+			if (deflateInit2(&w->zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				w->error = 1;
+				break;
+			}
+			w->compression = COMPRESSION_GZIP;
+			w->out = emalloc(WRITER_BUFFER_SIZE);
+			break;
+#endif
+#if HAVE_MEMPROF_ZSTD
+		case COMPRESSION_ZSTD:
+			w->zstd = ZSTD_createCCtx();
+			if (w->zstd == NULL) {
+				w->error = 1;
+				break;
+			}
+			/* Bound the window size (and the context size) to 1MiB */
+			ZSTD_CCtx_setParameter(w->zstd, ZSTD_c_windowLog, 20);
+			w->compression = COMPRESSION_ZSTD;
+			w->out = emalloc(WRITER_BUFFER_SIZE);
+			break;
+#endif
+		default:
+			w->error = 1;
+			break;
+	}
+
+	return !w->error;
+}
+
+/* Initializes an uncompressed writer on a file descriptor, using buf as
+ * output buffer. buf must have room for WRITER_BUFFER_SIZE bytes. */
+void writer_init_fd(memprof_writer * w, int fd, char * buf)
+{
+	w->stream = NULL;
+	w->fd = fd;
+	w->own_buf = 0;
+	w->compression = COMPRESSION_NONE;
+	w->error = 0;
+	w->buf = buf;
+	w->buf_len = 0;
+	w->out = NULL;
+}
+
+zend_bool writer_write(memprof_writer * w, const char * data, size_t len)
+{
+	while (len > 0 && !w->error) {
+		size_t n = MIN(len, WRITER_BUFFER_SIZE - w->buf_len);
+
+		memcpy(w->buf + w->buf_len, data, n);
+		w->buf_len += n;
+		data += n;
+		len -= n;
+
+		if (w->buf_len == WRITER_BUFFER_SIZE) {
+			writer_flush(w, 0);
+		}
+	}
+
+	return !w->error;
+}
+
+zend_bool writer_printf(memprof_writer * w, const char * format, ...)
+{
+	va_list ap;
+	int len;
+	char * str;
+
+	if (w->error) {
+		return 0;
+	}
+
+	va_start(ap, format);
+	len = vsnprintf(w->buf + w->buf_len, WRITER_BUFFER_SIZE - w->buf_len, format, ap);
+	va_end(ap);
+
+	if (len < 0) {
+		w->error = 1;
+		return 0;
+	}
+
+	if ((size_t) len < WRITER_BUFFER_SIZE - w->buf_len) {
+		w->buf_len += len;
+		return 1;
+	}
+
+	/* Did not fit in the remaining space */
+
+	writer_flush(w, 0);
+	if (w->error) {
+		return 0;
+	}
+
+	if ((size_t) len < WRITER_BUFFER_SIZE) {
+		va_start(ap, format);
+		vsnprintf(w->buf, WRITER_BUFFER_SIZE, format, ap);
+		va_end(ap);
+		w->buf_len = len;
+		return 1;
+	}
+
+	/* Larger than the buffer. Writers using the caller's buffer must not
+	 * allocate. */
+
+	if (!w->own_buf) {
+		w->error = 1;
+		return 0;
+	}
+
+	va_start(ap, format);
+	len = vspprintf(&str, 0, format, ap);
+	va_end(ap);
+
+	writer_write(w, str, len);
+
+	efree(str);
+
+	return !w->error;
+}
+
+zend_bool writer_write_word(memprof_writer * w, zend_uintptr_t word)
+{
+	return writer_write(w, (char*) &word, sizeof(word));
+}
+
+/* Flushes and releases the writer. The stream is not closed. */
+zend_bool writer_close(memprof_writer * w)
+{
+	writer_flush(w, 1);
+
+	switch (w->compression) {
+#if HAVE_MEMPROF_ZLIB
+		case COMPRESSION_GZIP:
+			deflateEnd(&w->zstream);
+			break;
+#endif
+#if HAVE_MEMPROF_ZSTD
+		case COMPRESSION_ZSTD:
+			ZSTD_freeCCtx(w->zstd);
+			break;
+#endif
+		default:
+			break;
+	}
+
+	if (w->out) {
+		efree(w->out);
+	}
+	if (w->own_buf) {
+		efree(w->buf);
+	}
+
+	return !w->error;
+}
@@ -0,0 +1,55 @@
+/*
+  +----------------------------------------------------------------------+
+  | Memprof                                                              |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2012-2013 Arnaud Le Blanc                              |
+  +----------------------------------------------------------------------+
+  | Redistribution and use in source and binary forms, with or without   |
+  | modification, are permitted provided that the conditions mentioned   |
+  | in the accompanying LICENSE file are met.                            |
+  +----------------------------------------------------------------------+
+  | Author: Arnaud Le Blanc <arnaud.lb@gmail.com>                        |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef MEMPROF_WRITER_H
+#define MEMPROF_WRITER_H
+
+#if HAVE_MEMPROF_ZLIB
+#	include <zlib.h>
+#endif
+#if HAVE_MEMPROF_ZSTD
+#	include <zstd.h>
+#endif
+
+/* Size of the output buffer, and of the compressed output buffer */
+#define WRITER_BUFFER_SIZE (64*1024)
+
+/* A buffered, optionally compressing, stream writer. Memory usage is
+ * bounded: besides the two buffers, compression state has a fixed size.
+ * A writer initialized with writer_init_fd() doesn't allocate at all. */
+typedef struct _memprof_writer {
+	php_stream * stream;
+	int fd;					/* used when stream is NULL */
+	zend_bool own_buf;
+	memprof_compression compression;
+	zend_bool error;
+	char * buf;
+	size_t buf_len;
+	char * out;
+#if HAVE_MEMPROF_ZLIB
+	z_stream zstream;
+#endif
+#if HAVE_MEMPROF_ZSTD
+	ZSTD_CCtx * zstd;
+#endif
+} memprof_writer;
+
+zend_bool writer_init(memprof_writer * w, php_stream * stream, memprof_compression compression);
+void writer_init_fd(memprof_writer * w, int fd, char * buf);
+zend_bool writer_write(memprof_writer * w, const char * data, size_t len);
+zend_bool writer_printf(memprof_writer * w, const char * format, ...);
+zend_bool writer_write_word(memprof_writer * w, zend_uintptr_t word);
+zend_bool writer_close(memprof_writer * w);
+
+#endif /* MEMPROF_WRITER_H */